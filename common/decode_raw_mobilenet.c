@@ -1,48 +1,337 @@
 #include "decode_raw_mobilenet.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define RECORD_HALVES       7
+#define RECORD_HEADER       0
+#define RECORD_LABEL        1
+#define RECORD_CONFIDENCE   2
+#define RECORD_X_MIN        3
+#define RECORD_Y_MIN        4
+#define RECORD_X_MAX        5
+#define RECORD_Y_MAX        6
+
+// -1.0 in half precision, ends the list of detections
+#define HEADER_END          ((half) 0xBC00)
+// +Inf, positive NaNs are above it
+#define HALF_INFINITY       0x7C00
+
+// records tested per iteration
+#define DECODE_BLOCK        8
+
 float f16Tof32(half f16){
-    _float16_shape_type test_float16;
-    test_float16.words.msw = ((char*)&f16)[0];
-    test_float16.words.lsw = ((char*)&f16)[1];
+    return f16_to_f32((uint16_t) f16);
+}
+
+static inline float clamp01(float val){
+    // compiles to max/min instructions. A NaN, signalling ones included, fails the first compare and ends up as 0 like
+    // with CLAMP_MIN_MAX - fmaxf would pass a signalling NaN through.
+    val = val >= 0.f ? val : 0.f;
+    return val < 1.f ? val : 1.f;
+}
 
-    return float16_to_float32(test_float16);
+static inline void decode_record(Detection* det, const half* record){
+    det->label = f16Tof32(record[RECORD_LABEL]);
+    det->confidence = clamp01(f16Tof32(record[RECORD_CONFIDENCE]));
+    det->x_min = clamp01(f16Tof32(record[RECORD_X_MIN]));
+    det->y_min = clamp01(f16Tof32(record[RECORD_Y_MIN]));
+    det->x_max = clamp01(f16Tof32(record[RECORD_X_MAX]));
+    det->y_max = clamp01(f16Tof32(record[RECORD_Y_MAX]));
+}
+
+// Smallest half which is >= confidence_thr, for a threshold > 0
+static half threshold_bits(float confidence_thr){
+    uint16_t bits = f32_to_f16(confidence_thr);
+    if(f16_to_f32(bits) < confidence_thr){
+        bits++;
+    }
+    return (half) bits;
+}
+
+// Bit i is set if record i of the block passes the threshold
+static inline uint32_t block_mask(const half* block, half thr_bits){
+#if defined(__SSE2__)
+    #define FIELD(k, field) block[(k) * RECORD_HALVES + (field)]
+    __m128i confidence = _mm_set_epi16(FIELD(7, RECORD_CONFIDENCE), FIELD(6, RECORD_CONFIDENCE), FIELD(5, RECORD_CONFIDENCE), FIELD(4, RECORD_CONFIDENCE),
+                                       FIELD(3, RECORD_CONFIDENCE), FIELD(2, RECORD_CONFIDENCE), FIELD(1, RECORD_CONFIDENCE), FIELD(0, RECORD_CONFIDENCE));
+    #undef FIELD
+
+    // thr_bits <= c <= +Inf, as signed 16 bit
+    __m128i below = _mm_cmplt_epi16(confidence, _mm_set1_epi16(thr_bits));
+    __m128i nan = _mm_cmpgt_epi16(confidence, _mm_set1_epi16(HALF_INFINITY));
+    __m128i pass = _mm_andnot_si128(_mm_or_si128(below, nan), _mm_set1_epi16(-1));
+
+    // one bit per 16 bit lane
+    return (uint32_t) _mm_movemask_epi8(_mm_packs_epi16(pass, _mm_setzero_si128()));
+#else
+    uint32_t pass = 0;
+    for(int k = 0; k < DECODE_BLOCK; k++){
+        half confidence = block[k * RECORD_HALVES + RECORD_CONFIDENCE];
+        pass |= (uint32_t) ((confidence >= thr_bits) & (confidence <= HALF_INFINITY)) << k;
+    }
+    return pass;
+#endif
 }
 
+/*
+The tensor only holds records up to the end marker, so they are counted first and blocks never read past it. For a
+positive threshold the confidence is tested on the raw half bits: non-negative halves order like the integers,
+negative ones are negative as int16 and NaNs lie above +Inf. Only records which pass are converted.
+*/
 int decode_raw_mobilenet(Detection dets[], half *result, float confidence_thr, int max_detections)
 {
     int i = 0;
     int detections_nr = 0;
 
-    while (1)
+    int records = 0;
+    while(records < max_detections && result[records * RECORD_HALVES + RECORD_HEADER] != HEADER_END)
     {
-        raw_Detection temp;
-        memcpy(&temp, &result[i*7], sizeof(raw_Detection));
-        if(f16Tof32(result[i*7]) == -1.0f || i+1 > max_detections)
+        records++;
+    }
+
+    // negative, zero or NaN threshold - compare as floats
+    if(!(confidence_thr > 0.f))
+    {
+        for(; i < records; i++)
         {
-            break;
+            const half* record = &result[i * RECORD_HALVES];
+            if(f16Tof32(record[RECORD_CONFIDENCE]) >= confidence_thr)
+            {
+                decode_record(&dets[detections_nr++], record);
+            }
         }
-        i++;
+        return detections_nr;
+    }
+
+    half thr_bits = threshold_bits(confidence_thr);
 
-        float current_confidence = f16Tof32(temp.confidence);
-        if(current_confidence >= confidence_thr)
+    for(; i + DECODE_BLOCK <= records; i += DECODE_BLOCK)
+    {
+        const half* block = &result[i * RECORD_HALVES];
+        uint32_t pass_mask = block_mask(block, thr_bits);
+        while(pass_mask != 0)
         {
-            dets[detections_nr].label = f16Tof32(temp.label);
+            int k = __builtin_ctz(pass_mask);
+            pass_mask &= pass_mask - 1;
+            decode_record(&dets[detections_nr++], &block[k * RECORD_HALVES]);
+        }
+    }
 
-            dets[detections_nr].confidence = current_confidence; CLAMP_MIN_MAX(dets[detections_nr].confidence, 0., 1.);
+    for(; i < records; i++)
+    {
+        const half* record = &result[i * RECORD_HALVES];
+        half confidence = record[RECORD_CONFIDENCE];
+        if(confidence >= thr_bits && confidence <= HALF_INFINITY)
+        {
+            decode_record(&dets[detections_nr++], record);
+        }
+    }
 
-            float x_min = f16Tof32(temp.x_min); CLAMP_MIN_MAX(x_min, 0., 1.);
-            float y_min = f16Tof32(temp.y_min); CLAMP_MIN_MAX(y_min, 0., 1.);
-            float x_max = f16Tof32(temp.x_max); CLAMP_MIN_MAX(x_max, 0., 1.);
-            float y_max = f16Tof32(temp.y_max); CLAMP_MIN_MAX(y_max, 0., 1.);
+    return detections_nr;
+}
 
-            dets[detections_nr].x_min = x_min;
-            dets[detections_nr].x_max = x_max;
-            dets[detections_nr].y_min = y_min;
-            dets[detections_nr].y_max = y_max;
 
-            detections_nr++;
+void mobilenet_stream_init(MobilenetStreamDecoder* decoder, Detection dets[], float confidence_thr, int max_detections)
+{
+    memset(decoder, 0, sizeof(MobilenetStreamDecoder));
+    decoder->dets = dets;
+    decoder->max_detections = max_detections;
+    decoder->confidence_thr = confidence_thr;
+    if(confidence_thr > 0.f)
+    {
+        decoder->thr_bits = threshold_bits(confidence_thr);
+    }
+    decoder->done = max_detections <= 0;
+}
+
+void mobilenet_stream_set_detection_cb(MobilenetStreamDecoder* decoder, void (*detection_cb)(void* ctx, const Detection* det), void* ctx)
+{
+    decoder->detection_cb = detection_cb;
+    decoder->ctx = ctx;
+}
+
+static void stream_record(MobilenetStreamDecoder* decoder, const uint8_t* bytes)
+{
+    // chunks can start at any byte, copy out to get aligned halves
+    half record[RECORD_HALVES];
+    memcpy(record, bytes, sizeof(record));
+
+    if(record[RECORD_HEADER] == HEADER_END)
+    {
+        decoder->done = 1;
+        return;
+    }
+
+    int pass;
+    if(decoder->confidence_thr > 0.f)
+    {
+        pass = record[RECORD_CONFIDENCE] >= decoder->thr_bits && record[RECORD_CONFIDENCE] <= HALF_INFINITY;
+    }
+    else
+    {
+        pass = f16Tof32(record[RECORD_CONFIDENCE]) >= decoder->confidence_thr;
+    }
+
+    if(pass)
+    {
+        Detection* det = &decoder->dets[decoder->detections_nr++];
+        decode_record(det, record);
+        if(decoder->detection_cb != NULL)
+        {
+            decoder->detection_cb(decoder->ctx, det);
         }
+    }
 
+    if(++decoder->records >= decoder->max_detections)
+    {
+        decoder->done = 1;
     }
+}
+
+int mobilenet_stream_feed(MobilenetStreamDecoder* decoder, const void* data, uint32_t size)
+{
+    const uint8_t* bytes = (const uint8_t*) data;
+
+    // finish a record split by the previous chunk
+    if(decoder->partial_size > 0 && !decoder->done)
+    {
+        uint32_t missing = sizeof(raw_Detection) - decoder->partial_size;
+        uint32_t take = size < missing ? size : missing;
+        memcpy(decoder->partial + decoder->partial_size, bytes, take);
+        decoder->partial_size += take;
+        bytes += take;
+        size -= take;
+        if(decoder->partial_size < sizeof(raw_Detection))
+        {
+            return 1;
+        }
+        decoder->partial_size = 0;
+        stream_record(decoder, decoder->partial);
+    }
+
+    while(!decoder->done && size >= sizeof(raw_Detection))
+    {
+        stream_record(decoder, bytes);
+        bytes += sizeof(raw_Detection);
+        size -= sizeof(raw_Detection);
+    }
+
+    if(!decoder->done && size > 0)
+    {
+        memcpy(decoder->partial, bytes, size);
+        decoder->partial_size = size;
+    }
+
+    return !decoder->done;
+}
+
+
+// Integer part of a half, rounded toward zero. Inf and NaN saturate.
+static int16_t half_to_int16(half value)
+{
+    uint16_t bits = (uint16_t) value;
+    int exponent = (bits >> 10) & 0x1f;
+    int32_t magnitude;
+
+    if(exponent < 15)
+    {
+        magnitude = 0;
+    }
+    else if(exponent >= 30)
+    {
+        // >= 32768, Inf or NaN
+        magnitude = INT16_MAX;
+    }
+    else if(exponent > 25)
+    {
+        // (1024 + mantissa) * 2^(exponent - 25)
+        magnitude = (1024 + (bits & 0x3ff)) << (exponent - 25);
+    }
+    else
+    {
+        magnitude = (1024 + (bits & 0x3ff)) >> (25 - exponent);
+    }
+    return (int16_t) ((bits & 0x8000) ? -magnitude : magnitude);
+}
+
+uint16_t half_to_q15_clamped(half value)
+{
+    uint16_t bits = (uint16_t) value;
+
+    // negative, zero or NaN
+    if((bits & 0x8000) || bits == 0 || bits > HALF_INFINITY)
+    {
+        return 0;
+    }
+    if(bits >= 0x3C00)
+    {
+        return Q15_ONE;
+    }
+
+    // value * 2^15 = (1024 + mantissa) * 2^(exponent - 10), rounded to nearest. exponent is below 15 here.
+    int exponent = bits >> 10;
+    uint32_t mantissa = bits & 0x3ff;
+    int shift;
+    if(exponent == 0)
+    {
+        // subnormal, mantissa * 2^-9
+        shift = 9;
+    }
+    else
+    {
+        mantissa |= 0x400;
+        shift = 10 - exponent;
+        if(shift < 0)
+        {
+            return (uint16_t) (mantissa << -shift);
+        }
+        if(shift == 0)
+        {
+            return (uint16_t) mantissa;
+        }
+    }
+    return (uint16_t) ((mantissa + (1u << (shift - 1))) >> shift);
+}
+
+static inline uint16_t q15_to_pixels(uint16_t q15, uint16_t size)
+{
+    return (uint16_t) (((uint32_t) q15 * size + (Q15_ONE / 2)) >> 15);
+}
+
+int decode_raw_mobilenet_fixed(DetectionFixed dets[], const half *result, uint16_t confidence_thr, int max_detections,
+                               uint16_t frame_width, uint16_t frame_height)
+{
+    int detections_nr = 0;
+
+    for(int i = 0; i < max_detections; i++)
+    {
+        const half* record = &result[i * RECORD_HALVES];
+        if(record[RECORD_HEADER] == HEADER_END)
+        {
+            break;
+        }
+
+        half raw_confidence = record[RECORD_CONFIDENCE];
+        if(((uint16_t) raw_confidence & 0x8000) || (uint16_t) raw_confidence > HALF_INFINITY)
+        {
+            continue;
+        }
+        uint16_t confidence = half_to_q15_clamped(raw_confidence);
+        if(confidence < confidence_thr)
+        {
+            continue;
+        }
+
+        DetectionFixed* det = &dets[detections_nr++];
+        det->label = half_to_int16(record[RECORD_LABEL]);
+        det->confidence = confidence;
+        det->x_min = q15_to_pixels(half_to_q15_clamped(record[RECORD_X_MIN]), frame_width);
+        det->y_min = q15_to_pixels(half_to_q15_clamped(record[RECORD_Y_MIN]), frame_height);
+        det->x_max = q15_to_pixels(half_to_q15_clamped(record[RECORD_X_MAX]), frame_width);
+        det->y_max = q15_to_pixels(half_to_q15_clamped(record[RECORD_Y_MAX]), frame_height);
+    }
+
     return detections_nr;
 }
@@ -42,6 +42,39 @@ typedef struct {
     float y_max;
 } Detection;
 
+// 1.0 in Q15
+#define Q15_ONE 32768
+
+// Integer only result of decode_raw_mobilenet_fixed, for hosts without an FPU
+typedef struct {
+    int16_t label;
+    uint16_t confidence;        // Q15, 0 to Q15_ONE
+    uint16_t x_min;             // pixels in the frame passed to the decoder
+    uint16_t y_min;
+    uint16_t x_max;
+    uint16_t y_max;
+} DetectionFixed;
+
+/*
+Streaming decoder, fed with the NN output as it arrives (eg. from a chunk_message callback) instead of the whole
+tensor. Records split between chunks are put back together. Detections are stored in dets and, if set, passed to
+detection_cb as soon as their record is complete. Once the end marker or max_detections is reached, feed returns 0 -
+the rest of the transfer can then be cancelled with a CancellationToken on a windowed chunk_message.
+*/
+typedef struct {
+    Detection* dets;
+    int max_detections;
+    float confidence_thr;
+    half thr_bits;              // threshold in the half bit domain, for a threshold > 0
+    int records;                // records seen
+    int detections_nr;
+    int done;
+    uint8_t partial[sizeof(raw_Detection)];
+    uint32_t partial_size;
+    void (*detection_cb)(void* ctx, const Detection* det);
+    void* ctx;
+} MobilenetStreamDecoder;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -49,6 +82,19 @@ extern "C" {
 float f16Tof32(half f16);
 int decode_raw_mobilenet(Detection dets[], half *result, float confidence_thr, int max_detections);
 
+// Clamps to [0, 1] like decode_raw_mobilenet, NaN gives 0
+uint16_t half_to_q15_clamped(half value);
+/*
+Same records as decode_raw_mobilenet without any float math. A record passes if its confidence, converted to Q15, is
+>= confidence_thr; negative and NaN confidences never pass. Boxes are scaled to frame_width x frame_height pixels.
+*/
+int decode_raw_mobilenet_fixed(DetectionFixed dets[], const half *result, uint16_t confidence_thr, int max_detections,
+                               uint16_t frame_width, uint16_t frame_height);
+
+void mobilenet_stream_init(MobilenetStreamDecoder* decoder, Detection dets[], float confidence_thr, int max_detections);
+void mobilenet_stream_set_detection_cb(MobilenetStreamDecoder* decoder, void (*detection_cb)(void* ctx, const Detection* det), void* ctx);
+int mobilenet_stream_feed(MobilenetStreamDecoder* decoder, const void* data, uint32_t size);
+
 #ifdef __cplusplus
 }
 #endif
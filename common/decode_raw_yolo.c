@@ -0,0 +1,203 @@
+#include "decode_raw_yolo.h"
+
+#include "nms.h"
+
+// cells whose objectness logits are converted per iteration
+#define CELL_BLOCK      64
+
+static inline float sigmoid(float x){
+    return 1.f / (1.f + expf(-x));
+}
+
+static inline float clamp01(float val){
+    val = val >= 0.f ? val : 0.f;
+    return val < 1.f ? val : 1.f;
+}
+
+typedef struct {
+    int anchor_stride;
+    int channel_stride;
+    int cell_stride;
+} Strides;
+
+static Strides layer_strides(const YoloConfig* config, const YoloLayer* layer){
+    int cells = layer->grid_width * layer->grid_height;
+    int channels = 5 + config->num_classes;
+    Strides strides;
+    strides.anchor_stride = cells * channels;
+    if(config->layout == YOLO_LAYOUT_CHW){
+        strides.channel_stride = cells;
+        strides.cell_stride = 1;
+    } else {
+        strides.channel_stride = 1;
+        strides.cell_stride = channels;
+    }
+    return strides;
+}
+
+static inline float load(const half* data){
+    return f16_to_f32((uint16_t) *data);
+}
+
+// Box and class of a cell which passed the objectness pre-filter, 0 if the final confidence is below the threshold
+static int decode_cell(Detection* det, const YoloConfig* config, const YoloLayer* layer, const half* cell, int channel_stride,
+                       int cell_x, int cell_y, const float* anchor, float objectness_logit){
+    // sigmoid is monotonic, so the best class is the best logit
+    int best_class = 0;
+    float best_logit = load(&cell[5 * channel_stride]);
+    for(int c = 1; c < config->num_classes; c++){
+        float logit = load(&cell[(5 + c) * channel_stride]);
+        if(logit > best_logit){
+            best_logit = logit;
+            best_class = c;
+        }
+    }
+
+    float confidence = sigmoid(objectness_logit) * sigmoid(best_logit);
+    if(!(confidence >= config->confidence_thr)){
+        return 0;
+    }
+
+    float tx = load(&cell[0]);
+    float ty = load(&cell[channel_stride]);
+    float tw = load(&cell[2 * channel_stride]);
+    float th = load(&cell[3 * channel_stride]);
+
+    float x, y, w, h;
+    if(config->version == YOLO_V5){
+        x = 2.f * sigmoid(tx) - 0.5f;
+        y = 2.f * sigmoid(ty) - 0.5f;
+        float sw = 2.f * sigmoid(tw);
+        float sh = 2.f * sigmoid(th);
+        w = sw * sw * anchor[0];
+        h = sh * sh * anchor[1];
+    } else {
+        float scale = config->version == YOLO_V4 ? config->scale_xy : 1.f;
+        x = scale * sigmoid(tx) - 0.5f * (scale - 1.f);
+        y = scale * sigmoid(ty) - 0.5f * (scale - 1.f);
+        w = expf(tw) * anchor[0];
+        h = expf(th) * anchor[1];
+    }
+
+    float center_x = (cell_x + x) / layer->grid_width;
+    float center_y = (cell_y + y) / layer->grid_height;
+    float half_w = 0.5f * w / config->input_width;
+    float half_h = 0.5f * h / config->input_height;
+
+    det->header = 0;
+    det->label = (float) best_class;
+    det->confidence = clamp01(confidence);
+    det->x_min = clamp01(center_x - half_w);
+    det->y_min = clamp01(center_y - half_h);
+    det->x_max = clamp01(center_x + half_w);
+    det->y_max = clamp01(center_y + half_h);
+    return 1;
+}
+
+static int least_confident(const Detection dets[], int detections_nr){
+    int lowest = 0;
+    for(int i = 1; i < detections_nr; i++){
+        if(dets[i].confidence < dets[lowest].confidence){
+            lowest = i;
+        }
+    }
+    return lowest;
+}
+
+// a cell can only beat confidence if its objectness alone does
+static float raise_logit_thr(float logit_thr, float confidence){
+    if(confidence <= 0.f){
+        return logit_thr;
+    }
+    float logit = confidence >= 1.f ? INFINITY : logf(confidence / (1.f - confidence));
+    return logit > logit_thr ? logit : logit_thr;
+}
+
+int decode_raw_yolo_layer(Detection dets[], int detections_nr, int max_detections, const YoloConfig* config, const YoloLayer* layer)
+{
+    // objectness * class probability can't exceed objectness, so cells with sigmoid(objectness) < threshold are out.
+    // In the logit domain that's one compare per cell.
+    float thr = config->confidence_thr;
+    float logit_thr = thr <= 0.f ? -INFINITY : (thr >= 1.f ? INFINITY : logf(thr / (1.f - thr)));
+
+    int cells = layer->grid_width * layer->grid_height;
+    Strides strides = layer_strides(config, layer);
+    float logits[CELL_BLOCK];
+    int lowest = -1;        // least confident detection, once dets is full
+
+    for(int a = 0; a < layer->mask_size; a++)
+    {
+        const float* anchor = &config->anchors[2 * layer->mask[a]];
+        const half* base = layer->data + a * strides.anchor_stride;
+        const half* objectness = base + 4 * strides.channel_stride;
+
+        for(int start = 0; start < cells; start += CELL_BLOCK)
+        {
+            int count = cells - start < CELL_BLOCK ? cells - start : CELL_BLOCK;
+
+            if(strides.cell_stride == 1)
+            {
+                // contiguous plane, bulk conversion
+                f16_to_f32_n(logits, (const uint16_t*) &objectness[start], count);
+            }
+            else
+            {
+                for(int i = 0; i < count; i++)
+                {
+                    logits[i] = load(&objectness[(start + i) * strides.cell_stride]);
+                }
+            }
+
+            for(int i = 0; i < count; i++)
+            {
+                if(!(logits[i] >= logit_thr))
+                {
+                    continue;
+                }
+                int cell = start + i;
+                if(detections_nr < max_detections)
+                {
+                    detections_nr += decode_cell(&dets[detections_nr], config, layer, base + cell * strides.cell_stride, strides.channel_stride,
+                                                 cell % layer->grid_width, cell / layer->grid_width, anchor, logits[i]);
+                    continue;
+                }
+                if(max_detections <= 0)
+                {
+                    return detections_nr;
+                }
+
+                // full, a candidate replaces the least confident detection if it beats it
+                if(lowest < 0)
+                {
+                    lowest = least_confident(dets, detections_nr);
+                    logit_thr = raise_logit_thr(logit_thr, dets[lowest].confidence);
+                    if(!(logits[i] >= logit_thr))
+                    {
+                        continue;
+                    }
+                }
+                Detection det;
+                if(decode_cell(&det, config, layer, base + cell * strides.cell_stride, strides.channel_stride,
+                               cell % layer->grid_width, cell / layer->grid_width, anchor, logits[i])
+                   && det.confidence > dets[lowest].confidence)
+                {
+                    dets[lowest] = det;
+                    lowest = least_confident(dets, detections_nr);
+                    logit_thr = raise_logit_thr(logit_thr, dets[lowest].confidence);
+                }
+            }
+        }
+    }
+
+    return detections_nr;
+}
+
+int decode_raw_yolo(Detection dets[], int max_detections, const YoloConfig* config, const YoloLayer layers[], int layer_count)
+{
+    int detections_nr = 0;
+    for(int l = 0; l < layer_count; l++)
+    {
+        detections_nr = decode_raw_yolo_layer(dets, detections_nr, max_detections, config, &layers[l]);
+    }
+    return nms_detections(dets, detections_nr, config->iou_thr, 1);
+}
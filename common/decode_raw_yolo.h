@@ -0,0 +1,59 @@
+#ifndef __DECODE_YOLO__
+#define __DECODE_YOLO__
+
+#include <stdint.h>
+
+#include "decode_raw_mobilenet.h"
+
+typedef enum {
+    YOLO_V3,
+    YOLO_V4,    // v3 box formula with scale_xy, 1.0 gives plain v3
+    YOLO_V5
+} YoloVersion;
+
+typedef enum {
+    YOLO_LAYOUT_CHW,    // [anchors * (5 + classes), H, W], the OpenVINO export
+    YOLO_LAYOUT_HWC     // [anchors, H, W, 5 + classes], eg. a yolov5 export without the final reshape
+} YoloLayout;
+
+typedef struct {
+    YoloVersion version;
+    YoloLayout layout;
+    int num_classes;
+    int input_width;            // network input in pixels, anchors are in the same units
+    int input_height;
+    const float* anchors;       // w, h pairs for all anchors of the model
+    float scale_xy;             // YOLO_V4 only
+    float confidence_thr;       // objectness * class probability
+    float iou_thr;              // NMS between detections of the same class
+} YoloConfig;
+
+// One output layer, raw logits as half
+typedef struct {
+    const half* data;
+    int grid_width;
+    int grid_height;
+    const int* mask;            // indices into anchors used by this layer
+    int mask_size;
+} YoloLayer;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+Decodes one layer and appends its detections to dets, returns the new count. Once max_detections are held, a more
+confident detection replaces the least confident one, so dets keeps the best over all layers decoded into it. Cells
+are pre-filtered on the objectness logit, so sigmoid/exp and box math only run on candidates. Coordinates are
+normalized and clamped like decode_raw_mobilenet, label is the class index.
+*/
+int decode_raw_yolo_layer(Detection dets[], int detections_nr, int max_detections, const YoloConfig* config, const YoloLayer* layer);
+
+// All layers followed by class aware nms_detections, returns the number of detections
+int decode_raw_yolo(Detection dets[], int max_detections, const YoloConfig* config, const YoloLayer layers[], int layer_count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -14,10 +14,8 @@ task waits for this semaphore to be given before queueing a transmission.
 
 #define RECV_TIMEOUT_TICKS 250
 
-static xQueueHandle rdySem;
-static spi_transaction_t spi_trans;
-static spi_device_handle_t handle;
-static char* emptyPacket;
+// device used by the single bus functions
+static Esp32SpiDevice defaultDevice;
 static esp_err_t ret;
 
 /*
@@ -33,18 +31,36 @@ static void IRAM_ATTR gpio_handshake_isr_handler(void* arg)
     // if (diff<120000) return; //ignore everything <0.5ms after an earlier irq
     // lasthandshaketime=currtime;
 
+    Esp32SpiDevice* device = (Esp32SpiDevice*) arg;
+
     //Give the semaphore.
     BaseType_t mustYield=false;
-    xSemaphoreGiveFromISR(rdySem, &mustYield);
+    xSemaphoreGiveFromISR(device->rdySem, &mustYield);
     if (mustYield) portYIELD_FROM_ISR();
 }
 
-void init_esp32_spi(){
+void esp32_spi_default_config(Esp32SpiConfig* config){
+    config->host = HSPI_HOST;
+    config->dma_chan = 1;
+    config->gpio_mosi = GPIO_MOSI;
+    config->gpio_miso = GPIO_MISO;
+    config->gpio_sclk = GPIO_SCLK;
+    config->gpio_cs = GPIO_CS;
+    config->gpio_handshake = GPIO_HANDSHAKE;
+    config->clock_speed_hz = 16000000;
+    config->free_bus = 0;
+    // TODO(themarpe) - enable .clock_speed_hz=20000000
+}
+
+void esp32_spi_device_init(Esp32SpiDevice* device, const Esp32SpiConfig* config){
+    device->config = *config;
+    device->recvTimeoutTicks = RECV_TIMEOUT_TICKS;
+
     //Configuration for the SPI bus
     spi_bus_config_t buscfg={
-        .mosi_io_num=GPIO_MOSI,
-        .miso_io_num=GPIO_MISO,
-        .sclk_io_num=GPIO_SCLK,
+        .mosi_io_num=config->gpio_mosi,
+        .miso_io_num=config->gpio_miso,
+        .sclk_io_num=config->gpio_sclk,
         .quadwp_io_num=-1,
         .quadhd_io_num=-1,
         .max_transfer_sz = 4*1024
@@ -55,12 +71,11 @@ void init_esp32_spi(){
         .command_bits=0,
         .address_bits=0,
         .dummy_bits=0,
-        .clock_speed_hz=16000000,
-        // TODO(themarpe) - enable .clock_speed_hz=20000000
+        .clock_speed_hz=config->clock_speed_hz,
         .duty_cycle_pos=128,        //50% duty cycle
         .mode=1,
         //.mode=0,
-        .spics_io_num=GPIO_CS,
+        .spics_io_num=config->gpio_cs,
         .cs_ena_pretrans = 4,
         // IMPORTANT - Keep the CS for a little more after transaction, to stop slave from missing the last bit when CS has less propagation delay than CLK
         .cs_ena_posttrans = 4,
@@ -73,22 +88,22 @@ void init_esp32_spi(){
         .intr_type=GPIO_PIN_INTR_NEGEDGE,
         .mode=GPIO_MODE_INPUT,
         .pull_up_en=1,
-        .pin_bit_mask=(1<<GPIO_HANDSHAKE)
+        .pin_bit_mask=(1ULL<<config->gpio_handshake)
     };
 
     //Create the semaphore.
-    rdySem=xSemaphoreCreateBinary();
+    device->rdySem=xSemaphoreCreateBinary();
 
-    //Set up handshake line interrupt.
+    //Set up handshake line interrupt. The ISR service is shared, installing it again for another device is harmless.
     gpio_config(&io_conf);
     gpio_install_isr_service(0);
-    gpio_set_intr_type(GPIO_HANDSHAKE, GPIO_PIN_INTR_NEGEDGE);
-    gpio_isr_handler_add(GPIO_HANDSHAKE, gpio_handshake_isr_handler, NULL);
+    gpio_set_intr_type(config->gpio_handshake, GPIO_PIN_INTR_NEGEDGE);
+    gpio_isr_handler_add(config->gpio_handshake, gpio_handshake_isr_handler, device);
 
     //Initialize the SPI bus and add the device we want to send stuff to.
-    ret=spi_bus_initialize(HSPI_HOST, &buscfg, 1);
+    ret=spi_bus_initialize(config->host, &buscfg, config->dma_chan);
     assert(ret==ESP_OK);
-    ret=spi_bus_add_device(HSPI_HOST, &devcfg, &handle);
+    ret=spi_bus_add_device(config->host, &devcfg, &device->handle);
     assert(ret==ESP_OK);
 
 
@@ -103,30 +118,52 @@ void init_esp32_spi(){
 
     //Assume the slave is ready for the first transmission: if the slave started up before us, we will not detect
     //positive edge on the handshake line.
-    xSemaphoreGive(rdySem);
+    xSemaphoreGive(device->rdySem);
 
     // take semaphore for first time.
-    xSemaphoreTake(rdySem, ( TickType_t ) 50);
+    xSemaphoreTake(device->rdySem, ( TickType_t ) 50);
 
-    emptyPacket = calloc(SPI_PKT_SIZE, sizeof(uint8_t));
+    device->emptyPacket = calloc(SPI_PKT_SIZE, sizeof(uint8_t));
 }
 
-void deinit_esp32_spi(){
-    free(emptyPacket);
-    ret=spi_bus_remove_device(handle);
+void esp32_spi_device_deinit(Esp32SpiDevice* device){
+    // the ISR gives rdySem, so it goes first
+    gpio_isr_handler_remove(device->config.gpio_handshake);
+    ret=spi_bus_remove_device(device->handle);
     assert(ret==ESP_OK);
+    if(device->config.free_bus){
+        ret=spi_bus_free(device->config.host);
+        assert(ret==ESP_OK);
+    }
+
+    vSemaphoreDelete(device->rdySem);
+    free(device->emptyPacket);
+    device->rdySem = NULL;
+    device->emptyPacket = NULL;
 }
 
-uint8_t esp32_send_spi(const char* sendbuf){
+void init_esp32_spi(){
+    Esp32SpiConfig config;
+    esp32_spi_default_config(&config);
+    esp32_spi_device_init(&defaultDevice, &config);
+}
+
+void deinit_esp32_spi(){
+    esp32_spi_device_deinit(&defaultDevice);
+}
+
+uint8_t esp32_device_send_spi(void* ctx, const char* sendbuf){
+    Esp32SpiDevice* device = (Esp32SpiDevice*) ctx;
     uint8_t status = 0;
     char discard_recvbuf[BUFF_MAX_SIZE] = {0};
 
+    spi_transaction_t spi_trans;
     memset(&spi_trans, 0, sizeof(spi_trans));
     spi_trans.length=SPI_PKT_SIZE*8;
     spi_trans.rx_buffer=discard_recvbuf;
     spi_trans.tx_buffer=sendbuf;
 
-    esp_err_t trans_result = spi_device_transmit(handle, &spi_trans);
+    esp_err_t trans_result = spi_device_transmit(device->handle, &spi_trans);
     if(trans_result == ESP_OK){
         status = 1;
     } else {
@@ -135,38 +172,16 @@ uint8_t esp32_send_spi(const char* sendbuf){
     return status;
 }
 
-/*
-uint8_t esp32_recv_spi(char* recvbuf){
+uint8_t esp32_device_recv_spi(void* ctx, char* recvbuf){
+    Esp32SpiDevice* device = (Esp32SpiDevice*) ctx;
     uint8_t status = 0;
-    //if(xSemaphoreTake(rdySem, ( TickType_t ) RECV_TIMEOUT_TICKS) == pdPASS){
+    if(xSemaphoreTake(device->rdySem, device->recvTimeoutTicks) == pdPASS){
+        spi_transaction_t spi_trans;
         memset(&spi_trans, 0, sizeof(spi_trans));
         spi_trans.length=SPI_PKT_SIZE*8;
         spi_trans.rx_buffer=recvbuf;
-        spi_trans.tx_buffer=emptyPacket;
-        esp_err_t trans_result = spi_device_transmit(handle, &spi_trans);
-        if(trans_result == ESP_OK){
-            status = 1;
-        } else {
-            status = 0;
-            printf("trans_result issue: %d\n", trans_result);
-        }
-    //} else {
-    //    printf("Timeout: no response from remote device...\n");
-    //    status = 0;
-    //}
-
-    return status;
-}
-*/
-
-uint8_t esp32_recv_spi(char* recvbuf){
-    uint8_t status = 0;
-    if(xSemaphoreTake(rdySem, ( TickType_t ) RECV_TIMEOUT_TICKS) == pdPASS){
-        memset(&spi_trans, 0, sizeof(spi_trans));
-        spi_trans.length=SPI_PKT_SIZE*8;
-        spi_trans.rx_buffer=recvbuf;
-        spi_trans.tx_buffer=emptyPacket;
-        esp_err_t trans_result = spi_device_transmit(handle, &spi_trans);
+        spi_trans.tx_buffer=device->emptyPacket;
+        esp_err_t trans_result = spi_device_transmit(device->handle, &spi_trans);
         if(trans_result == ESP_OK){
             status = 1;
         } else {
@@ -180,8 +195,21 @@ uint8_t esp32_recv_spi(char* recvbuf){
     return status;
 }
 
-uint8_t esp32_transfer_spi(const void* send_buffer, size_t send_size, void* receive_buffer, size_t receive_size){
+// 0 restores the default RECV_TIMEOUT_TICKS
+void esp32_device_set_recv_timeout(void* ctx, uint32_t timeout_ms){
+    Esp32SpiDevice* device = (Esp32SpiDevice*) ctx;
+    if(timeout_ms == 0){
+        device->recvTimeoutTicks = RECV_TIMEOUT_TICKS;
+    } else {
+        device->recvTimeoutTicks = pdMS_TO_TICKS(timeout_ms);
+        if(device->recvTimeoutTicks == 0){
+            device->recvTimeoutTicks = 1;
+        }
+    }
+}
 
+uint8_t esp32_device_transfer_spi(void* ctx, const void* send_buffer, size_t send_size, void* receive_buffer, size_t receive_size){
+    Esp32SpiDevice* device = (Esp32SpiDevice*) ctx;
 
     spi_transaction_t spi_trans;
     memset(&spi_trans, 0, sizeof(spi_trans));
@@ -200,7 +228,7 @@ uint8_t esp32_transfer_spi(const void* send_buffer, size_t send_size, void* rece
         spi_trans.rxlength = receive_size * 8; // bits
     }
 
-    esp_err_t trans_result = spi_device_transmit(handle, &spi_trans);
+    esp_err_t trans_result = spi_device_transmit(device->handle, &spi_trans);
     if(trans_result != ESP_OK){
         printf("error in spi transmit: %d\n", trans_result);
         return 0;
@@ -209,6 +237,22 @@ uint8_t esp32_transfer_spi(const void* send_buffer, size_t send_size, void* rece
     return 1;
 }
 
+uint8_t esp32_send_spi(const char* sendbuf){
+    return esp32_device_send_spi(&defaultDevice, sendbuf);
+}
+
+uint8_t esp32_recv_spi(char* recvbuf){
+    return esp32_device_recv_spi(&defaultDevice, recvbuf);
+}
+
+void esp32_set_recv_timeout(uint32_t timeout_ms){
+    esp32_device_set_recv_timeout(&defaultDevice, timeout_ms);
+}
+
+uint8_t esp32_transfer_spi(const void* send_buffer, size_t send_size, void* receive_buffer, size_t receive_size){
+    return esp32_device_transfer_spi(&defaultDevice, send_buffer, send_size, receive_buffer, receive_size);
+}
+
 
 uint8_t esp32_enable_spi_cs(uint8_t enable){
     if(enable){
@@ -51,12 +51,45 @@ Pins in use. The SPI Master can use the GPIO mux, so feel free to change these i
 #endif
 
 
+// One SPI host and the pins of the device on it. Several can be driven at once, eg. carriers with multiple SOMs.
+typedef struct {
+    spi_host_device_t host;
+    int dma_chan;
+    int gpio_mosi;
+    int gpio_miso;
+    int gpio_sclk;
+    int gpio_cs;
+    int gpio_handshake;
+    int clock_speed_hz;
+    int free_bus;           // deinit frees the bus too, leave 0 if anything else uses it
+} Esp32SpiConfig;
+
+typedef struct {
+    Esp32SpiConfig config;
+    spi_device_handle_t handle;
+    xQueueHandle rdySem;
+    TickType_t recvTimeoutTicks;
+    char* emptyPacket;
+} Esp32SpiDevice;
+
+// single device, on HSPI_HOST with the pins above
 void init_esp32_spi();
 void deinit_esp32_spi();
 uint8_t esp32_send_spi(const char* sendbuf);
 uint8_t esp32_recv_spi(char* recvbuf);
 uint8_t esp32_transfer_spi(const void* send_buffer, size_t send_size, void* receive_buffer, size_t receive_size);
 uint8_t esp32_enable_spi_cs(uint8_t enable);
+void esp32_set_recv_timeout(uint32_t timeout_ms);
+
+// multiple devices - the void* variants take an Esp32SpiDevice*, to be used with SpiApi's context carrying transports
+void esp32_spi_default_config(Esp32SpiConfig* config);
+void esp32_spi_device_init(Esp32SpiDevice* device, const Esp32SpiConfig* config);
+// releases everything init took, the bus only if the config's free_bus is set
+void esp32_spi_device_deinit(Esp32SpiDevice* device);
+uint8_t esp32_device_send_spi(void* device, const char* sendbuf);
+uint8_t esp32_device_recv_spi(void* device, char* recvbuf);
+uint8_t esp32_device_transfer_spi(void* device, const void* send_buffer, size_t send_size, void* receive_buffer, size_t receive_size);
+void esp32_device_set_recv_timeout(void* device, uint32_t timeout_ms);
 
 #ifdef __cplusplus
 }
@@ -1,67 +1,285 @@
 #include "float16.h"
 #include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define FLOAT16_HAS_F16C_DISPATCH
+#endif
+#endif
+
+#if defined(__aarch64__) || (defined(__ARM_NEON) && defined(__ARM_FP) && (__ARM_FP & 2))
+#include <arm_neon.h>
+#define FLOAT16_HAS_NEON
+#endif
 
 float float16_to_float32(_float16_shape_type f16_val)
 {
-	//printf("32to16. Input: 0x%x\n", f16_val.bits);
+	return f16_to_f32(f16_val.bits);
+}
+
+_float16_shape_type float32_to_float16(float f32_val)
+{
+	_float16_shape_type f16_val;
+	f16_val.bits = f32_to_f16(f32_val);
+	return f16_val;
+}
+
+static inline float bits_to_float(uint32_t bits)
+{
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+static inline uint32_t float_to_bits(float f)
+{
+	uint32_t bits;
+	memcpy(&bits, &f, sizeof(bits));
+	return bits;
+}
+
+/*
+Exponent and mantissa are shifted into place and the exponent rebiased by adding (127 - 15) << 23. Inf/NaN get the
+rebias twice, which takes their exponent to all ones. Zero and subnormals are renormalized by the FPU: they are built
+as 2^-14 * (1 + mantissa) and 2^-14 is subtracted. Both cases are selected with masks, not branches.
+*/
+float f16_to_f32(uint16_t bits)
+{
+	uint32_t shifted = (uint32_t) (bits & 0x7fff) << 13;
+	uint32_t exponent = shifted & 0x0f800000;
+	uint32_t out = shifted + 0x38000000;
+
+	uint32_t infnan_mask = -(uint32_t) (exponent == 0x0f800000);
+	out += infnan_mask & 0x38000000;
+
+	uint32_t subnormal = float_to_bits(bits_to_float(out + 0x00800000) - bits_to_float(0x38800000));
+	uint32_t subnormal_mask = -(uint32_t) (exponent == 0);
+	out = (out & ~subnormal_mask) | (subnormal & subnormal_mask);
+
+	out |= (uint32_t) (bits & 0x8000) << 16;
+	return bits_to_float(out);
+}
+
+static void f16_to_f32_n_scalar(float* dst, const uint16_t* src, size_t n)
+{
+	for(size_t i = 0; i < n; i++)
+	{
+		dst[i] = f16_to_f32(src[i]);
+	}
+}
+
+#if defined(__SSE2__) && !defined(__F16C__)
+/* the scalar algorithm, 4 lanes at a time */
+static inline __m128 f16_to_f32_sse2_4(__m128i h)
+{
+	const __m128i exponent_mask = _mm_set1_epi32(0x0f800000);
+	const __m128i rebias = _mm_set1_epi32(0x38000000);
 
-	int32_t sign = (f16_val.bits >> 15) & 0x00000001;
-	uint32_t exponent = (f16_val.bits >> 10) & 0x0000001f;
-    uint32_t mantissa =  f16_val.bits & 0x000003ff;
+	__m128i shifted = _mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(0x7fff)), 13);
+	__m128i exponent = _mm_and_si128(shifted, exponent_mask);
+	__m128i out = _mm_add_epi32(shifted, rebias);
 
-	//printf("float16:\n  f16_val.number.sign: %d\n  f16_val.number.exponent %d\n  f16_val.number.mantissa %d\n", sign, exponent, mantissa);
+	__m128i infnan_mask = _mm_cmpeq_epi32(exponent, exponent_mask);
+	out = _mm_add_epi32(out, _mm_and_si128(infnan_mask, rebias));
 
-	union { float f; uint32_t i; } v;
+	__m128 subnormal = _mm_sub_ps(_mm_castsi128_ps(_mm_add_epi32(out, _mm_set1_epi32(0x00800000))), _mm_castsi128_ps(_mm_set1_epi32(0x38800000)));
+	__m128i subnormal_mask = _mm_cmpeq_epi32(exponent, _mm_setzero_si128());
+	out = _mm_or_si128(_mm_andnot_si128(subnormal_mask, out), _mm_and_si128(subnormal_mask, _mm_castps_si128(subnormal)));
 
-	if(exponent == 0)
+	out = _mm_or_si128(out, _mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(0x8000)), 16));
+	return _mm_castsi128_ps(out);
+}
+
+static void f16_to_f32_n_sse2(float* dst, const uint16_t* src, size_t n)
+{
+	size_t i = 0;
+	for(; i + 8 <= n; i += 8)
+	{
+		__m128i h = _mm_loadu_si128((const __m128i*) (src + i));
+		_mm_storeu_ps(dst + i, f16_to_f32_sse2_4(_mm_unpacklo_epi16(h, _mm_setzero_si128())));
+		_mm_storeu_ps(dst + i + 4, f16_to_f32_sse2_4(_mm_unpackhi_epi16(h, _mm_setzero_si128())));
+	}
+	f16_to_f32_n_scalar(dst + i, src + i, n - i);
+}
+#endif
+
+#if defined(FLOAT16_HAS_F16C_DISPATCH)
+__attribute__((target("avx,f16c")))
+static void f16_to_f32_n_f16c(float* dst, const uint16_t* src, size_t n)
+{
+	size_t i = 0;
+	for(; i + 8 <= n; i += 8)
 	{
-		if(mantissa == 0) //zero!
-		{
-			//printf("zero value!\n");
-			v.i = sign << 31;
-			return v.f;
-		}
-		else	//sub-normal number, renormalize it (!?)
-		{
-			//printf("subnormal value!\n");
-			//printf("   0x%x, 0x%x\n", mantissa, exponent);
-			while (!(mantissa & 0x00000400))
-			{
-				mantissa <<= 1;
-				exponent -=  1;
-				//printf("   0x%x, 0x%x\n", mantissa, exponent);
-			}
-			exponent += 1;
-			mantissa &= ~0x00000400;
-			//printf("   0x%x, 0x%x\n", mantissa, exponent);
-
-		}
+		__m128i h = _mm_loadu_si128((const __m128i*) (src + i));
+		_mm256_storeu_ps(dst + i, _mm256_cvtph_ps(h));
 	}
+	f16_to_f32_n_scalar(dst + i, src + i, n - i);
+}
+#endif
 
-	else if(exponent == 0x1F) //NaN! treat as zero for our purposes
+#if defined(FLOAT16_HAS_NEON)
+static void f16_to_f32_n_neon(float* dst, const uint16_t* src, size_t n)
+{
+	size_t i = 0;
+	for(; i + 4 <= n; i += 4)
 	{
-		if (mantissa == 0) // Inf
-		{
-			//printf("Infinite\n");
-			v.i = (sign << 31) | 0x7f800000;
-			return v.f;
-		}
-		else // NaN
-		{
-			//printf("NaN\n");
-			v.i = (sign << 31) | 0x7f800000 | (mantissa << 13);
-			return v.f;
-		}
+		vst1q_f32(dst + i, vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(src + i))));
 	}
+	f16_to_f32_n_scalar(dst + i, src + i, n - i);
+}
+#endif
 
-	//printf("Normal number\n");
-	//else a normal number; fall through from sub-normal case.
-	exponent = exponent + (127 - 15);
-    mantissa = mantissa << 13;
-	//printf("   0x%x, 0x%x, 0x%x\n", sign, exponent, mantissa);
-    
-    v.i = (sign << 31) | (exponent << 23) | mantissa;
-    //printf("  0x%x\n", v.i);
-    return v.f;
+void f16_to_f32_n(float* dst, const uint16_t* src, size_t n)
+{
+#if defined(__F16C__)
+	f16_to_f32_n_f16c(dst, src, n);
+#elif defined(FLOAT16_HAS_F16C_DISPATCH)
+	if(__builtin_cpu_supports("f16c"))
+	{
+		f16_to_f32_n_f16c(dst, src, n);
+	}
+	else
+	{
+		f16_to_f32_n_sse2(dst, src, n);
+	}
+#elif defined(__SSE2__)
+	f16_to_f32_n_sse2(dst, src, n);
+#elif defined(FLOAT16_HAS_NEON)
+	f16_to_f32_n_neon(dst, src, n);
+#else
+	f16_to_f32_n_scalar(dst, src, n);
+#endif
 }
 
+/*
+Normal results: rebias the exponent and round the mantissa to nearest even by adding 0xfff plus the lowest kept bit
+before truncating. Subnormal results: adding 0.5 as float lets the FPU do the shift and the rounding, the half bits
+are then the low bits of the sum.
+*/
+#define F32_INFINITY_BITS   0x7f800000u
+#define F16_OVERFLOW_BITS   ((127u + 16u) << 23)
+#define F16_MIN_NORMAL_BITS (113u << 23)
+#define F16_DENORM_MAGIC    (((127u - 15u) + (23u - 10u) + 1u) << 23)
+#define F16_REBIAS_ROUND    ((uint32_t) (15 - 127) * (1u << 23) + 0xfffu)
+
+uint16_t f32_to_f16(float value)
+{
+	uint32_t f = float_to_bits(value);
+	uint32_t sign = f & 0x80000000u;
+	uint16_t out;
+	f ^= sign;
+
+	if(f >= F16_OVERFLOW_BITS)
+	{
+		out = f > F32_INFINITY_BITS ? 0x7e00 : 0x7c00;
+	}
+	else if(f < F16_MIN_NORMAL_BITS)
+	{
+		out = (uint16_t) (float_to_bits(bits_to_float(f) + bits_to_float(F16_DENORM_MAGIC)) - F16_DENORM_MAGIC);
+	}
+	else
+	{
+		uint32_t mantissa_odd = (f >> 13) & 1;
+		out = (uint16_t) ((f + F16_REBIAS_ROUND + mantissa_odd) >> 13);
+	}
+
+	return out | (uint16_t) (sign >> 16);
+}
+
+static void f32_to_f16_n_scalar(uint16_t* dst, const float* src, size_t n)
+{
+	for(size_t i = 0; i < n; i++)
+	{
+		dst[i] = f32_to_f16(src[i]);
+	}
+}
+
+#if defined(__SSE2__) && !defined(__F16C__)
+/* the scalar algorithm, 4 lanes at a time with the three cases blended by masks. Results are in the low 16 bits. */
+static inline __m128i f32_to_f16_sse2_4(__m128 value)
+{
+	__m128i f = _mm_castps_si128(value);
+	__m128i sign = _mm_and_si128(f, _mm_set1_epi32((int) 0x80000000u));
+	f = _mm_xor_si128(f, sign);
+
+	__m128i mantissa_odd = _mm_and_si128(_mm_srli_epi32(f, 13), _mm_set1_epi32(1));
+	__m128i normal = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(f, _mm_set1_epi32((int) F16_REBIAS_ROUND)), mantissa_odd), 13);
+
+	__m128i denorm_magic = _mm_set1_epi32((int) F16_DENORM_MAGIC);
+	__m128i subnormal = _mm_sub_epi32(_mm_castps_si128(_mm_add_ps(_mm_castsi128_ps(f), _mm_castsi128_ps(denorm_magic))), denorm_magic);
+
+	__m128i nan_mask = _mm_cmpgt_epi32(f, _mm_set1_epi32((int) F32_INFINITY_BITS));
+	__m128i infnan = _mm_or_si128(_mm_set1_epi32(0x7c00), _mm_and_si128(nan_mask, _mm_set1_epi32(0x0200)));
+
+	// sign is cleared, signed compares are fine
+	__m128i subnormal_mask = _mm_cmplt_epi32(f, _mm_set1_epi32((int) F16_MIN_NORMAL_BITS));
+	__m128i overflow_mask = _mm_cmpgt_epi32(f, _mm_set1_epi32((int) F16_OVERFLOW_BITS - 1));
+
+	__m128i out = _mm_or_si128(_mm_andnot_si128(subnormal_mask, normal), _mm_and_si128(subnormal_mask, subnormal));
+	out = _mm_or_si128(_mm_andnot_si128(overflow_mask, out), _mm_and_si128(overflow_mask, infnan));
+	return _mm_or_si128(out, _mm_srli_epi32(sign, 16));
+}
+
+static void f32_to_f16_n_sse2(uint16_t* dst, const float* src, size_t n)
+{
+	size_t i = 0;
+	for(; i + 8 <= n; i += 8)
+	{
+		// sign extend so the signed saturating pack keeps the bits
+		__m128i lo = _mm_srai_epi32(_mm_slli_epi32(f32_to_f16_sse2_4(_mm_loadu_ps(src + i)), 16), 16);
+		__m128i hi = _mm_srai_epi32(_mm_slli_epi32(f32_to_f16_sse2_4(_mm_loadu_ps(src + i + 4)), 16), 16);
+		_mm_storeu_si128((__m128i*) (dst + i), _mm_packs_epi32(lo, hi));
+	}
+	f32_to_f16_n_scalar(dst + i, src + i, n - i);
+}
+#endif
+
+#if defined(FLOAT16_HAS_F16C_DISPATCH)
+__attribute__((target("avx,f16c")))
+static void f32_to_f16_n_f16c(uint16_t* dst, const float* src, size_t n)
+{
+	size_t i = 0;
+	for(; i + 8 <= n; i += 8)
+	{
+		_mm_storeu_si128((__m128i*) (dst + i), _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+	}
+	f32_to_f16_n_scalar(dst + i, src + i, n - i);
+}
+#endif
+
+#if defined(FLOAT16_HAS_NEON)
+static void f32_to_f16_n_neon(uint16_t* dst, const float* src, size_t n)
+{
+	size_t i = 0;
+	for(; i + 4 <= n; i += 4)
+	{
+		vst1_u16(dst + i, vreinterpret_u16_f16(vcvt_f16_f32(vld1q_f32(src + i))));
+	}
+	f32_to_f16_n_scalar(dst + i, src + i, n - i);
+}
+#endif
+
+void f32_to_f16_n(uint16_t* dst, const float* src, size_t n)
+{
+#if defined(__F16C__)
+	f32_to_f16_n_f16c(dst, src, n);
+#elif defined(FLOAT16_HAS_F16C_DISPATCH)
+	if(__builtin_cpu_supports("f16c"))
+	{
+		f32_to_f16_n_f16c(dst, src, n);
+	}
+	else
+	{
+		f32_to_f16_n_sse2(dst, src, n);
+	}
+#elif defined(__SSE2__)
+	f32_to_f16_n_sse2(dst, src, n);
+#elif defined(FLOAT16_HAS_NEON)
+	f32_to_f16_n_neon(dst, src, n);
+#else
+	f32_to_f16_n_scalar(dst, src, n);
+#endif
+}
@@ -1,6 +1,7 @@
 #ifndef __FLOAT_16__
 #define __FLOAT_16__
 
+#include <stddef.h>
 #include <stdint.h>
 
 /* data type for storing float16s */
@@ -27,6 +28,17 @@ extern "C" {
 #endif
 
 float float16_to_float32(_float16_shape_type f16_val);
+_float16_shape_type float32_to_float16(float f32_val);
+
+/* branch free conversion of the raw half bits */
+float f16_to_f32(uint16_t bits);
+/* bulk conversion, uses F16C, SSE2 or NEON when available. F16C and NEON return signalling NaNs quieted. */
+void f16_to_f32_n(float* dst, const uint16_t* src, size_t n);
+
+/* round to nearest even, overflow goes to Inf and NaN to a quiet NaN */
+uint16_t f32_to_f16(float value);
+/* bulk conversion, uses F16C, SSE2 or NEON when available. F16C and NEON keep NaN payloads. */
+void f32_to_f16_n(uint16_t* dst, const float* src, size_t n);
 
 #ifdef __cplusplus
 }
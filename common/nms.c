@@ -0,0 +1,243 @@
+#include "nms.h"
+
+#include <stdlib.h>
+
+// below this the grid costs more than testing every kept box
+#define NMS_GRID_MIN_DETECTIONS     32
+// grid cells per side, at most
+#define NMS_GRID_MAX_SIDE           64
+
+typedef struct {
+    float confidence;
+    int index;
+} ScoreKey;
+
+typedef struct {
+    int box;        // index in sorted order
+    int next;       // next entry of the same cell, -1 ends the list
+} CellEntry;
+
+static int compare_score(const void* a, const void* b){
+    const ScoreKey* ka = (const ScoreKey*) a;
+    const ScoreKey* kb = (const ScoreKey*) b;
+    if(ka->confidence != kb->confidence){
+        return ka->confidence < kb->confidence ? 1 : -1;
+    }
+    return ka->index - kb->index;
+}
+
+// Stable, so ties keep their input order like compare_score's index tie-break. Allocates nothing, it's also the
+// fallback when the grid's buffers can't be allocated.
+static void sort_by_confidence(Detection dets[], int detections_nr){
+    for(int i = 1; i < detections_nr; i++){
+        Detection det = dets[i];
+        int j = i;
+        while(j > 0 && dets[j - 1].confidence < det.confidence){
+            dets[j] = dets[j - 1];
+            j--;
+        }
+        dets[j] = det;
+    }
+}
+
+static inline float iou(const Detection* a, const Detection* b){
+    float w = fminf(a->x_max, b->x_max) - fmaxf(a->x_min, b->x_min);
+    float h = fminf(a->y_max, b->y_max) - fmaxf(a->y_min, b->y_min);
+    if(w <= 0.f || h <= 0.f){
+        return 0.f;
+    }
+    float intersection = w * h;
+    float area_a = (a->x_max - a->x_min) * (a->y_max - a->y_min);
+    float area_b = (b->x_max - b->x_min) * (b->y_max - b->y_min);
+    return intersection / (area_a + area_b - intersection);
+}
+
+// Every candidate against every kept box, for small sets or when allocation fails
+static int nms_pairwise(Detection dets[], int detections_nr, float iou_thr, int class_aware)
+{
+    sort_by_confidence(dets, detections_nr);
+
+    int kept = 0;
+    for(int i = 0; i < detections_nr; i++)
+    {
+        int suppressed = 0;
+        for(int k = 0; k < kept; k++)
+        {
+            if((!class_aware || dets[k].label == dets[i].label) && iou(&dets[k], &dets[i]) > iou_thr)
+            {
+                suppressed = 1;
+                break;
+            }
+        }
+        if(!suppressed)
+        {
+            dets[kept++] = dets[i];
+        }
+    }
+    return kept;
+}
+
+static inline int grid_cell(float value, float origin, float scale, int side){
+    int cell = (int) ((value - origin) * scale);
+    cell = cell < 0 ? 0 : cell;
+    return cell < side ? cell : side - 1;
+}
+
+int nms_detections(Detection dets[], int detections_nr, float iou_thr, int class_aware)
+{
+    if(detections_nr < NMS_GRID_MIN_DETECTIONS)
+    {
+        return nms_pairwise(dets, detections_nr, iou_thr, class_aware);
+    }
+
+    // about two boxes per cell
+    int side = 1;
+    while(side < NMS_GRID_MAX_SIDE && side * side * 2 < detections_nr)
+    {
+        side++;
+    }
+    int cells = side * side;
+
+    int n = detections_nr;
+    size_t soa_size = 6 * n * sizeof(float);
+    ScoreKey* keys = malloc(n * sizeof(ScoreKey));
+    float* soa = malloc(soa_size);
+    int* heads = malloc(cells * sizeof(int));
+    int* kept_boxes = malloc(n * sizeof(int));
+    int entries_capacity = 4 * n;
+    CellEntry* entries = malloc(entries_capacity * sizeof(CellEntry));
+    Detection* sorted = malloc(n * sizeof(Detection));
+    if(keys == NULL || soa == NULL || heads == NULL || kept_boxes == NULL || entries == NULL || sorted == NULL)
+    {
+        free(keys);
+        free(soa);
+        free(heads);
+        free(kept_boxes);
+        free(entries);
+        free(sorted);
+        return nms_pairwise(dets, detections_nr, iou_thr, class_aware);
+    }
+
+    float* x_min = soa;
+    float* y_min = soa + n;
+    float* x_max = soa + 2 * n;
+    float* y_max = soa + 3 * n;
+    float* area = soa + 4 * n;
+    float* label = soa + 5 * n;
+
+    for(int i = 0; i < n; i++)
+    {
+        keys[i].confidence = dets[i].confidence;
+        keys[i].index = i;
+    }
+    qsort(keys, n, sizeof(ScoreKey), compare_score);
+
+    float left = dets[0].x_min, top = dets[0].y_min, right = dets[0].x_max, bottom = dets[0].y_max;
+    for(int i = 0; i < n; i++)
+    {
+        const Detection* det = &dets[keys[i].index];
+        x_min[i] = det->x_min;
+        y_min[i] = det->y_min;
+        x_max[i] = det->x_max;
+        y_max[i] = det->y_max;
+        area[i] = (det->x_max - det->x_min) * (det->y_max - det->y_min);
+        label[i] = det->label;
+        left = fminf(left, det->x_min);
+        top = fminf(top, det->y_min);
+        right = fmaxf(right, det->x_max);
+        bottom = fmaxf(bottom, det->y_max);
+    }
+
+    float scale_x = right > left ? side / (right - left) : 0.f;
+    float scale_y = bottom > top ? side / (bottom - top) : 0.f;
+    for(int c = 0; c < cells; c++)
+    {
+        heads[c] = -1;
+    }
+
+    int entries_nr = 0;
+    int kept = 0;
+    for(int i = 0; i < n; i++)
+    {
+        int cx0 = grid_cell(x_min[i], left, scale_x, side);
+        int cx1 = grid_cell(x_max[i], left, scale_x, side);
+        int cy0 = grid_cell(y_min[i], top, scale_y, side);
+        int cy1 = grid_cell(y_max[i], top, scale_y, side);
+
+        // boxes which overlap share at least one cell
+        int suppressed = 0;
+        for(int cy = cy0; cy <= cy1 && !suppressed; cy++)
+        {
+            for(int cx = cx0; cx <= cx1 && !suppressed; cx++)
+            {
+                for(int e = heads[cy * side + cx]; e != -1; e = entries[e].next)
+                {
+                    int k = entries[e].box;
+                    if(class_aware && label[k] != label[i])
+                    {
+                        continue;
+                    }
+                    float w = fminf(x_max[k], x_max[i]) - fmaxf(x_min[k], x_min[i]);
+                    float h = fminf(y_max[k], y_max[i]) - fmaxf(y_min[k], y_min[i]);
+                    if(w <= 0.f || h <= 0.f)
+                    {
+                        continue;
+                    }
+                    float intersection = w * h;
+                    if(intersection / (area[k] + area[i] - intersection) > iou_thr)
+                    {
+                        suppressed = 1;
+                        break;
+                    }
+                }
+            }
+        }
+        if(suppressed)
+        {
+            continue;
+        }
+
+        int needed = (cx1 - cx0 + 1) * (cy1 - cy0 + 1);
+        if(entries_nr + needed > entries_capacity)
+        {
+            int capacity = 2 * entries_capacity + needed;
+            CellEntry* grown = realloc(entries, capacity * sizeof(CellEntry));
+            if(grown == NULL)
+            {
+                free(keys);
+                free(soa);
+                free(heads);
+                free(kept_boxes);
+                free(entries);
+                free(sorted);
+                return nms_pairwise(dets, detections_nr, iou_thr, class_aware);
+            }
+            entries = grown;
+            entries_capacity = capacity;
+        }
+        for(int cy = cy0; cy <= cy1; cy++)
+        {
+            for(int cx = cx0; cx <= cx1; cx++)
+            {
+                entries[entries_nr].box = i;
+                entries[entries_nr].next = heads[cy * side + cx];
+                heads[cy * side + cx] = entries_nr++;
+            }
+        }
+        kept_boxes[kept++] = i;
+    }
+
+    for(int i = 0; i < kept; i++)
+    {
+        sorted[i] = dets[keys[kept_boxes[i]].index];
+    }
+    memcpy(dets, sorted, kept * sizeof(Detection));
+
+    free(keys);
+    free(soa);
+    free(heads);
+    free(kept_boxes);
+    free(entries);
+    free(sorted);
+    return kept;
+}
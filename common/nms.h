@@ -0,0 +1,25 @@
+#ifndef __NMS__
+#define __NMS__
+
+#include "decode_raw_mobilenet.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+Greedy NMS in place, returns the number of detections kept, sorted by confidence with ties in input order. A
+detection is dropped if its IoU with an already kept one is above iou_thr - with class_aware set, only kept
+detections of the same label count.
+
+Kept boxes are put in a uniform grid over the area spanned by all boxes, into every cell they cover, so a candidate
+is only tested against boxes sharing a cell with it instead of all kept ones. The sorted boxes are kept as separate
+coordinate arrays for the IoU loop.
+*/
+int nms_detections(Detection dets[], int detections_nr, float iou_thr, int class_aware);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
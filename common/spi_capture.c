@@ -0,0 +1,275 @@
+#ifndef ESP_PLATFORM
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "spi_capture.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <spi_messaging.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_timer.h"
+#else
+#include <time.h>
+#endif
+
+// capture state
+static FILE* capture_file = NULL;
+static uint64_t capture_start_us = 0;
+static uint8_t (*capture_send_impl)(const char*) = NULL;
+static uint8_t (*capture_recv_impl)(char*) = NULL;
+static uint8_t (*capture_transfer_impl)(const void*, size_t, void*, size_t) = NULL;
+
+// replay state
+static FILE* replay_file = NULL;
+static uint8_t replay_realtime = 0;
+static uint8_t replay_has_next = 0;
+static SpiCaptureRecord replay_next;
+static SpiReplayStats replay_stats;
+
+static uint64_t capture_time_us(){
+#ifdef ESP_PLATFORM
+    return (uint64_t) esp_timer_get_time();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000ULL + (uint64_t) ts.tv_nsec / 1000ULL;
+#endif
+}
+
+static void capture_write_record(uint8_t type, uint8_t status, const void* tx, uint32_t tx_size, const void* rx, uint32_t rx_size, uint64_t start_us, uint64_t end_us){
+    if(capture_file == NULL){
+        return;
+    }
+
+    SpiCaptureRecord record;
+    memset(&record, 0, sizeof(record));
+    record.type = type;
+    record.status = status;
+    record.tx_size = tx == NULL ? 0 : tx_size;
+    record.rx_size = rx == NULL ? 0 : rx_size;
+    record.timestamp_us = start_us - capture_start_us;
+    record.duration_us = end_us - start_us;
+
+    fwrite(&record, sizeof(record), 1, capture_file);
+    if(record.tx_size > 0){
+        fwrite(tx, 1, record.tx_size, capture_file);
+    }
+    if(record.rx_size > 0){
+        fwrite(rx, 1, record.rx_size, capture_file);
+    }
+}
+
+uint8_t spi_capture_start(const char* path,
+    uint8_t (*send_impl)(const char*),
+    uint8_t (*recv_impl)(char*),
+    uint8_t (*transfer_impl)(const void*, size_t, void*, size_t)){
+
+    spi_capture_stop();
+
+    capture_file = fopen(path, "wb");
+    if(capture_file == NULL){
+        printf("failed to open capture file %s\n", path);
+        return 0;
+    }
+
+    SpiCaptureHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SPI_CAPTURE_MAGIC, sizeof(header.magic));
+    header.version = SPI_CAPTURE_VERSION;
+    header.packet_size = SPI_PKT_SIZE;
+    fwrite(&header, sizeof(header), 1, capture_file);
+
+    capture_send_impl = send_impl;
+    capture_recv_impl = recv_impl;
+    capture_transfer_impl = transfer_impl;
+    capture_start_us = capture_time_us();
+
+    return 1;
+}
+
+void spi_capture_stop(){
+    if(capture_file != NULL){
+        fclose(capture_file);
+        capture_file = NULL;
+    }
+}
+
+uint8_t spi_capture_send_spi(const char* sendbuf){
+    if(capture_send_impl == NULL){
+        return 0;
+    }
+    uint64_t start_us = capture_time_us();
+    uint8_t status = (*capture_send_impl)(sendbuf);
+    capture_write_record(SPI_CAPTURE_SEND, status, sendbuf, SPI_PKT_SIZE, NULL, 0, start_us, capture_time_us());
+    return status;
+}
+
+uint8_t spi_capture_recv_spi(char* recvbuf){
+    if(capture_recv_impl == NULL){
+        return 0;
+    }
+    uint64_t start_us = capture_time_us();
+    uint8_t status = (*capture_recv_impl)(recvbuf);
+    capture_write_record(SPI_CAPTURE_RECV, status, NULL, 0, recvbuf, SPI_PKT_SIZE, start_us, capture_time_us());
+    return status;
+}
+
+uint8_t spi_capture_transfer_spi(const void* send_buffer, size_t send_size, void* receive_buffer, size_t receive_size){
+    if(capture_transfer_impl == NULL){
+        return 0;
+    }
+    uint64_t start_us = capture_time_us();
+    uint8_t status = (*capture_transfer_impl)(send_buffer, send_size, receive_buffer, receive_size);
+    capture_write_record(SPI_CAPTURE_TRANSFER, status, send_buffer, send_size, receive_buffer, receive_size, start_us, capture_time_us());
+    return status;
+}
+
+
+
+static void replay_load_next(){
+    replay_has_next = 0;
+    if(replay_file != NULL && fread(&replay_next, sizeof(replay_next), 1, replay_file) == 1){
+        replay_has_next = 1;
+    }
+}
+
+static void replay_skip_bytes(uint32_t size){
+    if(size > 0){
+        fseek(replay_file, size, SEEK_CUR);
+    }
+}
+
+static void replay_read_bytes(void* dst, uint32_t dst_size, uint32_t size){
+    uint32_t to_read = size < dst_size ? size : dst_size;
+    if(to_read > 0 && fread(dst, 1, to_read, replay_file) != to_read){
+        replay_has_next = 0;
+    }
+    replay_skip_bytes(size - to_read);
+}
+
+// Skips forward to the next record of given type, counting what had to be skipped
+static uint8_t replay_seek_type(uint8_t type){
+    while(replay_has_next && replay_next.type != type){
+        replay_skip_bytes(replay_next.tx_size + replay_next.rx_size);
+        replay_stats.skipped_records++;
+        replay_load_next();
+    }
+
+    if(!replay_has_next){
+        replay_stats.exhausted = 1;
+        return 0;
+    }
+    return 1;
+}
+
+static void replay_wait(const SpiCaptureRecord* record){
+    if(replay_realtime && record->duration_us > 0){
+#ifdef ESP_PLATFORM
+        usleep((useconds_t) record->duration_us);
+#else
+        struct timespec ts;
+        ts.tv_sec = record->duration_us / 1000000ULL;
+        ts.tv_nsec = (record->duration_us % 1000000ULL) * 1000ULL;
+        nanosleep(&ts, NULL);
+#endif
+    }
+}
+
+uint8_t spi_replay_open(const char* path, uint8_t realtime){
+    spi_replay_close();
+
+    replay_file = fopen(path, "rb");
+    if(replay_file == NULL){
+        printf("failed to open capture file %s\n", path);
+        return 0;
+    }
+
+    SpiCaptureHeader header;
+    if(fread(&header, sizeof(header), 1, replay_file) != 1
+        || memcmp(header.magic, SPI_CAPTURE_MAGIC, sizeof(header.magic)) != 0
+        || header.packet_size != SPI_PKT_SIZE){
+        printf("%s is not a compatible capture file\n", path);
+        spi_replay_close();
+        return 0;
+    }
+
+    replay_realtime = realtime;
+    memset(&replay_stats, 0, sizeof(replay_stats));
+    replay_load_next();
+
+    return 1;
+}
+
+void spi_replay_close(){
+    if(replay_file != NULL){
+        fclose(replay_file);
+        replay_file = NULL;
+    }
+    replay_has_next = 0;
+}
+
+void spi_replay_get_stats(SpiReplayStats* stats){
+    *stats = replay_stats;
+}
+
+uint8_t spi_replay_send_spi(const char* sendbuf){
+    // an extra send which isn't in the recording - accept it, without consuming anything
+    if(!replay_has_next || replay_next.type != SPI_CAPTURE_SEND){
+        replay_stats.send_mismatches++;
+        return 1;
+    }
+
+    SpiCaptureRecord record = replay_next;
+    char recorded[SPI_PKT_SIZE];
+    replay_read_bytes(recorded, sizeof(recorded), record.tx_size);
+    replay_skip_bytes(record.rx_size);
+    if(record.tx_size != SPI_PKT_SIZE || memcmp(recorded, sendbuf, SPI_PKT_SIZE) != 0){
+        replay_stats.send_mismatches++;
+    }
+    replay_stats.records++;
+    replay_load_next();
+
+    replay_wait(&record);
+    return record.status;
+}
+
+uint8_t spi_replay_recv_spi(char* recvbuf){
+    if(!replay_seek_type(SPI_CAPTURE_RECV)){
+        return 0;
+    }
+
+    SpiCaptureRecord record = replay_next;
+    replay_skip_bytes(record.tx_size);
+    replay_read_bytes(recvbuf, SPI_PKT_SIZE, record.rx_size);
+    replay_stats.records++;
+    replay_load_next();
+
+    replay_wait(&record);
+    return record.status;
+}
+
+uint8_t spi_replay_transfer_spi(const void* send_buffer, size_t send_size, void* receive_buffer, size_t receive_size){
+    (void) send_buffer;
+    (void) send_size;
+
+    if(!replay_seek_type(SPI_CAPTURE_TRANSFER)){
+        return 0;
+    }
+
+    SpiCaptureRecord record = replay_next;
+    replay_skip_bytes(record.tx_size);
+    if(receive_buffer != NULL){
+        replay_read_bytes(receive_buffer, receive_size, record.rx_size);
+    } else {
+        replay_skip_bytes(record.rx_size);
+    }
+    replay_stats.records++;
+    replay_load_next();
+
+    replay_wait(&record);
+    return record.status;
+}
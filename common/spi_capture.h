@@ -0,0 +1,82 @@
+#ifndef SHARED_SPI_CAPTURE_H
+#define SHARED_SPI_CAPTURE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+Packet-level capture and replay of the SPI transport.
+
+The capture functions wrap an existing transport (eg. esp32_send_spi/esp32_recv_spi/esp32_transfer_spi) and write every
+call to a file: the raw bytes in both directions, the transport return value, when the call started and how long it
+took (for receives this includes the handshake wait). The replay functions have the same signatures as the transport
+callbacks and feed a recording back into SpiApi, either at full speed or with the recorded timing.
+
+Capture file layout - the structs below are dumped as they are in memory, so a file uses the byte order and struct
+layout of the host that captured it. ESP32 and x86/ARM hosts share both (little endian, same padding), replaying on a
+big endian host isn't supported. The capture functions fail (return 0) until spi_capture_start set the wrapped call.
+    SpiCaptureHeader
+    SpiCaptureRecord, followed by tx_size bytes sent and rx_size bytes received
+    SpiCaptureRecord, ...
+*/
+
+#define SPI_CAPTURE_MAGIC "SPICAP01"
+#define SPI_CAPTURE_VERSION 1
+
+typedef enum {
+    SPI_CAPTURE_SEND = 1,
+    SPI_CAPTURE_RECV = 2,
+    SPI_CAPTURE_TRANSFER = 3,
+} spi_capture_type;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t packet_size;
+} SpiCaptureHeader;
+
+typedef struct {
+    uint8_t type;
+    uint8_t status;         // return value of the wrapped transport call
+    uint16_t reserved;
+    uint32_t tx_size;
+    uint32_t rx_size;
+    uint32_t reserved2;
+    uint64_t timestamp_us;  // call start, relative to spi_capture_start
+    uint64_t duration_us;   // time spent in the transport call, including handshake wait
+} SpiCaptureRecord;
+
+typedef struct {
+    uint32_t records;
+    uint32_t send_mismatches;   // sent packets which differ from the recording
+    uint32_t skipped_records;   // records skipped because the call sequence diverged
+    uint8_t exhausted;          // replay ran past the end of the recording
+} SpiReplayStats;
+
+// Recording
+uint8_t spi_capture_start(const char* path,
+    uint8_t (*send_impl)(const char*),
+    uint8_t (*recv_impl)(char*),
+    uint8_t (*transfer_impl)(const void*, size_t, void*, size_t));
+void spi_capture_stop();
+uint8_t spi_capture_send_spi(const char* sendbuf);
+uint8_t spi_capture_recv_spi(char* recvbuf);
+uint8_t spi_capture_transfer_spi(const void* send_buffer, size_t send_size, void* receive_buffer, size_t receive_size);
+
+// Replay
+uint8_t spi_replay_open(const char* path, uint8_t realtime);
+void spi_replay_close();
+void spi_replay_get_stats(SpiReplayStats* stats);
+uint8_t spi_replay_send_spi(const char* sendbuf);
+uint8_t spi_replay_recv_spi(char* recvbuf);
+uint8_t spi_replay_transfer_spi(const void* send_buffer, size_t send_size, void* receive_buffer, size_t receive_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,84 @@
+#include "spi_resync.h"
+
+#include <string.h>
+
+void spi_resync_init(SpiResyncInstance* instance){
+    memset(instance, 0, sizeof(SpiResyncInstance));
+}
+
+void spi_resync_reset(SpiResyncInstance* instance){
+    instance->carry = 0;
+}
+
+static uint32_t count_nonzero(const uint8_t* data, uint32_t size){
+    uint32_t count = 0;
+    for(uint32_t i = 0; i < size; i++){
+        if(data[i] != 0x00){
+            count++;
+        }
+    }
+    return count;
+}
+
+// Keeps window[from, avail) for the next burst
+static void keep_from(SpiResyncInstance* instance, uint32_t from, uint32_t avail){
+    memmove(instance->window, instance->window + from, avail - from);
+    instance->carry = avail - from;
+}
+
+int spi_resync_feed(SpiResyncInstance* instance, SpiProtocolInstance* proto, const uint8_t* burst, uint32_t size, SpiProtocolPacket** packet){
+    *packet = NULL;
+    if(size > SPI_PKT_SIZE){
+        size = SPI_PKT_SIZE;
+    }
+
+    // Aligned burst, nothing held over - regular parse. A bad CRC here is corruption, not a misalignment.
+    if(instance->carry == 0 && size == SPI_PKT_SIZE && burst[0] == START_BYTE_MAGIC){
+        SpiProtocolPacket* parsed = spi_protocol_parse(proto, burst, SPI_PKT_SIZE);
+        if(parsed == NULL){
+            instance->dropped_bytes += count_nonzero(burst, size);
+            return SPI_RESYNC_CORRUPT;
+        }
+        *packet = parsed;
+        return SPI_RESYNC_PACKET;
+    }
+
+    memcpy(instance->window + instance->carry, burst, size);
+    uint32_t avail = instance->carry + size;
+
+    for(uint32_t off = 0; off < avail; off++){
+        if(instance->window[off] != START_BYTE_MAGIC){
+            continue;
+        }
+
+        // frame continues in the next burst
+        if(off + SPI_PKT_SIZE > avail){
+            uint32_t dropped = count_nonzero(instance->window, off);
+            instance->dropped_bytes += dropped;
+            keep_from(instance, off, avail);
+            return dropped > 0 ? SPI_RESYNC_LOST : SPI_RESYNC_PENDING;
+        }
+
+        if(instance->window[off + SPI_PKT_SIZE - 1] != END_BYTE_MAGIC){
+            continue;
+        }
+
+        SpiProtocolPacket* parsed = spi_protocol_parse(proto, instance->window + off, SPI_PKT_SIZE);
+        if(parsed != NULL){
+            // copy out before the window is compacted, parse may point into it
+            memcpy(&instance->packet, parsed, sizeof(SpiProtocolPacket));
+            uint32_t dropped = count_nonzero(instance->window, off);
+            instance->dropped_bytes += dropped;
+            keep_from(instance, off + SPI_PKT_SIZE, avail);
+            instance->resynced_packets++;
+            *packet = &instance->packet;
+            // whatever was dropped belonged to a packet before this one
+            return dropped > 0 ? SPI_RESYNC_LOST : SPI_RESYNC_PACKET;
+        }
+    }
+
+    uint32_t dropped = count_nonzero(instance->window, avail);
+    instance->carry = 0;
+    instance->dropped_bytes += dropped;
+    return dropped > 0 ? SPI_RESYNC_LOST : SPI_RESYNC_PENDING;
+}
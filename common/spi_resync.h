@@ -0,0 +1,47 @@
+#ifndef SHARED_SPI_RESYNC_H
+#define SHARED_SPI_RESYNC_H
+
+#include <stdint.h>
+
+#include <spi_protocol.h>
+#include <spi_messaging.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+Byte-level resynchronization of received SPI bursts.
+
+After a CS glitch the slave and master packet boundaries can end up offset, so every received burst holds the end of
+one packet and the start of the next. Bursts are fed in order; the engine keeps the bytes of an incomplete frame between
+bursts and searches for the next START_BYTE_MAGIC ... END_BYTE_MAGIC frame with a valid CRC.
+*/
+
+typedef enum {
+    SPI_RESYNC_CORRUPT = -2,    // aligned packet with a bad CRC
+    SPI_RESYNC_LOST = -1,       // non-idle bytes were discarded, so at least one packet is missing. A frame recovered
+                                // after them is still returned in packet, its position in the stream is unknown.
+    SPI_RESYNC_PENDING = 0,     // no frame yet - idle burst or an incomplete frame kept for the next burst
+    SPI_RESYNC_PACKET = 1,      // a valid packet was recovered
+} spi_resync_status;
+
+typedef struct {
+    uint8_t window[2 * SPI_PKT_SIZE];
+    uint32_t carry;             // bytes kept in window from previous bursts
+    SpiProtocolPacket packet;   // last recovered packet
+
+    // stats
+    uint32_t resynced_packets;  // packets recovered from misaligned bursts
+    uint32_t dropped_bytes;     // non-idle bytes which weren't part of any valid frame
+} SpiResyncInstance;
+
+void spi_resync_init(SpiResyncInstance* instance);
+void spi_resync_reset(SpiResyncInstance* instance);
+int spi_resync_feed(SpiResyncInstance* instance, SpiProtocolInstance* proto, const uint8_t* burst, uint32_t size, SpiProtocolPacket** packet);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,591 @@
+#include "tensor_kernels.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "float16.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Min-heap of the best candidates so far, the root is the one to replace next
+typedef struct {
+    int32_t* keys;
+    uint32_t* indices;
+    size_t size;
+} TopkHeap;
+
+// a is worse than b: smaller key, or the same key found later
+static inline int worse(const TopkHeap* heap, size_t a, size_t b){
+    return heap->keys[a] < heap->keys[b] || (heap->keys[a] == heap->keys[b] && heap->indices[a] > heap->indices[b]);
+}
+
+static inline void heap_swap(TopkHeap* heap, size_t a, size_t b){
+    int32_t key = heap->keys[a];
+    uint32_t index = heap->indices[a];
+    heap->keys[a] = heap->keys[b];
+    heap->indices[a] = heap->indices[b];
+    heap->keys[b] = key;
+    heap->indices[b] = index;
+}
+
+static void sift_down(TopkHeap* heap, size_t i){
+    for(;;){
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+        size_t worst = i;
+        if(left < heap->size && worse(heap, left, worst)){
+            worst = left;
+        }
+        if(right < heap->size && worse(heap, right, worst)){
+            worst = right;
+        }
+        if(worst == i){
+            return;
+        }
+        heap_swap(heap, i, worst);
+        i = worst;
+    }
+}
+
+static void sift_up(TopkHeap* heap, size_t i){
+    while(i > 0){
+        size_t parent = (i - 1) / 2;
+        if(!worse(heap, i, parent)){
+            return;
+        }
+        heap_swap(heap, i, parent);
+        i = parent;
+    }
+}
+
+// Offers a candidate to a heap of capacity k. Candidates arrive in index order, so an equal key never replaces.
+static inline void heap_offer(TopkHeap* heap, size_t k, int32_t key, uint32_t index){
+    if(heap->size < k){
+        heap->keys[heap->size] = key;
+        heap->indices[heap->size] = index;
+        sift_up(heap, heap->size++);
+    } else if(key > heap->keys[0]){
+        heap->keys[0] = key;
+        heap->indices[0] = index;
+        sift_down(heap, 0);
+    }
+}
+
+// Empties the heap into indices, best first
+static size_t heap_drain(TopkHeap* heap, uint32_t* indices){
+    size_t count = heap->size;
+    while(heap->size > 0){
+        indices[heap->size - 1] = heap->indices[0];
+        heap_swap(heap, 0, heap->size - 1);
+        heap->size--;
+        sift_down(heap, 0);
+    }
+    return count;
+}
+
+// heap keys live on the stack for up to this k
+#define TOPK_STACK_KEYS     64
+
+size_t argmax_f16(const uint16_t* data, size_t n)
+{
+    if(n == 0)
+    {
+        return 0;
+    }
+
+    size_t i = 0;
+    int16_t best = f16_sort_key(data[0]);
+#if defined(__SSE2__)
+    if(n >= 8)
+    {
+        // the largest key first, then its first position
+        __m128i max = _mm_set1_epi16(best);
+        for(; i + 8 <= n; i += 8)
+        {
+            __m128i h = _mm_loadu_si128((const __m128i*) (data + i));
+            __m128i sign = _mm_srai_epi16(h, 15);
+            max = _mm_max_epi16(max, _mm_sub_epi16(_mm_xor_si128(_mm_and_si128(h, _mm_set1_epi16(0x7fff)), sign), sign));
+        }
+        max = _mm_max_epi16(max, _mm_shuffle_epi32(max, _MM_SHUFFLE(1, 0, 3, 2)));
+        max = _mm_max_epi16(max, _mm_shuffle_epi32(max, _MM_SHUFFLE(2, 3, 0, 1)));
+        max = _mm_max_epi16(max, _mm_shufflelo_epi16(max, _MM_SHUFFLE(2, 3, 0, 1)));
+        best = (int16_t) _mm_extract_epi16(max, 0);
+        for(; i < n; i++)
+        {
+            int16_t key = f16_sort_key(data[i]);
+            best = key > best ? key : best;
+        }
+
+        __m128i target = _mm_set1_epi16(best);
+        for(i = 0; i + 8 <= n; i += 8)
+        {
+            __m128i h = _mm_loadu_si128((const __m128i*) (data + i));
+            __m128i sign = _mm_srai_epi16(h, 15);
+            __m128i key = _mm_sub_epi16(_mm_xor_si128(_mm_and_si128(h, _mm_set1_epi16(0x7fff)), sign), sign);
+            int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(key, target));
+            if(mask != 0)
+            {
+                return i + __builtin_ctz(mask) / 2;
+            }
+        }
+        for(; i < n; i++)
+        {
+            if(f16_sort_key(data[i]) == best)
+            {
+                return i;
+            }
+        }
+        return 0;
+    }
+#endif
+
+    size_t best_index = 0;
+    for(i = 1; i < n; i++)
+    {
+        int16_t key = f16_sort_key(data[i]);
+        if(key > best)
+        {
+            best = key;
+            best_index = i;
+        }
+    }
+    return best_index;
+}
+
+size_t argmax_u8(const uint8_t* data, size_t n)
+{
+    if(n == 0)
+    {
+        return 0;
+    }
+
+    size_t i = 0;
+    uint8_t best = data[0];
+#if defined(__SSE2__)
+    if(n >= 16)
+    {
+        __m128i max = _mm_set1_epi8((char) best);
+        for(; i + 16 <= n; i += 16)
+        {
+            max = _mm_max_epu8(max, _mm_loadu_si128((const __m128i*) (data + i)));
+        }
+        max = _mm_max_epu8(max, _mm_shuffle_epi32(max, _MM_SHUFFLE(1, 0, 3, 2)));
+        max = _mm_max_epu8(max, _mm_shuffle_epi32(max, _MM_SHUFFLE(2, 3, 0, 1)));
+        max = _mm_max_epu8(max, _mm_shufflelo_epi16(max, _MM_SHUFFLE(2, 3, 0, 1)));
+        max = _mm_max_epu8(max, _mm_srli_epi16(max, 8));
+        best = (uint8_t) _mm_cvtsi128_si32(max);
+        for(; i < n; i++)
+        {
+            best = data[i] > best ? data[i] : best;
+        }
+
+        __m128i target = _mm_set1_epi8((char) best);
+        for(i = 0; i + 16 <= n; i += 16)
+        {
+            int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (data + i)), target));
+            if(mask != 0)
+            {
+                return i + __builtin_ctz(mask);
+            }
+        }
+        for(; i < n; i++)
+        {
+            if(data[i] == best)
+            {
+                return i;
+            }
+        }
+        return 0;
+    }
+#endif
+
+    size_t best_index = 0;
+    for(i = 1; i < n; i++)
+    {
+        if(data[i] > best)
+        {
+            best = data[i];
+            best_index = i;
+        }
+    }
+    return best_index;
+}
+
+size_t topk_f16(const uint16_t* data, size_t n, size_t k, uint32_t* indices)
+{
+    if(k > n)
+    {
+        k = n;
+    }
+    if(k == 0)
+    {
+        return 0;
+    }
+
+    int32_t stack_keys[TOPK_STACK_KEYS];
+    uint32_t stack_indices[TOPK_STACK_KEYS];
+    TopkHeap heap;
+    heap.keys = k <= TOPK_STACK_KEYS ? stack_keys : malloc(k * sizeof(int32_t));
+    heap.indices = k <= TOPK_STACK_KEYS ? stack_indices : malloc(k * sizeof(uint32_t));
+    heap.size = 0;
+    if(heap.keys == NULL || heap.indices == NULL)
+    {
+        if(k > TOPK_STACK_KEYS)
+        {
+            free(heap.keys);
+            free(heap.indices);
+        }
+        return 0;
+    }
+
+    size_t i = 0;
+    for(; i < k; i++)
+    {
+        heap_offer(&heap, k, f16_sort_key(data[i]), (uint32_t) i);
+    }
+
+#if defined(__SSE2__)
+    // most blocks have nothing above the current k-th best
+    for(; i + 8 <= n; i += 8)
+    {
+        __m128i h = _mm_loadu_si128((const __m128i*) (data + i));
+        __m128i sign = _mm_srai_epi16(h, 15);
+        __m128i key = _mm_sub_epi16(_mm_xor_si128(_mm_and_si128(h, _mm_set1_epi16(0x7fff)), sign), sign);
+        int mask = _mm_movemask_epi8(_mm_cmpgt_epi16(key, _mm_set1_epi16((int16_t) heap.keys[0])));
+        while(mask != 0)
+        {
+            size_t lane = __builtin_ctz(mask) / 2;
+            mask &= ~(3 << (2 * lane));
+            heap_offer(&heap, k, f16_sort_key(data[i + lane]), (uint32_t) (i + lane));
+        }
+    }
+#endif
+    for(; i < n; i++)
+    {
+        heap_offer(&heap, k, f16_sort_key(data[i]), (uint32_t) i);
+    }
+
+    size_t count = heap_drain(&heap, indices);
+    if(k > TOPK_STACK_KEYS)
+    {
+        free(heap.keys);
+        free(heap.indices);
+    }
+    return count;
+}
+
+size_t topk_u8(const uint8_t* data, size_t n, size_t k, uint32_t* indices)
+{
+    if(k > n)
+    {
+        k = n;
+    }
+    if(k == 0)
+    {
+        return 0;
+    }
+
+    int32_t stack_keys[TOPK_STACK_KEYS];
+    uint32_t stack_indices[TOPK_STACK_KEYS];
+    TopkHeap heap;
+    heap.keys = k <= TOPK_STACK_KEYS ? stack_keys : malloc(k * sizeof(int32_t));
+    heap.indices = k <= TOPK_STACK_KEYS ? stack_indices : malloc(k * sizeof(uint32_t));
+    heap.size = 0;
+    if(heap.keys == NULL || heap.indices == NULL)
+    {
+        if(k > TOPK_STACK_KEYS)
+        {
+            free(heap.keys);
+            free(heap.indices);
+        }
+        return 0;
+    }
+
+    size_t i = 0;
+    for(; i < k; i++)
+    {
+        heap_offer(&heap, k, data[i], (uint32_t) i);
+    }
+
+#if defined(__SSE2__)
+    // unsigned compare as signed, with the top bit flipped
+    const __m128i flip = _mm_set1_epi8((char) 0x80);
+    for(; i + 16 <= n; i += 16)
+    {
+        __m128i values = _mm_xor_si128(_mm_loadu_si128((const __m128i*) (data + i)), flip);
+        __m128i threshold = _mm_xor_si128(_mm_set1_epi8((char) heap.keys[0]), flip);
+        int mask = _mm_movemask_epi8(_mm_cmpgt_epi8(values, threshold));
+        while(mask != 0)
+        {
+            size_t lane = __builtin_ctz(mask);
+            mask &= mask - 1;
+            heap_offer(&heap, k, data[i + lane], (uint32_t) (i + lane));
+        }
+    }
+#endif
+    for(; i < n; i++)
+    {
+        heap_offer(&heap, k, data[i], (uint32_t) i);
+    }
+
+    size_t count = heap_drain(&heap, indices);
+    if(k > TOPK_STACK_KEYS)
+    {
+        free(heap.keys);
+        free(heap.indices);
+    }
+    return count;
+}
+
+static void softmax_in_place(float* values, size_t k)
+{
+    float max = values[0];
+    for(size_t i = 1; i < k; i++)
+    {
+        max = values[i] > max ? values[i] : max;
+    }
+    float sum = 0.f;
+    for(size_t i = 0; i < k; i++)
+    {
+        values[i] = expf(values[i] - max);
+        sum += values[i];
+    }
+    for(size_t i = 0; i < k; i++)
+    {
+        values[i] /= sum;
+    }
+}
+
+void softmax_topk_f16(const uint16_t* data, const uint32_t* indices, size_t k, float* probs)
+{
+    if(k == 0)
+    {
+        return;
+    }
+    for(size_t i = 0; i < k; i++)
+    {
+        probs[i] = f16_to_f32(data[indices[i]]);
+    }
+    softmax_in_place(probs, k);
+}
+
+void softmax_topk_u8(const uint8_t* data, const uint32_t* indices, size_t k, float scale, int32_t zero_point, float* probs)
+{
+    if(k == 0)
+    {
+        return;
+    }
+    for(size_t i = 0; i < k; i++)
+    {
+        probs[i] = (float) ((int32_t) data[indices[i]] - zero_point) * scale;
+    }
+    softmax_in_place(probs, k);
+}
+
+void dequantize_u8(float* dst, const uint8_t* src, size_t n, float scale, int32_t zero_point)
+{
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128 offset = _mm_set1_ps((float) zero_point);
+    const __m128 factor = _mm_set1_ps(scale);
+    for(; i + 16 <= n; i += 16)
+    {
+        __m128i bytes = _mm_loadu_si128((const __m128i*) (src + i));
+        __m128i low = _mm_unpacklo_epi8(bytes, _mm_setzero_si128());
+        __m128i high = _mm_unpackhi_epi8(bytes, _mm_setzero_si128());
+        __m128i words[4] = {
+            _mm_unpacklo_epi16(low, _mm_setzero_si128()),
+            _mm_unpackhi_epi16(low, _mm_setzero_si128()),
+            _mm_unpacklo_epi16(high, _mm_setzero_si128()),
+            _mm_unpackhi_epi16(high, _mm_setzero_si128()),
+        };
+        for(int w = 0; w < 4; w++)
+        {
+            _mm_storeu_ps(dst + i + 4 * w, _mm_mul_ps(_mm_sub_ps(_mm_cvtepi32_ps(words[w]), offset), factor));
+        }
+    }
+#endif
+    for(; i < n; i++)
+    {
+        dst[i] = (float) ((int32_t) src[i] - zero_point) * scale;
+    }
+}
+
+int seg_argmax_init(SegArgmaxState* state, SegLayout layout, uint32_t classes, uint32_t width, uint32_t height, uint8_t* class_map)
+{
+    memset(state, 0, sizeof(SegArgmaxState));
+    if(classes == 0 || classes > 256)
+    {
+        return 0;
+    }
+    // the pixel count and the CHW plane's byte size have to fit
+    if(width != 0 && (height > UINT32_MAX / width || (size_t) width * height > SIZE_MAX / sizeof(int16_t)))
+    {
+        return 0;
+    }
+    state->layout = layout;
+    state->classes = classes;
+    state->pixels = width * height;
+    state->class_map = class_map;
+    if(layout == SEG_LAYOUT_CHW)
+    {
+        state->max_keys = malloc(state->pixels * sizeof(int16_t));
+        if(state->max_keys == NULL)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void seg_argmax_free(SegArgmaxState* state)
+{
+    free(state->max_keys);
+    state->max_keys = NULL;
+}
+
+int seg_argmax_done(const SegArgmaxState* state)
+{
+    return state->position == (uint64_t) state->classes * state->pixels;
+}
+
+static inline uint16_t load_half(const uint8_t* bytes)
+{
+    uint16_t bits;
+    memcpy(&bits, bytes, sizeof(bits));
+    return bits;
+}
+
+// count values of class plane `plane`, starting at pixel
+static void seg_feed_plane(SegArgmaxState* state, const uint8_t* bytes, uint32_t plane, uint32_t pixel, uint32_t count)
+{
+    int16_t* max_keys = state->max_keys + pixel;
+    uint8_t* class_map = state->class_map + pixel;
+    uint32_t i = 0;
+
+    if(plane == 0)
+    {
+        for(; i < count; i++)
+        {
+            max_keys[i] = f16_sort_key(load_half(bytes + 2 * i));
+        }
+        memset(class_map, 0, count);
+        return;
+    }
+
+#if defined(__SSE2__)
+    const __m128i class_index = _mm_set1_epi8((char) plane);
+    for(; i + 8 <= count; i += 8)
+    {
+        __m128i h = _mm_loadu_si128((const __m128i*) (bytes + 2 * i));
+        __m128i sign = _mm_srai_epi16(h, 15);
+        __m128i key = _mm_sub_epi16(_mm_xor_si128(_mm_and_si128(h, _mm_set1_epi16(0x7fff)), sign), sign);
+        __m128i best = _mm_loadu_si128((const __m128i*) (max_keys + i));
+        __m128i greater = _mm_cmpgt_epi16(key, best);
+        _mm_storeu_si128((__m128i*) (max_keys + i), _mm_max_epi16(key, best));
+
+        // one byte per lane for the class map
+        __m128i greater_bytes = _mm_packs_epi16(greater, greater);
+        __m128i classes = _mm_loadl_epi64((const __m128i*) (class_map + i));
+        classes = _mm_or_si128(_mm_andnot_si128(greater_bytes, classes), _mm_and_si128(greater_bytes, class_index));
+        _mm_storel_epi64((__m128i*) (class_map + i), classes);
+    }
+#endif
+    for(; i < count; i++)
+    {
+        int16_t key = f16_sort_key(load_half(bytes + 2 * i));
+        if(key > max_keys[i])
+        {
+            max_keys[i] = key;
+            class_map[i] = (uint8_t) plane;
+        }
+    }
+}
+
+// count values of the HWC tensor, starting at the current position
+static void seg_feed_pixels(SegArgmaxState* state, const uint8_t* bytes, uint64_t count)
+{
+    uint32_t classes = state->classes;
+    uint64_t i = 0;
+    while(i < count)
+    {
+        uint32_t pixel = (uint32_t) ((state->position + i) / classes);
+        uint32_t channel = (uint32_t) ((state->position + i) % classes);
+
+        // a whole pixel in this chunk, at an aligned address
+        if(channel == 0 && count - i >= classes && ((uintptr_t) (bytes + 2 * i) & 1) == 0)
+        {
+            state->class_map[pixel] = (uint8_t) argmax_f16((const uint16_t*) (bytes + 2 * i), classes);
+            i += classes;
+            continue;
+        }
+
+        int16_t key = f16_sort_key(load_half(bytes + 2 * i));
+        if(channel == 0 || key > state->pixel_best)
+        {
+            state->pixel_best = key;
+            state->pixel_class = (uint8_t) channel;
+        }
+        if(channel == classes - 1)
+        {
+            state->class_map[pixel] = state->pixel_class;
+        }
+        i++;
+    }
+    state->position += count;
+}
+
+static void seg_feed_values(SegArgmaxState* state, const uint8_t* bytes, uint64_t count)
+{
+    if(state->layout == SEG_LAYOUT_HWC)
+    {
+        seg_feed_pixels(state, bytes, count);
+        return;
+    }
+
+    while(count > 0)
+    {
+        uint32_t plane = (uint32_t) (state->position / state->pixels);
+        uint32_t pixel = (uint32_t) (state->position % state->pixels);
+        uint32_t run = state->pixels - pixel;
+        if(run > count)
+        {
+            run = (uint32_t) count;
+        }
+        seg_feed_plane(state, bytes, plane, pixel, run);
+        bytes += 2 * (size_t) run;
+        count -= run;
+        state->position += run;
+    }
+}
+
+void seg_argmax_feed(SegArgmaxState* state, const void* data, size_t size)
+{
+    const uint8_t* bytes = (const uint8_t*) data;
+    uint64_t total = (uint64_t) state->classes * state->pixels;
+
+    if(state->has_carry && size > 0 && state->position < total)
+    {
+        uint8_t value[2] = {state->carry, bytes[0]};
+        seg_feed_values(state, value, 1);
+        state->has_carry = 0;
+        bytes++;
+        size--;
+    }
+
+    uint64_t count = size / 2;
+    if(count > total - state->position)
+    {
+        count = total - state->position;
+    }
+    seg_feed_values(state, bytes, count);
+
+    if(size % 2 == 1 && state->position < total)
+    {
+        state->carry = bytes[size - 1];
+        state->has_carry = 1;
+    }
+}
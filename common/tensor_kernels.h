@@ -0,0 +1,73 @@
+#ifndef __TENSOR_KERNELS__
+#define __TENSOR_KERNELS__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+Kernels for classification and segmentation outputs, on the raw FP16 or U8 tensor data - no float copy of the
+tensor is made. Halves are compared through f16_sort_key, which orders them like the values they hold (-0 and +0
+share a key, a NaN sorts past the infinity of its sign). Ties go to the lowest index.
+*/
+
+// Signed 16 bit key ordered like the half value: the magnitude, negated for negative halves
+static inline int16_t f16_sort_key(uint16_t bits){
+    int16_t sign = (int16_t) bits >> 15;
+    return (int16_t) (((bits & 0x7fff) ^ sign) - sign);
+}
+
+typedef enum {
+    SEG_LAYOUT_HWC,     // all classes of a pixel, then the next pixel
+    SEG_LAYOUT_CHW      // a plane of all pixels per class
+} SegLayout;
+
+/*
+Per pixel argmax of an FP16 segmentation output, fed as it is received (eg. from a chunk_message_buffer callback with
+the state as context), so the tensor is never held in full. Chunks can split values at any byte. For HWC a pixel's
+class is written once its last class arrives; for CHW a plane of running maximum keys is kept next to the class map,
+which is final once the last plane is in.
+*/
+typedef struct {
+    SegLayout layout;
+    uint32_t classes;           // at most 256
+    uint32_t pixels;
+    uint8_t* class_map;         // pixels bytes, owned by the caller
+    int16_t* max_keys;          // CHW only
+    uint64_t position;          // values consumed
+    uint8_t carry;              // first byte of a value split between chunks
+    int has_carry;
+    int16_t pixel_best;         // HWC, best key of the current pixel so far
+    uint8_t pixel_class;
+} SegArgmaxState;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+size_t argmax_f16(const uint16_t* data, size_t n);
+size_t argmax_u8(const uint8_t* data, size_t n);
+
+// Indices of the k largest elements, largest first, returns min(k, n). Uses a k sized heap, k should be small.
+size_t topk_f16(const uint16_t* data, size_t n, size_t k, uint32_t* indices);
+size_t topk_u8(const uint8_t* data, size_t n, size_t k, uint32_t* indices);
+
+// Softmax over the selected elements only (eg. the top-k), probs[i] belongs to indices[i]
+void softmax_topk_f16(const uint16_t* data, const uint32_t* indices, size_t k, float* probs);
+void softmax_topk_u8(const uint8_t* data, const uint32_t* indices, size_t k, float scale, int32_t zero_point, float* probs);
+
+// dst[i] = (src[i] - zero_point) * scale
+void dequantize_u8(float* dst, const uint8_t* src, size_t n, float scale, int32_t zero_point);
+
+// returns 0 if classes is above 256, width * height overflows or the CHW plane can't be allocated
+int seg_argmax_init(SegArgmaxState* state, SegLayout layout, uint32_t classes, uint32_t width, uint32_t height, uint8_t* class_map);
+// bytes past the end of the tensor are ignored
+void seg_argmax_feed(SegArgmaxState* state, const void* data, size_t size);
+// all values were fed and class_map is complete
+int seg_argmax_done(const SegArgmaxState* state);
+void seg_argmax_free(SegArgmaxState* state);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,133 @@
+#include "device_group.hpp"
+
+#include <chrono>
+#include <cstdint>
+
+#ifdef ESP_PLATFORM
+#include "esp_pthread.h"
+#endif
+
+namespace dai {
+
+DeviceGroup::DeviceGroup(size_t max_queued) : max_queued(max_queued) {
+    running = false;
+}
+
+DeviceGroup::~DeviceGroup(){
+    stop();
+    for(auto& group_msg : queue){
+        free_message(&group_msg);
+    }
+}
+
+size_t DeviceGroup::add_device(SpiApi& api, const std::vector<std::string>& stream_names, int core){
+    // the link threads index links, it can't grow under them
+    if(running){
+        return SIZE_MAX;
+    }
+    Link link;
+    link.api = &api;
+    link.stream_names = stream_names;
+    link.core = core;
+    links.push_back(std::move(link));
+    return links.size() - 1;
+}
+
+void DeviceGroup::start(){
+    if(running){
+        return;
+    }
+    running = true;
+
+#ifdef ESP_PLATFORM
+    // the pthread config is global, put back the caller's once the link threads are created
+    esp_pthread_cfg_t saved_cfg;
+    bool has_saved_cfg = esp_pthread_get_cfg(&saved_cfg) == ESP_OK;
+#endif
+
+    for(size_t i = 0; i < links.size(); i++){
+#ifdef ESP_PLATFORM
+        esp_pthread_cfg_t cfg = esp_pthread_get_default_config();
+        if(links[i].core >= 0){
+            cfg.pin_to_core = links[i].core;
+        }
+        esp_pthread_set_cfg(&cfg);
+#endif
+        links[i].thread = std::thread(&DeviceGroup::run_link, this, i);
+    }
+
+#ifdef ESP_PLATFORM
+    esp_pthread_cfg_t restored_cfg = has_saved_cfg ? saved_cfg : esp_pthread_get_default_config();
+    esp_pthread_set_cfg(&restored_cfg);
+#endif
+}
+
+void DeviceGroup::stop(){
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        running = false;
+    }
+    queue_not_full.notify_all();
+    for(auto& link : links){
+        if(link.thread.joinable()){
+            link.thread.join();
+        }
+    }
+}
+
+void DeviceGroup::run_link(size_t device){
+    Link& link = links[device];
+
+    while(running){
+        bool received = false;
+        for(const auto& stream_name : link.stream_names){
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                queue_not_full.wait(lock, [this]{ return queue.size() < max_queued || !running; });
+            }
+            if(!running){
+                return;
+            }
+
+            GroupMessage group_msg;
+            group_msg.device = device;
+            group_msg.stream_name = stream_name;
+            if(!link.api->req_message(&group_msg.msg, stream_name.c_str())){
+                continue;
+            }
+            link.api->spi_pop_message(stream_name.c_str());
+            received = true;
+
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                queue.push_back(std::move(group_msg));
+            }
+            queue_not_empty.notify_one();
+        }
+
+        // nothing on any stream, don't keep the bus busy with empty polls
+        if(!received){
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+}
+
+bool DeviceGroup::get_message(GroupMessage* group_msg, uint32_t timeout_ms){
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    if(!queue_not_empty.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this]{ return !queue.empty(); })){
+        return false;
+    }
+    *group_msg = std::move(queue.front());
+    queue.pop_front();
+    lock.unlock();
+    queue_not_full.notify_one();
+    return true;
+}
+
+void DeviceGroup::free_message(GroupMessage* group_msg){
+    free(group_msg->msg.raw_data.data);
+    free(group_msg->msg.raw_meta.data);
+    group_msg->msg = {};
+}
+
+}  // namespace dai
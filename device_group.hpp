@@ -0,0 +1,64 @@
+#ifndef SHARED_DEVICE_GROUP_H
+#define SHARED_DEVICE_GROUP_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "spi_api.hpp"
+
+namespace dai {
+
+struct GroupMessage {
+    size_t device;          // index returned by add_device
+    std::string stream_name;
+    Message msg;
+};
+
+// Drives several SpiApi links, each on its own bus, in parallel. Every link gets a thread which polls its streams
+// round-robin with req_message - so per stream budgets, decimation and retry policies set on the SpiApi apply - and
+// pushes what it receives into one shared queue. When the queue is full the links stop fetching and messages wait
+// on the devices.
+class DeviceGroup {
+    public:
+        explicit DeviceGroup(size_t max_queued = 16);
+        ~DeviceGroup();
+
+        // api must use its own transport (see the context carrying set_*_impl) and outlive the group. core pins the
+        // link thread on ESP32, -1 leaves it unpinned. Devices are added before start(), while the group runs SIZE_MAX
+        // is returned.
+        size_t add_device(SpiApi& api, const std::vector<std::string>& stream_names, int core = -1);
+
+        void start();
+        void stop();
+
+        // waits up to timeout_ms for a message from any device, the message is already popped from its device
+        bool get_message(GroupMessage* group_msg, uint32_t timeout_ms);
+        void free_message(GroupMessage* group_msg);
+
+    private:
+        struct Link {
+            SpiApi* api;
+            std::vector<std::string> stream_names;
+            int core;
+            std::thread thread;
+        };
+
+        size_t max_queued;
+        std::vector<Link> links;
+        std::deque<GroupMessage> queue;
+        std::mutex queue_mutex;
+        std::condition_variable queue_not_empty;
+        std::condition_variable queue_not_full;
+        std::atomic<bool> running;
+
+        void run_link(size_t device);
+};
+
+}  // namespace dai
+
+#endif
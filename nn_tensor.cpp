@@ -0,0 +1,197 @@
+#include "nn_tensor.hpp"
+
+#include <cstring>
+
+#include "float16.h"
+
+namespace dai {
+
+static uint32_t data_type_size(TensorInfo::DataType type){
+    switch(type){
+        case TensorInfo::DataType::FP16:
+            return 2;
+        case TensorInfo::DataType::U8F:
+        case TensorInfo::DataType::I8:
+            return 1;
+        case TensorInfo::DataType::INT:
+        case TensorInfo::DataType::FP32:
+            return 4;
+        default:
+            return 0;
+    }
+}
+
+// strides as sent, or packed ones with the last dimension varying fastest if the device didn't send any
+static std::vector<unsigned> tensor_strides(const TensorInfo& info){
+    if(info.strides.size() == info.dims.size()){
+        return info.strides;
+    }
+    std::vector<unsigned> strides(info.dims.size());
+    unsigned stride = data_type_size(info.dataType);
+    for(size_t i = info.dims.size(); i-- > 0;){
+        strides[i] = stride;
+        stride *= info.dims[i];
+    }
+    return strides;
+}
+
+TensorView::TensorView() : info(nullptr), bytes(nullptr), size(0) {}
+
+TensorView::TensorView(const TensorInfo* info, const uint8_t* data, uint32_t size) : info(info), bytes(data), size(size) {
+    effective_strides = tensor_strides(*info);
+}
+
+uint32_t TensorView::tensor_byte_size(const TensorInfo& info){
+    std::vector<unsigned> strides = tensor_strides(info);
+    uint32_t last = 0;
+    for(size_t i = 0; i < info.dims.size(); i++){
+        if(info.dims[i] == 0){
+            return 0;
+        }
+        last += (info.dims[i] - 1) * strides[i];
+    }
+    return last + data_type_size(info.dataType);
+}
+
+size_t TensorView::element_count() const {
+    size_t count = 1;
+    for(unsigned dim : info->dims){
+        count *= dim;
+    }
+    return count;
+}
+
+uint32_t TensorView::element_size() const {
+    return data_type_size(info->dataType);
+}
+
+bool TensorView::is_dense() const {
+    return element_count() * element_size() == tensor_byte_size(*info);
+}
+
+float TensorView::load(const uint8_t* element) const {
+    switch(info->dataType){
+        case TensorInfo::DataType::FP16: {
+            uint16_t bits;
+            memcpy(&bits, element, sizeof(bits));
+            return f16_to_f32(bits);
+        }
+        case TensorInfo::DataType::U8F:
+            return *element;
+        case TensorInfo::DataType::I8:
+            return (int8_t) *element;
+        case TensorInfo::DataType::INT: {
+            int32_t value;
+            memcpy(&value, element, sizeof(value));
+            return (float) value;
+        }
+        case TensorInfo::DataType::FP32: {
+            float value;
+            memcpy(&value, element, sizeof(value));
+            return value;
+        }
+        default:
+            return 0;
+    }
+}
+
+float TensorView::get(const unsigned* index) const {
+    size_t offset = 0;
+    for(size_t i = 0; i < effective_strides.size(); i++){
+        offset += (size_t) index[i] * effective_strides[i];
+    }
+    return load(bytes + offset);
+}
+
+float TensorView::get_flat(size_t i) const {
+    return load(bytes + i * element_size());
+}
+
+
+NNTensorIndex::NNTensorIndex(SpiApi& api) : api(api) {}
+
+bool NNTensorIndex::index(const char* stream_name, Metadata* metadata){
+    if(metadata->type != DatatypeEnum::NNData){
+        printf("stream %s doesn't carry NNData\n", stream_name);
+        return false;
+    }
+
+    RawNNData nn_data;
+    if(!api.parse_metadata(metadata, nn_data)){
+        return false;
+    }
+
+    std::map<std::string, TensorInfo>& layout = layouts[stream_name];
+    layout.clear();
+    for(const auto& tensor : nn_data.tensors){
+        layout[tensor.name] = tensor;
+    }
+    return true;
+}
+
+const TensorInfo* NNTensorIndex::find(const char* stream_name, const std::string& layer){
+    auto stream = layouts.find(stream_name);
+    if(stream == layouts.end()){
+        return nullptr;
+    }
+    auto tensor = stream->second.find(layer);
+    if(tensor == stream->second.end()){
+        printf("no layer %s on stream %s\n", layer.c_str(), stream_name);
+        return nullptr;
+    }
+    return &tensor->second;
+}
+
+void NNTensorIndex::invalidate(const char* stream_name){
+    layouts.erase(stream_name);
+}
+
+bool NNTensorIndex::view(const Message& msg, const char* stream_name, const std::string& layer, TensorView* view){
+    if(layouts.find(stream_name) == layouts.end()){
+        Metadata metadata = msg.raw_meta;
+        if(!index(stream_name, &metadata)){
+            return false;
+        }
+    }
+
+    const TensorInfo* info = find(stream_name, layer);
+    if(info == nullptr){
+        return false;
+    }
+    uint32_t size = TensorView::tensor_byte_size(*info);
+    if(info->offset + size > msg.raw_data.size){
+        printf("layer %s is out of the message data\n", layer.c_str());
+        return false;
+    }
+
+    *view = TensorView(info, msg.raw_data.data + info->offset, size);
+    return true;
+}
+
+bool NNTensorIndex::req_layer(const char* stream_name, const std::string& layer, Data* data, TensorView* view){
+    if(layouts.find(stream_name) == layouts.end()){
+        Metadata metadata;
+        if(!api.req_metadata(&metadata, stream_name)){
+            return false;
+        }
+        bool indexed = index(stream_name, &metadata);
+        free(metadata.data);
+        if(!indexed){
+            return false;
+        }
+    }
+
+    const TensorInfo* info = find(stream_name, layer);
+    if(info == nullptr){
+        return false;
+    }
+    uint32_t size = TensorView::tensor_byte_size(*info);
+    if(!api.req_data_partial(data, stream_name, info->offset, size)){
+        return false;
+    }
+
+    *view = TensorView(info, data->data, size);
+    return true;
+}
+
+}  // namespace dai
@@ -0,0 +1,84 @@
+#ifndef SHARED_NN_TENSOR_H
+#define SHARED_NN_TENSOR_H
+
+#include <initializer_list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "spi_api.hpp"
+
+namespace dai {
+
+// One output layer of an NNData message, over data owned by someone else (a Message or a Data from req_layer).
+// Nothing is copied, the view is valid as long as that data and the NNTensorIndex it came from.
+class TensorView {
+    public:
+        TensorView();
+        TensorView(const TensorInfo* info, const uint8_t* data, uint32_t size);
+
+        bool valid() const { return info != nullptr; }
+        const std::string& name() const { return info->name; }
+        TensorInfo::DataType type() const { return info->dataType; }
+        const std::vector<unsigned>& dims() const { return info->dims; }
+        // in bytes, in the order of dims
+        const std::vector<unsigned>& strides() const { return effective_strides; }
+
+        size_t element_count() const;
+        uint32_t element_size() const;
+        uint32_t byte_size() const { return size; }
+        // elements follow each other without padding, so the flat accessors can be used
+        bool is_dense() const;
+
+        const uint8_t* data() const { return bytes; }
+        // typed pointer to the first element, nullptr if T doesn't match the element size
+        template<typename T>
+        const T* data_as() const {
+            return sizeof(T) == element_size() ? reinterpret_cast<const T*>(bytes) : nullptr;
+        }
+
+        // element at a position given per dimension, converted to float whatever the type
+        float get(const unsigned* index) const;
+        float get(std::initializer_list<unsigned> index) const { return get(index.begin()); }
+        // i-th element of a dense tensor
+        float get_flat(size_t i) const;
+
+        // bytes spanned by a tensor, from its first element
+        static uint32_t tensor_byte_size(const TensorInfo& info);
+
+    private:
+        const TensorInfo* info;
+        const uint8_t* bytes;
+        uint32_t size;
+        std::vector<unsigned> effective_strides;
+
+        float load(const uint8_t* element) const;
+};
+
+// Finds NN output layers by name. The tensor layout of a stream is parsed from the first NNData metadata seen and
+// cached, as it doesn't change while the pipeline runs; call invalidate if it does.
+class NNTensorIndex {
+    public:
+        explicit NNTensorIndex(SpiApi& api);
+
+        // view of a layer in a message received with req_message
+        bool view(const Message& msg, const char* stream_name, const std::string& layer, TensorView* view);
+
+        // Receives only the layer's byte range of the message at the front of the stream, with req_data_partial. The
+        // metadata is read only if the stream isn't indexed yet. data must be freed by the caller, the message isn't
+        // popped.
+        bool req_layer(const char* stream_name, const std::string& layer, Data* data, TensorView* view);
+
+        void invalidate(const char* stream_name);
+
+    private:
+        SpiApi& api;
+        std::map<std::string, std::map<std::string, TensorInfo>> layouts;
+
+        bool index(const char* stream_name, Metadata* metadata);
+        const TensorInfo* find(const char* stream_name, const std::string& layer);
+};
+
+}  // namespace dai
+
+#endif
@@ -1,4 +1,5 @@
 #include "spi_api.hpp"
+#include "float16.h"
 
 #include <cstdio>
 #include <cstdint>
@@ -6,8 +7,18 @@
 #include <cstring>
 #include <cassert>
 #include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <thread>
 
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #define DEBUG_CMD 0
 #define debug_cmd_print(...) \
     do { if (DEBUG_CMD) fprintf(stderr, __VA_ARGS__); } while (0)
@@ -20,6 +31,58 @@ namespace dai {
 // static function definitions
 static std::vector<std::uint8_t> serialize_metadata(const RawBuffer& msg);
 
+template<typename MSG>
+static bool parse_sequence_info_as(SpiApi& api, Metadata* metadata, SequenceInfo* info){
+    MSG msg;
+    if(!api.parse_metadata(metadata, msg)){
+        return false;
+    }
+    info->sequence_num = msg.sequenceNum;
+    info->timestamp = std::chrono::seconds(msg.ts.sec) + std::chrono::nanoseconds(msg.ts.nsec);
+    return true;
+}
+
+// Tracks the receive errors of a single transfer against its RetryPolicy. Made once per request, so the windows of a
+// message and the refetches of its damaged ranges share one error count and one deadline.
+class ErrorBudget {
+    public:
+        ErrorBudget(const RetryPolicy& policy, uint32_t size) : policy(policy) {
+            allowed = policy.max_errors + (uint32_t)(((uint64_t) policy.errors_per_mb * size) >> 20);
+            if(policy.deadline_ms != 0){
+                deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(policy.deadline_ms);
+            }
+        }
+
+        // Counts an error, returns true if the transfer should be given up
+        bool error(bool backoff){
+            errors++;
+            consecutive++;
+            if(errors > allowed){
+                return true;
+            }
+            if(backoff && policy.backoff_us != 0){
+                uint32_t shift = std::min<uint32_t>(consecutive - 1, 6);
+                std::this_thread::sleep_for(std::chrono::microseconds((uint64_t) policy.backoff_us << shift));
+            }
+            return false;
+        }
+
+        void success(){
+            consecutive = 0;
+        }
+
+        bool expired() const {
+            return policy.deadline_ms != 0 && std::chrono::steady_clock::now() > deadline;
+        }
+
+    private:
+        const RetryPolicy& policy;
+        uint32_t allowed = 0;
+        uint32_t errors = 0;
+        uint32_t consecutive = 0;
+        std::chrono::steady_clock::time_point deadline;
+};
+
 void SpiApi::debug_print_hex(uint8_t * data, int len){
     for(int i=0; i<len; i++){
         if(i%80==0){
@@ -40,42 +103,388 @@ void SpiApi::debug_print_char(char * data, int len){
 
 
 SpiApi::SpiApi(){
+    send_spi_impl = NULL;
+    recv_spi_impl = NULL;
+    spi_transfer_impl = NULL;
     chunk_message_cb = NULL;
+    recv_timeout_impl = NULL;
+    send_spi_ctx_impl = NULL;
+    recv_spi_ctx_impl = NULL;
+    spi_transfer_ctx_impl = NULL;
+    recv_timeout_ctx_impl = NULL;
+    chunk_message_ctx_cb = NULL;
+    send_spi_ctx = NULL;
+    recv_spi_ctx = NULL;
+    spi_transfer_ctx = NULL;
+    recv_timeout_ctx = NULL;
+    chunk_message_ctx = NULL;
+    transfer_control = nullptr;
+    send_credits = 0;
+    send_status_timeout = std::chrono::milliseconds(1000);
+    status_tags = StatusTags::UNKNOWN;
+    pipelined_send = false;
+    send_stats = {};
+    send_status_cb = NULL;
+    chunk_producer_cb = NULL;
+    chunk_producer_ctx = NULL;
+    interleave_window_size = 0;
+    in_interleave = false;
+    interleaved_message_cb = NULL;
 
     spi_proto_instance = (SpiProtocolInstance*) malloc(sizeof(SpiProtocolInstance));
     spi_send_packet = (SpiProtocolPacket*) malloc(sizeof(SpiProtocolPacket));
+    spi_resync_instance = (SpiResyncInstance*) malloc(sizeof(SpiResyncInstance));
     spi_protocol_init(spi_proto_instance);
+    spi_resync_init(spi_resync_instance);
+    link_stats = {};
 }
 
 SpiApi::~SpiApi(){
     free(spi_proto_instance);
     free(spi_send_packet);
+    free(spi_resync_instance);
+    for(auto& entry : stream_states){
+        free(entry.second.cached_meta.data);
+    }
+}
+
+LinkStats SpiApi::get_link_stats(){
+    LinkStats stats = link_stats;
+    stats.resynced_packets = spi_resync_instance->resynced_packets;
+    stats.dropped_bytes = spi_resync_instance->dropped_bytes;
+    return stats;
+}
+
+void SpiApi::reset_link_stats(){
+    link_stats = {};
+    spi_resync_instance->resynced_packets = 0;
+    spi_resync_instance->dropped_bytes = 0;
 }
 
 void SpiApi::set_send_spi_impl(uint8_t (*passed_send_spi)(const char*)){
     send_spi_impl = passed_send_spi;
+    send_spi_ctx_impl = NULL;
 }
 
 void SpiApi::set_recv_spi_impl(uint8_t (*passed_recv_spi)(char*)){
     recv_spi_impl = passed_recv_spi;
+    recv_spi_ctx_impl = NULL;
 }
 
 void SpiApi::set_spi_transfer_impl(uint8_t (*transfer_impl)(const void*, size_t, void*, size_t)){
     spi_transfer_impl = transfer_impl;
+    spi_transfer_ctx_impl = NULL;
+}
+
+void SpiApi::set_recv_timeout_impl(void (*timeout_impl)(uint32_t timeout_ms)){
+    recv_timeout_impl = timeout_impl;
+    recv_timeout_ctx_impl = NULL;
+}
+
+void SpiApi::set_send_spi_impl(uint8_t (*passed_send_spi)(void*, const char*), void* ctx){
+    send_spi_ctx_impl = passed_send_spi;
+    send_spi_ctx = ctx;
+}
+
+void SpiApi::set_recv_spi_impl(uint8_t (*passed_recv_spi)(void*, char*), void* ctx){
+    recv_spi_ctx_impl = passed_recv_spi;
+    recv_spi_ctx = ctx;
+}
+
+void SpiApi::set_spi_transfer_impl(uint8_t (*transfer_impl)(void*, const void*, size_t, void*, size_t), void* ctx){
+    spi_transfer_ctx_impl = transfer_impl;
+    spi_transfer_ctx = ctx;
+}
+
+void SpiApi::set_recv_timeout_impl(void (*timeout_impl)(void*, uint32_t timeout_ms), void* ctx){
+    recv_timeout_ctx_impl = timeout_impl;
+    recv_timeout_ctx = ctx;
+}
+
+void SpiApi::set_retry_policy(const RetryPolicy& policy){
+    retry_policy = policy;
+}
+
+void SpiApi::set_retry_policy(const char* stream_name, const RetryPolicy& policy){
+    stream_retry_policies[stream_name] = policy;
+}
+
+const RetryPolicy& SpiApi::get_retry_policy(const char* stream_name){
+    if(!stream_retry_policies.empty()){
+        auto it = stream_retry_policies.find(stream_name);
+        if(it != stream_retry_policies.end()){
+            return it->second;
+        }
+    }
+    return retry_policy;
+}
+
+SpiApi::StreamState& SpiApi::get_stream_state(const char* stream_name){
+    auto it = stream_states.find(stream_name);
+    if(it == stream_states.end()){
+        StreamState state = {};
+        state.last_refill = std::chrono::steady_clock::now();
+        state.stats_since = state.last_refill;
+        it = stream_states.emplace(stream_name, state).first;
+    }
+    return it->second;
+}
+
+void SpiApi::set_stream_budget(const char* stream_name, uint32_t bytes_per_second, uint32_t burst_bytes, OverBudgetAction action){
+    StreamState& state = get_stream_state(stream_name);
+    state.bytes_per_second = bytes_per_second;
+    state.burst_bytes = burst_bytes;
+    state.action = action;
+    state.tokens = burst_bytes;
+    state.last_refill = std::chrono::steady_clock::now();
+    state.stats = {};
+    state.stats.budget_bytes_per_second = bytes_per_second;
+    state.stats_since = state.last_refill;
+}
+
+void SpiApi::clear_stream_budget(const char* stream_name){
+    StreamState& state = get_stream_state(stream_name);
+    state.bytes_per_second = 0;
+    state.stats.budget_bytes_per_second = 0;
+}
+
+StreamStats SpiApi::get_stream_stats(const char* stream_name){
+    StreamState& state = get_stream_state(stream_name);
+    StreamStats stats = state.stats;
+    stats.last_sequence_num = state.has_sequence ? state.last_sequence_num : -1;
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - state.stats_since).count();
+    if(elapsed > 0){
+        stats.achieved_bytes_per_second = (uint32_t) (stats.bytes_fetched / elapsed);
+    }
+    return stats;
+}
+
+void SpiApi::reset_stream_stats(){
+    auto now = std::chrono::steady_clock::now();
+    for(auto& entry : stream_states){
+        uint32_t budget = entry.second.stats.budget_bytes_per_second;
+        entry.second.stats = {};
+        entry.second.stats.budget_bytes_per_second = budget;
+        entry.second.stats_since = now;
+    }
+}
+
+// Checks the stream's token bucket before fetching a message of given size. Over budget, the message is either left
+// on the device or popped without transfer, depending on the stream's OverBudgetAction.
+bool SpiApi::admit_fetch(const char* stream_name, uint32_t size){
+    if(stream_states.empty()){
+        return true;
+    }
+    StreamState& state = get_stream_state(stream_name);
+    if(decimate_message(stream_name, state)){
+        spi_pop_message(stream_name);
+        state.stats.skipped++;
+        return false;
+    }
+    if(state.bytes_per_second == 0){
+        return true;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - state.last_refill).count();
+    state.tokens = std::min<double>(state.tokens + elapsed * state.bytes_per_second, state.burst_bytes);
+    state.last_refill = now;
+
+    if(state.tokens > 0 || size == 0){
+        return true;
+    }
+
+    if(state.action == OverBudgetAction::DECIMATE){
+        spi_pop_message(stream_name);
+        state.stats.decimated++;
+    } else {
+        state.stats.deferred++;
+    }
+    return false;
+}
+
+void SpiApi::set_stream_decimation(const char* stream_name, uint32_t keep_every_n){
+    StreamState& state = get_stream_state(stream_name);
+    state.keep_every_n = keep_every_n;
+    state.decimation_counter = 0;
+    state.has_decision = false;
+}
+
+void SpiApi::set_stream_min_interval(const char* stream_name, uint32_t min_interval_ms){
+    StreamState& state = get_stream_state(stream_name);
+    state.min_interval = std::chrono::milliseconds(min_interval_ms);
+    state.has_last_kept = false;
+    state.has_decision = false;
+}
+
+// Returns true if the message at the front of the stream should be skipped by the stream's decimation setting. The
+// counter and the last kept timestamp only move once per message; a deferred or failed fetch gets the same answer when
+// it's retried, until the message is popped.
+bool SpiApi::decimate_message(const char* stream_name, StreamState& state){
+    if(state.has_decision){
+        return state.skip_message;
+    }
+
+    bool skip = state.keep_every_n > 1 && state.decimation_counter != 0;
+    if(!skip && state.min_interval.count() > 0){
+        if(state.cached_meta.data == nullptr && !req_metadata(&state.cached_meta, stream_name)){
+            return false;
+        }
+        SequenceInfo info;
+        if(parse_sequence_info(&state.cached_meta, &info)){
+            skip = state.has_last_kept && info.timestamp - state.last_kept < state.min_interval;
+            if(!skip){
+                state.last_kept = info.timestamp;
+                state.has_last_kept = true;
+            }
+        }
+    }
+
+    if(state.keep_every_n > 1){
+        state.decimation_counter = (state.decimation_counter + 1) % state.keep_every_n;
+    }
+    state.has_decision = true;
+    state.skip_message = skip;
+    return skip;
+}
+
+bool SpiApi::parse_sequence_info(Metadata *passed_metadata, SequenceInfo* info){
+    switch(passed_metadata->type){
+        case DatatypeEnum::ImgFrame:
+            return parse_sequence_info_as<RawImgFrame>(*this, passed_metadata, info);
+        case DatatypeEnum::NNData:
+            return parse_sequence_info_as<RawNNData>(*this, passed_metadata, info);
+        case DatatypeEnum::ImgDetections:
+            return parse_sequence_info_as<RawImgDetections>(*this, passed_metadata, info);
+        case DatatypeEnum::SpatialImgDetections:
+            return parse_sequence_info_as<RawSpatialImgDetections>(*this, passed_metadata, info);
+        case DatatypeEnum::Tracklets:
+            return parse_sequence_info_as<RawTracklets>(*this, passed_metadata, info);
+        case DatatypeEnum::SpatialLocationCalculatorData:
+            return parse_sequence_info_as<RawSpatialLocations>(*this, passed_metadata, info);
+        default:
+            return false;
+    }
+}
+
+void SpiApi::track_sequence(const char* stream_name, Metadata* metadata){
+    SequenceInfo info;
+    if(!parse_sequence_info(metadata, &info)){
+        return;
+    }
+
+    StreamState& state = get_stream_state(stream_name);
+    // the same message read again before it's popped, e.g. req_metadata followed by req_message
+    if(state.front_tracked && info.sequence_num == state.front_sequence_num){
+        return;
+    }
+    uint32_t untracked_pops = state.untracked_pops;
+    state.front_tracked = true;
+    state.front_sequence_num = info.sequence_num;
+    state.untracked_pops = 0;
+    if(!state.has_sequence){
+        state.has_sequence = true;
+        state.last_sequence_num = info.sequence_num;
+        return;
+    }
+
+    int64_t last = state.last_sequence_num;
+    if(info.sequence_num == last){
+        state.stats.duplicates++;
+    } else if(info.sequence_num < last){
+        state.stats.reorders++;
+    } else {
+        // messages popped by the host in between account for that many numbers of the gap
+        if(info.sequence_num > last + 1 + untracked_pops){
+            uint64_t missed = info.sequence_num - last - 1 - untracked_pops;
+            int bin = 0;
+            while(bin < SEQUENCE_GAP_BINS - 1 && (missed >> (bin + 1)) != 0){
+                bin++;
+            }
+            state.stats.sequence_gaps++;
+            state.stats.missed_messages += missed;
+            state.stats.gap_histogram[bin]++;
+            link_stats.missed_messages += missed;
+        }
+        state.last_sequence_num = info.sequence_num;
+    }
+}
+
+// Forgets what was read or decided about the message at the front of a stream, once it's popped
+void SpiApi::drop_cached_meta(StreamState& state){
+    free(state.cached_meta.data);
+    state.cached_meta = {};
+    state.has_decision = false;
+}
+
+void SpiApi::account_fetch(const char* stream_name, uint32_t size, bool message){
+    StreamState& state = get_stream_state(stream_name);
+    state.stats.bytes_fetched += size;
+    if(message){
+        state.stats.messages_fetched++;
+    }
+    if(state.bytes_per_second != 0){
+        state.tokens -= size;
+    }
 }
 
 uint8_t SpiApi::generic_send_spi(const char* spi_send_packet){
+    // anything held over for resync belongs to the previous exchange
+    spi_resync_reset(spi_resync_instance);
+    if(send_spi_ctx_impl != NULL){
+        return (*send_spi_ctx_impl)(send_spi_ctx, spi_send_packet);
+    }
     return (*send_spi_impl)(spi_send_packet);
 }
 
 uint8_t SpiApi::generic_recv_spi(char* recvbuf){
+    if(recv_spi_ctx_impl != NULL){
+        return (*recv_spi_ctx_impl)(recv_spi_ctx, recvbuf);
+    }
     return (*recv_spi_impl)(recvbuf);
 }
 
 uint8_t SpiApi::generic_spi_transfer(const void* send_buffer, size_t send_size, void* receive_buffer, size_t receive_size){
+    if(spi_transfer_ctx_impl != NULL){
+        return (*spi_transfer_ctx_impl)(spi_transfer_ctx, send_buffer, send_size, receive_buffer, receive_size);
+    }
     return (*spi_transfer_impl)(send_buffer, send_size, receive_buffer, receive_size);
 }
 
+void SpiApi::generic_set_recv_timeout(uint32_t timeout_ms){
+    if(recv_timeout_ctx_impl != NULL){
+        (*recv_timeout_ctx_impl)(recv_timeout_ctx, timeout_ms);
+    } else if(recv_timeout_impl != NULL){
+        (*recv_timeout_impl)(timeout_ms);
+    }
+}
+
+bool SpiApi::has_chunk_cb(){
+    return chunk_message_cb != NULL || chunk_message_ctx_cb != NULL;
+}
+
+void SpiApi::generic_chunk_cb(void* curr_packet, uint32_t chunk_size, uint32_t message_size){
+    if(chunk_message_ctx_cb != NULL){
+        (*chunk_message_ctx_cb)(chunk_message_ctx, curr_packet, chunk_size, message_size);
+    } else if(chunk_message_cb != NULL){
+        chunk_message_cb(curr_packet, chunk_size, message_size);
+    }
+}
+
+// Extracts a packet from a received burst. Bursts whose packet boundaries have drifted (eg. after a CS glitch) are
+// realigned across adjacent bursts instead of being discarded. Returns one of spi_resync_status.
+int SpiApi::parse_packet(const char* recvbuf, SpiProtocolPacket** packet){
+    int status = spi_resync_feed(spi_resync_instance, spi_proto_instance, (const uint8_t*)recvbuf, SPI_PKT_SIZE, packet);
+    if(status == SPI_RESYNC_PACKET){
+        link_stats.packets++;
+    } else if(status == SPI_RESYNC_CORRUPT){
+        link_stats.corrupt_packets++;
+    } else if(status == SPI_RESYNC_LOST){
+        link_stats.lost_bursts++;
+    }
+    return status;
+}
+
 uint8_t SpiApi::spi_get_size(SpiGetSizeResp *response, spi_command get_size_cmd, const char * stream_name){
     assert(isGetSizeCmd(get_size_cmd));
 
@@ -116,66 +525,255 @@ uint8_t SpiApi::spi_get_size(SpiGetSizeResp *response, spi_command get_size_cmd,
     return success;
 }
 
-uint8_t SpiApi::spi_get_message(SpiGetMessageResp *response, spi_command get_mess_cmd, const char * stream_name, uint32_t size){
-    assert(isGetMessageCmd(get_mess_cmd));
-
-    uint8_t success = 0;
-    debug_cmd_print("sending spi_get_message cmd.\n");
-    spi_generate_command(spi_send_packet, get_mess_cmd, strlen(stream_name)+1, stream_name);
-    generic_send_spi((char*)spi_send_packet);
+// Receives 'size' bytes of a response stream, handing each packet's payload (and its offset) to on_packet.
+// Errors are counted against the stream's RetryPolicy. An aligned packet with a bad CRC still takes up its slot; if
+// 'damaged' is given, its range is recorded there for a later repair, otherwise the transfer is drained and failed.
+// After a lost packet the offsets of the following ones are unknown, the rest of the response is drained and recorded
+// as damaged, or the transfer fails.
+uint8_t SpiApi::recv_payload(const char * stream_name, uint32_t size, const std::function<void(const uint8_t*, uint32_t, uint32_t)>& on_packet, std::vector<std::pair<uint32_t, uint32_t>>* damaged, ErrorBudget& budget){
+    generic_set_recv_timeout(get_retry_policy(stream_name).packet_timeout_ms);
 
     uint32_t total_recv = 0;
     int debug_skip = 0;
-    int error_count = 0;
+    bool corrupt = false;
     while(total_recv < size){
         if(debug_skip%20 == 0){
-            debug_cmd_print("receive spi_get_message response from remote device... %d/%d\n", total_recv, size);
+            debug_cmd_print("receive response from remote device... %d/%d\n", total_recv, size);
         }
         debug_skip++;
 
+        if(transfer_aborted()){
+            debug_cmd_print("transfer aborted %d/%d\n", total_recv, size);
+            drain_payload(size - total_recv);
+            link_stats.aborted_transfers++;
+            return false;
+        }
+
+        if(budget.expired()){
+            printf("transfer deadline exceeded %d/%d\n", total_recv, size);
+            drain_payload(size - total_recv);
+            return false;
+        }
+
         char recvbuf[BUFF_MAX_SIZE] = {0};
         uint8_t recv_success = generic_recv_spi(recvbuf);
-        if(recv_success){
-            if(recvbuf[0]==START_BYTE_MAGIC){
-                SpiProtocolPacket* spiRecvPacket = spi_protocol_parse(spi_proto_instance, (uint8_t*)recvbuf, sizeof(recvbuf));
-                if(spiRecvPacket == nullptr){
-                    error_count++;
-                    if(error_count > 5){
-                        //printf("Error %d/5...\n", error_count);
-                        return false;
-                    } else {
-                        continue;
-                    }
-                }
+        if(!recv_success){
+            //printf("failed to recv packet\n");
+            if(budget.error(true)){
+                return false;
+            }
+            continue;
+        }
 
-                uint32_t remaining_data = size-total_recv;
-                if ( remaining_data < PAYLOAD_MAX_SIZE ){
-                    memcpy(response->data+total_recv, spiRecvPacket->data, remaining_data);
-                    total_recv += remaining_data;
-                } else {
-                    memcpy(response->data+total_recv, spiRecvPacket->data, PAYLOAD_MAX_SIZE);
-                    total_recv += PAYLOAD_MAX_SIZE;
-                }
+        SpiProtocolPacket* spiRecvPacket = nullptr;
+        int parse_status = parse_packet(recvbuf, &spiRecvPacket);
+        if(parse_status == SPI_RESYNC_PENDING){
+            continue;
+        }
 
-            }else if(recvbuf[0] != 0x00){
-                //printf("*************************************** got a half/non aa packet ************************************************\n");
-                error_count++;
-                if(error_count > 5){
-                    return false;
-                }
-                continue;
-            }
-        } else {
-            //printf("failed to recv packet\n");
-            error_count++;
-            if(error_count > 5){
+        uint32_t remaining_data = size-total_recv;
+        uint32_t curr_packet_size = remaining_data < PAYLOAD_MAX_SIZE ? remaining_data : PAYLOAD_MAX_SIZE;
+
+        if(parse_status == SPI_RESYNC_PACKET){
+            budget.success();
+            on_packet(spiRecvPacket->data, total_recv, curr_packet_size);
+            total_recv += curr_packet_size;
+            continue;
+        }
+
+        //printf("*************************************** got a half/non aa packet ************************************************\n");
+        if(budget.error(false)){
+            drain_payload(remaining_data - curr_packet_size);
+            return false;
+        }
+        if(parse_status == SPI_RESYNC_LOST){
+            // Packets carry no offset, so everything after a lost one would land in the wrong place. Skip the rest of
+            // the response and refetch it, or fail.
+            uint32_t skipped = PAYLOAD_MAX_SIZE + (spiRecvPacket != nullptr ? PAYLOAD_MAX_SIZE : 0);
+            drain_payload(remaining_data > skipped ? remaining_data - skipped : 0);
+            if(damaged == nullptr){
                 return false;
             }
+            if(!damaged->empty() && damaged->back().first + damaged->back().second == total_recv){
+                damaged->back().second += remaining_data;
+            } else {
+                damaged->push_back({total_recv, remaining_data});
+            }
+            return true;
+        }
+        if(parse_status == SPI_RESYNC_CORRUPT){
+            if(damaged != nullptr){
+                if(!damaged->empty() && damaged->back().first + damaged->back().second == total_recv){
+                    damaged->back().second += curr_packet_size;
+                } else {
+                    damaged->push_back({total_recv, curr_packet_size});
+                }
+            }
+            corrupt = true;
+            total_recv += curr_packet_size;
+        }
+    }
+
+    return damaged != nullptr || !corrupt;
+}
+
+// Refetches ranges of a message which arrived corrupt, using GET_MESSAGE_PART
+uint8_t SpiApi::repair_payload(uint8_t* data, const char * stream_name, uint32_t offset, const std::vector<std::pair<uint32_t, uint32_t>>& damaged, ErrorBudget& budget){
+    for(const auto& range : damaged){
+        SpiGetMessageResp part_resp;
+        part_resp.data = data + range.first;
+
+        debug_cmd_print("repairing %d bytes at offset %d.\n", range.second, offset + range.first);
+        spi_generate_command_partial(spi_send_packet, GET_MESSAGE_PART, strlen(stream_name)+1, stream_name, offset + range.first, range.second);
+        generic_send_spi((char*)spi_send_packet);
+
+        uint8_t repaired = recv_payload(stream_name, range.second, [&part_resp](const uint8_t* packet, uint32_t packet_offset, uint32_t packet_size){
+            memcpy(part_resp.data + packet_offset, packet, packet_size);
+        }, nullptr, budget);
+        if(!repaired){
+            return false;
+        }
+        link_stats.repaired_packets += (range.second + PAYLOAD_MAX_SIZE - 1) / PAYLOAD_MAX_SIZE;
+    }
+    return true;
+}
+
+// Receives and discards the rest of an aborted response, so the next command starts from a known state
+void SpiApi::drain_payload(uint32_t size){
+    uint32_t drained = 0;
+    while(drained < size){
+        char recvbuf[BUFF_MAX_SIZE] = {0};
+        if(!generic_recv_spi(recvbuf)){
+            break;
+        }
+        SpiProtocolPacket* spiRecvPacket = nullptr;
+        int parse_status = parse_packet(recvbuf, &spiRecvPacket);
+        if(spiRecvPacket != nullptr || parse_status == SPI_RESYNC_CORRUPT){
+            drained += PAYLOAD_MAX_SIZE;
+        }
+    }
+}
+
+bool SpiApi::transfer_aborted(){
+    if(transfer_control == nullptr){
+        return false;
+    }
+    if(transfer_control->token != nullptr && transfer_control->token->is_cancelled()){
+        return true;
+    }
+    return std::chrono::steady_clock::now() > transfer_control->deadline;
+}
+
+// Fetches the data of the message at the front of a stream. Without a TransferControl this is a single GET_MESSAGE,
+// with one the data is requested in GET_MESSAGE_PART windows, checking for an abort between them.
+// If repair_data is given (contiguous destination), corrupt packets are refetched into it.
+uint8_t SpiApi::recv_message_data(const char * stream_name, uint32_t size, const std::function<void(const uint8_t*, uint32_t, uint32_t)>& on_packet, uint8_t* repair_data, ErrorBudget& budget){
+    std::vector<std::pair<uint32_t, uint32_t>> damaged;
+    std::vector<std::pair<uint32_t, uint32_t>>* p_damaged = repair_data != nullptr ? &damaged : nullptr;
+
+    uint32_t window = size;
+    if(transfer_control != nullptr){
+        // 0 - a packet per window, an abort never has anything left to drain
+        window = transfer_control->window_size != 0 ? transfer_control->window_size : PAYLOAD_MAX_SIZE;
+    } else if(!interleaved_streams.empty() && interleave_window_size != 0 && !in_interleave){
+        window = interleave_window_size;
+    }
+
+    if(window >= size){
+        debug_cmd_print("sending GET_MESSAGE cmd.\n");
+        spi_generate_command(spi_send_packet, GET_MESSAGE, strlen(stream_name)+1, stream_name);
+        generic_send_spi((char*)spi_send_packet);
+
+        if(!recv_payload(stream_name, size, on_packet, p_damaged, budget)){
+            return false;
+        }
+        return repair_data == nullptr || repair_payload(repair_data, stream_name, 0, damaged, budget);
+    }
+
+    for(uint32_t offset = 0; offset < size; offset += window){
+        if(transfer_aborted()){
+            link_stats.aborted_transfers++;
+            return false;
+        }
+
+        if(offset != 0){
+            service_interleaved(stream_name);
+        }
+
+        uint32_t window_size = std::min(window, size - offset);
+        debug_cmd_print("sending GET_MESSAGE_PART cmd, window %d/%d.\n", offset, size);
+        spi_generate_command_partial(spi_send_packet, GET_MESSAGE_PART, strlen(stream_name)+1, stream_name, offset, window_size);
+        generic_send_spi((char*)spi_send_packet);
+
+        damaged.clear();
+        uint8_t recv_success = recv_payload(stream_name, window_size, [&on_packet, offset](const uint8_t* packet, uint32_t packet_offset, uint32_t packet_size){
+            on_packet(packet, offset + packet_offset, packet_size);
+        }, p_damaged, budget);
+        if(!recv_success){
+            return false;
+        }
+        if(repair_data != nullptr && !repair_payload(repair_data + offset, stream_name, offset, damaged, budget)){
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Called in between windows of a large transfer: fetches small messages waiting on the interleaved streams.
+// The large message stays at the front of its stream, so the transfer resumes at its offset afterwards.
+void SpiApi::service_interleaved(const char* current_stream){
+    if(interleaved_message_cb == NULL || in_interleave){
+        return;
+    }
+
+    in_interleave = true;
+    const TransferControl* outer_control = transfer_control;
+    transfer_control = nullptr;
+
+    for(const auto& interleaved : interleaved_streams){
+        const char* stream_name = interleaved.name.c_str();
+        if(strcmp(stream_name, current_stream) == 0){
+            continue;
+        }
+
+        SpiGetSizeResp get_size_resp;
+        if(!spi_get_size(&get_size_resp, GET_SIZE, stream_name) || get_size_resp.size > interleaved.max_size){
             continue;
         }
+
+        Message msg;
+        if(req_message_sized(&msg, stream_name, &get_size_resp.size)){
+            interleaved_message_cb(&msg, stream_name);
+            free_message(&msg);
+            spi_pop_message(stream_name);
+            link_stats.interleaved_messages++;
+        }
+    }
+
+    transfer_control = outer_control;
+    in_interleave = false;
+}
+
+uint8_t SpiApi::spi_get_message(SpiGetMessageResp *response, spi_command get_mess_cmd, const char * stream_name, uint32_t size, ErrorBudget& budget){
+    assert(isGetMessageCmd(get_mess_cmd));
+
+    uint8_t recv_success = 0;
+    auto on_packet = [response](const uint8_t* packet, uint32_t offset, uint32_t packet_size){
+        memcpy(response->data+offset, packet, packet_size);
+    };
+
+    if(get_mess_cmd == GET_MESSAGE){
+        // message data can be windowed and refetched partially
+        recv_success = recv_message_data(stream_name, size, on_packet, response->data, budget);
+    } else {
+        debug_cmd_print("sending spi_get_message cmd.\n");
+        spi_generate_command(spi_send_packet, get_mess_cmd, strlen(stream_name)+1, stream_name);
+        generic_send_spi((char*)spi_send_packet);
+        recv_success = recv_payload(stream_name, size, on_packet, nullptr, budget);
     }
 
-    if(error_count == 0 && total_recv==size){
+    if(recv_success){
         spi_parse_get_message(response, size, get_mess_cmd);
 
         if(DEBUG_MESSAGE_CONTENTS){
@@ -184,7 +782,7 @@ uint8_t SpiApi::spi_get_message(SpiGetMessageResp *response, spi_command get_mes
         }
         return true;
     } else {
-        //printf("full packet not received %d/%d!\n", total_recv, size);
+        //printf("full packet not received!\n");
         return false;
     }
 
@@ -192,69 +790,28 @@ uint8_t SpiApi::spi_get_message(SpiGetMessageResp *response, spi_command get_mes
 
 
 
-uint8_t SpiApi::spi_get_message_partial(SpiGetMessageResp *response, const char * stream_name, uint32_t offset, uint32_t size){
-    uint8_t success = 0;
+uint8_t SpiApi::spi_get_message_partial(SpiGetMessageResp *response, const char * stream_name, uint32_t offset, uint32_t size, ErrorBudget& budget){
     debug_cmd_print("sending GET_MESSAGE_PART cmd.\n");
     spi_generate_command_partial(spi_send_packet, GET_MESSAGE_PART, strlen(stream_name)+1, stream_name, offset, size);
     generic_send_spi((char*)spi_send_packet);
 
-    uint32_t total_recv = 0;
-    int debug_skip = 0;
-    int error_count = 0;
-    while(total_recv < size){
-        if(debug_skip%20 == 0){
-            debug_cmd_print("receive GET_MESSAGE_PART response from remote device... %d/%d\n", total_recv, size);
-        }
-        debug_skip++;
-
-        char recvbuf[BUFF_MAX_SIZE] = {0};
-        uint8_t recv_success = generic_recv_spi(recvbuf);
-        if(recv_success){
-            if(recvbuf[0]==START_BYTE_MAGIC){
-                SpiProtocolPacket* spiRecvPacket = spi_protocol_parse(spi_proto_instance, (uint8_t*)recvbuf, sizeof(recvbuf));
-                if(spiRecvPacket == nullptr){
-                    error_count++;
-                    if(error_count > 5){
-                        //printf("Error %d/5...\n", error_count);
-                        return false;
-                    } else {
-                        continue;
-                    }
-                }
-
-                uint32_t remaining_data = size-total_recv;
-                if ( remaining_data < PAYLOAD_MAX_SIZE ){
-                    memcpy(response->data+total_recv, spiRecvPacket->data, remaining_data);
-                    total_recv += remaining_data;
-                } else {
-                    memcpy(response->data+total_recv, spiRecvPacket->data, PAYLOAD_MAX_SIZE);
-                    total_recv += PAYLOAD_MAX_SIZE;
-                }
-
-            }else if(recvbuf[0] != 0x00){
-                printf("*************************************** got a half/non aa packet ************************************************\n");
-                break;
-            }
-        } else {
-            printf("failed to recv packet\n");
-            break;
-        }
-    }
+    std::vector<std::pair<uint32_t, uint32_t>> damaged;
+    uint8_t recv_success = recv_payload(stream_name, size, [response](const uint8_t* packet, uint32_t packet_offset, uint32_t packet_size){
+        memcpy(response->data+packet_offset, packet, packet_size);
+    }, &damaged, budget);
 
-    if(total_recv==size){
+    if(recv_success && repair_payload(response->data, stream_name, offset, damaged, budget)){
         spi_parse_get_message(response, size, GET_MESSAGE_PART);
 
         if(DEBUG_MESSAGE_CONTENTS){
             printf("data_size: %d\n", response->data_size);
             debug_print_hex((uint8_t*)response->data, response->data_size);
         }
-        success = 1;
+        return true;
     } else {
-        printf("full packet not received %d/%d!\n", total_recv, size);
-        success = 0;
+        printf("full packet not received!\n");
+        return false;
     }
-
-    return success;
 }
 
 
@@ -268,6 +825,14 @@ uint8_t SpiApi::spi_pop_messages(){
     SpiStatusResp response;
     uint8_t success = 0;
 
+    // an unknown number of messages is dropped, sequence tracking starts over
+    for(auto& entry : stream_states){
+        drop_cached_meta(entry.second);
+        entry.second.has_sequence = false;
+        entry.second.front_tracked = false;
+        entry.second.untracked_pops = 0;
+    }
+
     debug_cmd_print("sending POP_MESSAGES cmd.\n");
     spi_generate_command(spi_send_packet, POP_MESSAGES, strlen(NOSTREAM)+1, NOSTREAM);
     generic_send_spi((char*)spi_send_packet);
@@ -304,6 +869,15 @@ uint8_t SpiApi::spi_pop_message(const char * stream_name){
     uint8_t success = 0;
     SpiStatusResp response;
 
+    StreamState* state = nullptr;
+    if(!stream_states.empty()){
+        auto it = stream_states.find(stream_name);
+        if(it != stream_states.end()){
+            state = &it->second;
+            drop_cached_meta(*state);
+        }
+    }
+
     debug_cmd_print("sending POP_MESSAGE cmd.\n");
     spi_generate_command(spi_send_packet, POP_MESSAGE, strlen(stream_name)+1, stream_name);
     generic_send_spi((char*)spi_send_packet);
@@ -322,6 +896,13 @@ uint8_t SpiApi::spi_pop_message(const char * stream_name){
             spi_status_resp(&response, spiRecvPacket->data);
             if(response.status == SPI_MSG_SUCCESS_RESP){
                 success = 1;
+                // a message popped without its sequence number being read isn't a device side drop
+                if(state != nullptr){
+                    if(state->has_sequence && !state->front_tracked){
+                        state->untracked_pops++;
+                    }
+                    state->front_tracked = false;
+                }
             }
 
         }else if(recvbuf[0] != 0x00){
@@ -397,7 +978,7 @@ void SpiApi::transfer(const void* buffer, int size){
         assert(ret == SPI_PROTOCOL_OK);
 
         // Transmit the packet
-        generic_send_spi((char*)packet);
+        send_payload_packet(packet);
     }
 }
 
@@ -426,7 +1007,7 @@ void SpiApi::transfer2(const void* buffer1, const void* buffer2, int size1, int
         // case where we are sending from both buffers
         } else if(currOffset + maxPayloadSize > size1 && currOffset < size1) {
             int buf1size = size1 - currOffset;
-            int buf2size = maxPayloadSize - buf1size;
+            int buf2size = toWrite - buf1size;
             auto ret = spi_protocol_write_packet2(packet, p_buffer1 + currOffset, p_buffer2, buf1size, buf2size);
             assert(ret == SPI_PROTOCOL_OK);
         // case where we are sending from buffer2
@@ -437,21 +1018,21 @@ void SpiApi::transfer2(const void* buffer1, const void* buffer2, int size1, int
         }
 
         // Transmit the packet
-        generic_send_spi((char*)packet);
+        send_payload_packet(packet);
     }
 }
 
-uint8_t SpiApi::send_data(Data *sdata, const char* stream_name){
-    uint8_t req_success = 0;
+// Sends SEND_DATA and waits for the device to accept the upload
+bool SpiApi::send_data_command(const char* stream_name, uint32_t metadata_size, uint32_t total_size){
+    bool req_success = false;
     SpiStatusResp response;
 
-    spi_generate_command_send(spi_send_packet, SEND_DATA, strlen(stream_name)+1, stream_name, 0, sdata->size);
+    spi_generate_command_send(spi_send_packet, SEND_DATA, strlen(stream_name)+1, stream_name, metadata_size, total_size);
     generic_send_spi((char*)spi_send_packet);
 
     char recvbuf[BUFF_MAX_SIZE] = {0};
     uint8_t recv_success = generic_recv_spi(recvbuf);
 
-    // actually send the data.
     if(recv_success){
         if(recvbuf[0]==START_BYTE_MAGIC){
             SpiProtocolPacket* spiRecvPacket = spi_protocol_parse(spi_proto_instance, (uint8_t*)recvbuf, sizeof(recvbuf));
@@ -461,23 +1042,31 @@ uint8_t SpiApi::send_data(Data *sdata, const char* stream_name){
 
             spi_status_resp(&response, spiRecvPacket->data);
             if(response.status == SPI_MSG_SUCCESS_RESP){
-                transfer(sdata->data, sdata->size);
-                req_success = 1;
+                req_success = true;
             }
 
         }else if(recvbuf[0] != 0x00){
             printf("*************************************** got a half/non aa packet ************************************************\n");
-            req_success = 0;
+            req_success = false;
         }
     } else {
         printf("failed to recv packet\n");
-        req_success = 0;
+        req_success = false;
     }
 
-
     return req_success;
 }
 
+uint8_t SpiApi::send_data(Data *sdata, const char* stream_name){
+    if(!send_data_command(stream_name, 0, sdata->size)){
+        return false;
+    }
+
+    // actually send the data.
+    transfer(sdata->data, sdata->size);
+    return true;
+}
+
 
 
 bool SpiApi::send_message(const std::shared_ptr<RawBuffer>& sp_msg, const char* stream_name){
@@ -485,51 +1074,407 @@ bool SpiApi::send_message(const std::shared_ptr<RawBuffer>& sp_msg, const char*
 }
 
 bool SpiApi::send_message(const RawBuffer& msg, const char* stream_name){
-    bool req_success = false;
-    SpiStatusResp response;
-    uint32_t total_send_size;
+    std::vector<uint8_t> metadata = serialize_metadata(msg);
+    uint32_t total_send_size = metadata.size() + msg.data.size();
+
+    if(!send_data_command(stream_name, metadata.size(), total_send_size)){
+        return false;
+    }
+
+    // actually send the data.
+    transfer2(msg.data.data(), metadata.data(), msg.data.size(), metadata.size());
+    return true;
+}
+
+void SpiApi::set_chunk_producer_cb(bool (*passed_chunk_producer_cb)(void*, uint8_t*, uint32_t, uint32_t), void* ctx){
+    chunk_producer_cb = passed_chunk_producer_cb;
+    chunk_producer_ctx = ctx;
+}
+
+bool SpiApi::send_data_chunked(uint32_t data_size, const char* stream_name, uint32_t chunk_size){
+    return send_chunked(std::vector<uint8_t>(), data_size, stream_name, chunk_size);
+}
+
+bool SpiApi::send_message_chunked(const RawBuffer& msg, uint32_t data_size, const char* stream_name, uint32_t chunk_size){
+    return send_chunked(serialize_metadata(msg), data_size, stream_name, chunk_size);
+}
+
+// Double buffered - a single worker thread runs the producer, filling one buffer while the other is transmitted.
+// Chunks are whole packets, so only the last one, sent together with the metadata, can end in a partly filled packet.
+bool SpiApi::send_chunked(const std::vector<uint8_t>& metadata, uint32_t data_size, const char* stream_name, uint32_t chunk_size){
+    if(chunk_producer_cb == NULL){
+        printf("WARNING: send_chunked called without setting the producer callback!");
+        return false;
+    }
 
+    chunk_size -= chunk_size % PAYLOAD_MAX_SIZE;
+    if(chunk_size == 0){
+        chunk_size = PAYLOAD_MAX_SIZE;
+    }
+    std::unique_ptr<uint8_t[]> buffers(new uint8_t[2 * chunk_size]);
+    uint32_t chunk_count = (data_size + chunk_size - 1) / chunk_size;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    uint32_t produced = 0;      // chunks filled by the worker
+    uint32_t sent = 0;          // chunks transmitted, their buffer can be filled again
+    bool failed = false;
+    bool stop = false;
+
+    std::thread worker([&]{
+        for(uint32_t i = 0; i < chunk_count; i++){
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&]{ return i < sent + 2 || stop; });
+                if(stop){
+                    return;
+                }
+            }
+            uint32_t offset = i * chunk_size;
+            bool ok = chunk_producer_cb(chunk_producer_ctx, buffers.get() + (i % 2) * chunk_size, offset, std::min(chunk_size, data_size - offset));
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if(ok){
+                    produced++;
+                } else {
+                    failed = true;
+                }
+            }
+            cv.notify_all();
+            if(!ok){
+                return;
+            }
+        }
+    });
+
+    // waits for chunk i, false if the producer gave up before it
+    auto wait_chunk = [&](uint32_t i){
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&]{ return i < produced || failed; });
+        return i < produced;
+    };
+    auto finish = [&](bool success){
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv.notify_all();
+        worker.join();
+        return success;
+    };
+
+    // the first chunk is ready before the device is told to expect the upload
+    if(chunk_count > 0 && !wait_chunk(0)){
+        return finish(false);
+    }
+    if(!send_data_command(stream_name, metadata.size(), data_size + metadata.size())){
+        return finish(false);
+    }
+    if(chunk_count == 0){
+        transfer2(buffers.get(), metadata.data(), 0, metadata.size());
+        return finish(true);
+    }
+
+    for(uint32_t i = 0; i < chunk_count; i++){
+        uint32_t offset = i * chunk_size;
+        if(!wait_chunk(i)){
+            // no way to abort, the device waits for the rest of the upload
+            printf("chunk producer failed %u bytes into a %u byte upload\n", offset, data_size);
+            return finish(false);
+        }
+
+        uint8_t* chunk = buffers.get() + (i % 2) * chunk_size;
+        uint32_t size = std::min(chunk_size, data_size - offset);
+        if(i + 1 == chunk_count){
+            transfer2(chunk, metadata.data(), size, metadata.size());
+        } else {
+            transfer(chunk, size);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            sent++;
+        }
+        cv.notify_all();
+    }
+
+    return finish(true);
+}
+
+uint8_t SpiApi::send_data_f16(const float* data, uint32_t count, const char* stream_name){
+    if(!send_data_command(stream_name, 0, count * sizeof(uint16_t))){
+        return false;
+    }
+    transfer_f16(data, count, nullptr, 0);
+    return true;
+}
+
+bool SpiApi::send_message_f16(const RawBuffer& msg, const float* data, uint32_t count, const char* stream_name){
     std::vector<uint8_t> metadata = serialize_metadata(msg);
-    total_send_size = metadata.size() + msg.data.size();
+    if(!send_data_command(stream_name, metadata.size(), count * sizeof(uint16_t) + metadata.size())){
+        return false;
+    }
+    transfer_f16(data, count, metadata.data(), metadata.size());
+    return true;
+}
+
+// Like transfer2, with the first buffer converted to FP16 one packet at a time. The payload size is even, so a
+// half never straddles two packets.
+void SpiApi::transfer_f16(const float* data, uint32_t count, const uint8_t* metadata, uint32_t metadata_size){
+    // halves are converted in place, so the buffer is a uint16_t array and written bytewise for the metadata
+    uint16_t halves[SPI_PROTOCOL_PAYLOAD_SIZE / sizeof(uint16_t)];
+    uint8_t* payload = (uint8_t*) halves;
+    uint32_t data_size = count * sizeof(uint16_t);
+    uint32_t total_size = data_size + metadata_size;
+
+    for(uint32_t offset = 0; offset < total_size; offset += SPI_PROTOCOL_PAYLOAD_SIZE){
+        uint32_t to_write = std::min<uint32_t>(SPI_PROTOCOL_PAYLOAD_SIZE, total_size - offset);
+        uint32_t filled = 0;
+        if(offset < data_size){
+            filled = std::min(to_write, data_size - offset);
+            f32_to_f16_n(halves, data + offset / sizeof(uint16_t), filled / sizeof(uint16_t));
+        }
+        if(filled < to_write){
+            memcpy(payload + filled, metadata + (offset + filled - data_size), to_write - filled);
+        }
+
+        auto ret = spi_protocol_write_packet(spi_send_packet, payload, to_write);
+        assert(ret == SPI_PROTOCOL_OK);
+        send_payload_packet(spi_send_packet);
+    }
+}
+
+#if defined(__linux__)
+bool SpiApi::send_file(int fd, const char* stream_name){
+    return send_mapped(std::vector<uint8_t>(), fd, stream_name);
+}
+
+bool SpiApi::send_file(const char* path, const char* stream_name){
+    int fd = open(path, O_RDONLY);
+    if(fd < 0){
+        printf("failed to open %s\n", path);
+        return false;
+    }
+    bool success = send_mapped(std::vector<uint8_t>(), fd, stream_name);
+    close(fd);
+    return success;
+}
+
+bool SpiApi::send_message_file(const RawBuffer& msg, int fd, const char* stream_name){
+    return send_mapped(serialize_metadata(msg), fd, stream_name);
+}
+
+bool SpiApi::send_message_file(const RawBuffer& msg, const char* path, const char* stream_name){
+    int fd = open(path, O_RDONLY);
+    if(fd < 0){
+        printf("failed to open %s\n", path);
+        return false;
+    }
+    bool success = send_mapped(serialize_metadata(msg), fd, stream_name);
+    close(fd);
+    return success;
+}
+
+// Packets are written straight from the page cache; the sequential hint lets the kernel read ahead and drop pages
+// behind, so a large file doesn't need private memory.
+bool SpiApi::send_mapped(const std::vector<uint8_t>& metadata, int fd, const char* stream_name){
+    struct stat st;
+    // transfer2 takes int sizes, the whole upload has to fit in one
+    if(fstat(fd, &st) != 0 || (uint64_t) st.st_size > INT32_MAX - metadata.size()){
+        printf("can't send file of fd %d\n", fd);
+        return false;
+    }
+    uint32_t data_size = st.st_size;
+    if(data_size == 0 && metadata.empty()){
+        printf("nothing to send, fd %d is empty\n", fd);
+        return false;
+    }
+
+    void* mapping = nullptr;
+    if(data_size > 0){
+        mapping = mmap(nullptr, data_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(mapping == MAP_FAILED){
+            printf("failed to map fd %d\n", fd);
+            return false;
+        }
+        madvise(mapping, data_size, MADV_SEQUENTIAL);
+    }
+
+    bool success = send_data_command(stream_name, metadata.size(), data_size + metadata.size());
+    if(success && metadata.empty()){
+        transfer(mapping, data_size);
+    } else if(success){
+        transfer2(mapping, metadata.data(), data_size, metadata.size());
+    }
+
+    if(mapping != nullptr){
+        munmap(mapping, data_size);
+    }
+    return success;
+}
+#endif
+
+void SpiApi::set_send_credits(uint32_t credits, uint32_t status_timeout_ms){
+    send_credits = credits;
+    send_status_timeout = std::chrono::milliseconds(status_timeout_ms);
+}
+
+void SpiApi::set_send_status_cb(void (*passed_send_status_cb)(const char* stream_name, bool success)){
+    send_status_cb = passed_send_status_cb;
+}
 
-    spi_generate_command_send(spi_send_packet, SEND_DATA, strlen(stream_name)+1, stream_name, metadata.size(), total_send_size);
+uint32_t SpiApi::get_pending_sends(){
+    return pending_sends.size();
+}
+
+SendStats SpiApi::get_send_stats(){
+    return send_stats;
+}
+
+void SpiApi::send_payload_packet(SpiProtocolPacket* packet){
+    if(!pipelined_send){
+        generic_send_spi((char*)packet);
+        return;
+    }
+
+    // full duplex, statuses of earlier messages come back meanwhile
+    char recvbuf[BUFF_MAX_SIZE] = {0};
+    generic_spi_transfer(packet, SPI_PKT_SIZE, recvbuf, SPI_PKT_SIZE);
+    collect_send_status(recvbuf);
+}
+
+// Picks up a tagged status. Completion statuses arrive in the order the messages were sent and are matched to the
+// oldest pending one, a refused SEND_DATA is only counted - its completion status follows. Anything else is ignored.
+void SpiApi::collect_send_status(const char* recvbuf){
+    SpiProtocolPacket* packet = nullptr;
+    if(parse_packet(recvbuf, &packet) != SPI_RESYNC_PACKET){
+        return;
+    }
+
+    SpiStatusResp response;
+    spi_status_resp(&response, packet->data);
+    bool success = response.status == SPI_MSG_SUCCESS_RESP;
+    uint8_t tag = packet->data[1];
+    if(tag == SEND_STATUS_ACCEPT){
+        if(!success){
+            send_stats.refused++;
+        }
+        return;
+    }
+    if(tag != SEND_STATUS_DONE || pending_sends.empty()){
+        return;
+    }
+
+    if(success){
+        send_stats.acked++;
+    } else {
+        send_stats.failed++;
+    }
+    if(send_status_cb != NULL){
+        send_status_cb(pending_sends.front().c_str(), success);
+    }
+    pending_sends.pop_front();
+}
+
+// Reads until the oldest pending completion status arrives. Gives up after the status timeout, but always reads at
+// least once.
+bool SpiApi::wait_send_status(){
+    size_t pending = pending_sends.size();
+    auto deadline = std::chrono::steady_clock::now() + send_status_timeout;
+    do {
+        char recvbuf[BUFF_MAX_SIZE] = {0};
+        if(generic_recv_spi(recvbuf)){
+            collect_send_status(recvbuf);
+            if(pending_sends.size() < pending){
+                return true;
+            }
+        }
+    } while(std::chrono::steady_clock::now() < deadline);
+    printf("no send status from remote device...\n");
+    return false;
+}
+
+// Sends SEND_DATA and reads its answer to learn whether the firmware tags its statuses. Returns the answer's status,
+// -1 if there was none.
+int SpiApi::probe_status_tags(const char* stream_name, uint32_t metadata_size, uint32_t total_size){
+    spi_generate_command_send(spi_send_packet, SEND_DATA, strlen(stream_name)+1, stream_name, metadata_size, total_size);
     generic_send_spi((char*)spi_send_packet);
 
     char recvbuf[BUFF_MAX_SIZE] = {0};
-    uint8_t recv_success = generic_recv_spi(recvbuf);
+    SpiProtocolPacket* packet = nullptr;
+    if(!generic_recv_spi(recvbuf) || parse_packet(recvbuf, &packet) != SPI_RESYNC_PACKET){
+        printf("no SEND_DATA response from remote device...\n");
+        return -1;
+    }
+    status_tags = packet->data[1] == SEND_STATUS_ACCEPT ? StatusTags::TAGGED : StatusTags::UNTAGGED;
+    SpiStatusResp response;
+    spi_status_resp(&response, packet->data);
+    return response.status;
+}
 
-    // actually send the data.
-    if(recv_success){
-        // TODO: check for SPI_MSG_FAIL_RESP and don't send.
-        if(recvbuf[0]==START_BYTE_MAGIC){
-            SpiProtocolPacket* spiRecvPacket = spi_protocol_parse(spi_proto_instance, (uint8_t*)recvbuf, sizeof(recvbuf));
-            if(spiRecvPacket == nullptr){
+bool SpiApi::send_message_pipelined(const RawBuffer& msg, const char* stream_name){
+    if(send_credits == 0 || status_tags == StatusTags::UNTAGGED || (spi_transfer_impl == NULL && spi_transfer_ctx_impl == NULL)){
+        return send_message(msg, stream_name);
+    }
+
+    // out of credits, the oldest message has to be accounted for first
+    if(pending_sends.size() >= send_credits){
+        send_stats.credit_waits++;
+        while(pending_sends.size() >= send_credits){
+            if(!wait_send_status()){
                 return false;
             }
+        }
+    }
 
-            spi_status_resp(&response, spiRecvPacket->data);
-            if(response.status == SPI_MSG_SUCCESS_RESP){
-                transfer2(msg.data.data(), metadata.data(), msg.data.size(), metadata.size());
-                req_success = true;
-            }
+    std::vector<uint8_t> metadata = serialize_metadata(msg);
+    uint32_t total_send_size = metadata.size() + msg.data.size();
 
-        }else if(recvbuf[0] != 0x00){
-            printf("*************************************** got a half/non aa packet ************************************************\n");
-            req_success = false;
+    if(status_tags == StatusTags::UNKNOWN){
+        // the first send waits for its answer. Firmware without tags took it as a plain SEND_DATA.
+        int status = probe_status_tags(stream_name, metadata.size(), total_send_size);
+        if(status < 0){
+            return false;
+        }
+        if(status_tags == StatusTags::UNTAGGED){
+            if(status != SPI_MSG_SUCCESS_RESP){
+                return false;
+            }
+            transfer2(msg.data.data(), metadata.data(), msg.data.size(), metadata.size());
+            return true;
+        }
+        if(status != SPI_MSG_SUCCESS_RESP){
+            send_stats.refused++;
         }
     } else {
-        printf("failed to recv packet\n");
-        req_success = false;
+        // the device reads the payload whatever its answer, which is collected later
+        pipelined_send = true;
+        spi_generate_command_send(spi_send_packet, SEND_DATA, strlen(stream_name)+1, stream_name, metadata.size(), total_send_size);
+        send_payload_packet(spi_send_packet);
     }
 
+    // queued first, the completion status can come back while this message is still being streamed
+    pending_sends.push_back(stream_name);
+    pipelined_send = true;
+    transfer2(msg.data.data(), metadata.data(), msg.data.size(), metadata.size());
+    pipelined_send = false;
+    send_stats.sent++;
 
-    return req_success;
+    return true;
 }
 
+bool SpiApi::flush_sends(){
+    uint32_t failed = send_stats.failed;
+    while(!pending_sends.empty()){
+        if(!wait_send_status()){
+            return false;
+        }
+    }
+    return send_stats.failed == failed;
+}
 
 uint8_t SpiApi::req_data(Data *requested_data, const char* stream_name){
     uint8_t req_success = 0;
-    SpiGetMessageResp get_message_resp;
 
     // do a get_size before trying to retreive message.
     SpiGetSizeResp get_size_resp;
@@ -538,25 +1483,39 @@ uint8_t SpiApi::req_data(Data *requested_data, const char* stream_name){
 
     // get message (assuming we got size)
     if(req_success){
+        req_success = req_data_sized(requested_data, stream_name, get_size_resp.size);
+    }
 
-        // If message has any data
-        if(get_size_resp.size > 0){
-            get_message_resp.data = (uint8_t*) malloc(get_size_resp.size);
-            req_success = spi_get_message(&get_message_resp, GET_MESSAGE, stream_name, get_size_resp.size);
-            if(req_success){
-                requested_data->data = get_message_resp.data;
-                requested_data->size = get_message_resp.data_size;
-            } else {
-                free(get_message_resp.data);
-                return false;
-            }
+    return req_success;
+}
+
+// req_data for a message whose size was already read with GET_SIZE
+uint8_t SpiApi::req_data_sized(Data *requested_data, const char* stream_name, uint32_t size){
+    uint8_t req_success = 0;
+    SpiGetMessageResp get_message_resp;
+
+    if(!admit_fetch(stream_name, size)){
+        return false;
+    }
+
+    // If message has any data
+    if(size > 0){
+        get_message_resp.data = (uint8_t*) malloc(size);
+        ErrorBudget budget(get_retry_policy(stream_name), size);
+        req_success = spi_get_message(&get_message_resp, GET_MESSAGE, stream_name, size, budget);
+        if(req_success){
+            requested_data->data = get_message_resp.data;
+            requested_data->size = get_message_resp.data_size;
+            account_fetch(stream_name, size, true);
         } else {
-            // message doesn't have any data
-            requested_data->data = nullptr;
-            requested_data->size = 0;
-            req_success = 1;
+            free(get_message_resp.data);
+            return false;
         }
-
+    } else {
+        // message doesn't have any data
+        requested_data->data = nullptr;
+        requested_data->size = 0;
+        req_success = 1;
     }
 
     return req_success;
@@ -566,6 +1525,16 @@ uint8_t SpiApi::req_metadata(Metadata *requested_data, const char* stream_name){
     uint8_t req_success = 0;
     SpiGetMessageResp get_message_resp;
 
+    // already read while deciding on decimation
+    if(!stream_states.empty()){
+        auto it = stream_states.find(stream_name);
+        if(it != stream_states.end() && it->second.cached_meta.data != nullptr){
+            *requested_data = it->second.cached_meta;
+            it->second.cached_meta = {};
+            return true;
+        }
+    }
+
     // do a get_size before trying to retreive message.
     SpiGetSizeResp get_size_resp;
     req_success = spi_get_size(&get_size_resp, GET_METASIZE, stream_name);
@@ -575,11 +1544,14 @@ uint8_t SpiApi::req_metadata(Metadata *requested_data, const char* stream_name){
     if(req_success){
         get_message_resp.data = (uint8_t*) malloc(get_size_resp.size);
         if(get_message_resp.data){
-            req_success = spi_get_message(&get_message_resp, GET_METADATA, stream_name, get_size_resp.size);
+            ErrorBudget budget(get_retry_policy(stream_name), get_size_resp.size);
+            req_success = spi_get_message(&get_message_resp, GET_METADATA, stream_name, get_size_resp.size, budget);
             if(req_success){
                 requested_data->data = get_message_resp.data;
                 requested_data->size = get_message_resp.data_size;
                 requested_data->type = (dai::DatatypeEnum) get_message_resp.data_type;
+                account_fetch(stream_name, get_size_resp.size, false);
+                track_sequence(stream_name, requested_data);
             } else {
                 free(get_message_resp.data);
                 return false;
@@ -606,10 +1578,12 @@ uint8_t SpiApi::req_data_partial(Data *requested_data, const char* stream_name,
         if(offset+offset_size <= get_size_resp.size){
             get_message_resp.data = (uint8_t*) malloc(offset_size);
             if(get_message_resp.data){
-                req_success = spi_get_message_partial(&get_message_resp, stream_name, offset, offset_size);
+                ErrorBudget budget(get_retry_policy(stream_name), offset_size);
+                req_success = spi_get_message_partial(&get_message_resp, stream_name, offset, offset_size, budget);
                 if(req_success){
                     requested_data->data = get_message_resp.data;
                     requested_data->size = get_message_resp.data_size;
+                    account_fetch(stream_name, offset_size, false);
                 } else {
                     free(get_message_resp.data);
                     return false;
@@ -627,10 +1601,35 @@ uint8_t SpiApi::req_data_partial(Data *requested_data, const char* stream_name,
     return req_success;
 }
 
+uint8_t SpiApi::req_data_size(const char* stream_name, uint32_t* size){
+    SpiGetSizeResp get_size_resp;
+    if(!spi_get_size(&get_size_resp, GET_SIZE, stream_name)){
+        return false;
+    }
+    *size = get_size_resp.size;
+    return true;
+}
+
+uint8_t SpiApi::req_data_partial_buffer(uint8_t* buffer, const char* stream_name, uint32_t offset, uint32_t offset_size){
+    SpiGetMessageResp get_message_resp;
+    get_message_resp.data = buffer;
+    ErrorBudget budget(get_retry_policy(stream_name), offset_size);
+    if(!spi_get_message_partial(&get_message_resp, stream_name, offset, offset_size, budget)){
+        return false;
+    }
+    account_fetch(stream_name, offset_size, false);
+    return true;
+}
+
 
 
 
 uint8_t SpiApi::req_message(Message* received_msg, const char* stream_name){
+    return req_message_sized(received_msg, stream_name, nullptr);
+}
+
+// size, if given, was already read with GET_SIZE and isn't asked for again
+uint8_t SpiApi::req_message_sized(Message* received_msg, const char* stream_name, const uint32_t* size){
     uint8_t req_success = 0;
     uint8_t req_data_success = 0;
     uint8_t req_meta_success = 0;
@@ -643,7 +1642,7 @@ uint8_t SpiApi::req_message(Message* received_msg, const char* stream_name){
     // example of receiving messages.
     // ----------------------------------------
     // the req_data method allocates memory for the received packet. we need to be sure to free it when we're done with it.
-    req_data_success = req_data(&raw_data, stream_name);
+    req_data_success = size != nullptr ? req_data_sized(&raw_data, stream_name, *size) : req_data(&raw_data, stream_name);
     if(!req_data_success){
         return false;
     }
@@ -652,8 +1651,15 @@ uint8_t SpiApi::req_message(Message* received_msg, const char* stream_name){
     // example of getting message metadata
     // ----------------------------------------
     // the req_metadata method allocates memory for the received packet. we need to be sure to free it when we're done with it.
+    if(transfer_aborted()){
+        link_stats.aborted_transfers++;
+        free(raw_data.data);
+        return false;
+    }
+
     req_meta_success = req_metadata(&raw_meta, stream_name);
     if(!req_meta_success){
+        free(raw_data.data);
         return false;
     }
 
@@ -668,6 +1674,13 @@ uint8_t SpiApi::req_message(Message* received_msg, const char* stream_name){
     return req_success;
 }
 
+uint8_t SpiApi::req_message(Message* received_msg, const char* stream_name, const TransferControl& control){
+    transfer_control = &control;
+    uint8_t req_success = req_message(received_msg, stream_name);
+    transfer_control = nullptr;
+    return req_success;
+}
+
 void SpiApi::free_message(Message* received_msg){
     free(received_msg->raw_data.data);
     free(received_msg->raw_meta.data);
@@ -677,6 +1690,12 @@ void SpiApi::free_message(Message* received_msg){
 
 void SpiApi::set_chunk_packet_cb(void (*passed_chunk_message_cb)(void*, uint32_t, uint32_t)){
     chunk_message_cb = passed_chunk_message_cb;
+    chunk_message_ctx_cb = NULL;
+}
+
+void SpiApi::set_chunk_packet_cb(void (*passed_chunk_message_cb)(void*, void*, uint32_t, uint32_t), void* ctx){
+    chunk_message_ctx_cb = passed_chunk_message_cb;
+    chunk_message_ctx = ctx;
 }
 
 /*
@@ -746,64 +1765,26 @@ bool SpiApi::chunk_message(const char* stream_name){
     debug_cmd_print("get_size_resp: %d\n", get_size_resp.size);
 
     if(req_success){
-        // send a get message command (assuming we got size)
-        spi_generate_command(spi_send_packet, GET_MESSAGE, strlen(stream_name)+1, stream_name);
-        generic_send_spi((char *)spi_send_packet);
+        if(!admit_fetch(stream_name, get_size_resp.size)){
+            return false;
+        }
 
+        // get message (assuming we got size)
         uint32_t message_size = get_size_resp.size;
-        uint32_t total_recv = 0;
-        int error_count = 0;
-
-        while(total_recv < message_size){
-            char recvbuf[BUFF_MAX_SIZE] = {0};
-            req_success = generic_recv_spi(recvbuf);
-            if(req_success){
-                if(recvbuf[0]==START_BYTE_MAGIC){
-                    SpiProtocolPacket* spiRecvPacket = spi_protocol_parse(spi_proto_instance, (uint8_t*)recvbuf, sizeof(recvbuf));
-                    if(spiRecvPacket == nullptr){
-                        error_count++;
-                        if(error_count > 5){
-                            //printf("Error %d/5...\n", error_count);
-                            return false;
-                        } else {
-                            continue;
-                        }
-                    }
-
-                    uint32_t remaining_data = message_size-total_recv;
-                    uint32_t curr_packet_size = 0;
-                    if ( remaining_data < PAYLOAD_MAX_SIZE ){
-                        curr_packet_size = remaining_data;
-                    } else {
-                        curr_packet_size = PAYLOAD_MAX_SIZE;
-                    }
-
-                    if(chunk_message_cb != NULL){
-                        chunk_message_cb((char*)spiRecvPacket->data, curr_packet_size, message_size);
-                        if(DEBUG_MESSAGE_CONTENTS){
-                            debug_print_hex((uint8_t*)spiRecvPacket->data, curr_packet_size);
-                        }
-                    } else {
-                        printf("WARNING: chunk_message called without setting callback!");
-                    }
-                    total_recv += curr_packet_size;
-
-                }else if(recvbuf[0] != 0x00){
-                    printf("*************************************** got a half/non aa packet ************************************************\n");
-                    req_success = 0;
-                    break;
+        ErrorBudget budget(get_retry_policy(stream_name), message_size);
+        req_success = recv_message_data(stream_name, message_size, [this, message_size](const uint8_t* packet, uint32_t, uint32_t curr_packet_size){
+            if(has_chunk_cb()){
+                generic_chunk_cb((char*)packet, curr_packet_size, message_size);
+                if(DEBUG_MESSAGE_CONTENTS){
+                    debug_print_hex((uint8_t*)packet, curr_packet_size);
                 }
             } else {
-                printf("failed to recv packet\n");
-                req_success = 0;
-                break;
+                printf("WARNING: chunk_message called without setting callback!");
             }
+        }, nullptr, budget);
+        if(req_success){
+            account_fetch(stream_name, message_size, true);
         }
-
-        if(error_count > 0){
-            return false;
-        }
-
     }
 
     return req_success;
@@ -824,13 +1805,12 @@ bool SpiApi::chunk_message_buffer(const char* stream_name, uint8_t* buffer, size
     }
 
     if(req_success){
-        // send a get message command (assuming we got size)
-        spi_generate_command(spi_send_packet, GET_MESSAGE, strlen(stream_name)+1, stream_name);
-        generic_send_spi((char *)spi_send_packet);
+        if(!admit_fetch(stream_name, get_size_resp.size)){
+            return false;
+        }
 
+        // get message (assuming we got size)
         uint32_t message_size = get_size_resp.size;
-        uint32_t total_recv = 0;
-        bool errorReceiving = false;
 
         size_t offset = 0;
         std::thread pingPongThread;
@@ -838,65 +1818,25 @@ bool SpiApi::chunk_message_buffer(const char* stream_name, uint8_t* buffer, size
         size_t currentTempSize = size / 2;
         uint8_t* currentSend = buffer + currentTempSize;
 
-        while(total_recv < message_size){
-            char recvbuf[BUFF_MAX_SIZE] = {0};
-            req_success = generic_recv_spi(recvbuf);
-            if(req_success){
-                if(recvbuf[0]==START_BYTE_MAGIC){
-                    SpiProtocolPacket* spiRecvPacket = spi_protocol_parse(spi_proto_instance, (uint8_t*)recvbuf, sizeof(recvbuf));
-                    if(spiRecvPacket == nullptr){
-                        errorReceiving = true;
-                        break;
-                    }
-
-                    uint32_t remaining_data = message_size-total_recv;
-                    uint32_t curr_packet_size = 0;
-                    if ( remaining_data < PAYLOAD_MAX_SIZE ){
-                        curr_packet_size = remaining_data;
-                    } else {
-                        curr_packet_size = PAYLOAD_MAX_SIZE;
-                    }
-
+        ErrorBudget budget(get_retry_policy(stream_name), message_size);
+        bool errorReceiving = !recv_message_data(stream_name, message_size, [&](const uint8_t* packet, uint32_t, uint32_t curr_packet_size){
+            // If buffer is full, send it out first
+            if(curr_packet_size + offset > currentTempSize){
+                //printf("Added up to: %d, with cur packet size: %d\n", offset, curr_packet_size);
 
-                    // If buffer is full, send it out first
-                    if(curr_packet_size + offset > currentTempSize){
-                        //printf("Added up to: %d, with cur packet size: %d\n", offset, curr_packet_size);
-
-                        // Wait until its send
-                        if(pingPongThread.joinable()) pingPongThread.join();
-                        std::swap(currentTemp, currentSend);
-                        pingPongThread = std::thread([this, currentSend, offset, message_size]{
-                            if(chunk_message_cb != nullptr){
-                                chunk_message_cb((char*)currentSend, offset, message_size);
-                            }
-                        });
+                // Wait until its send
+                if(pingPongThread.joinable()) pingPongThread.join();
+                std::swap(currentTemp, currentSend);
+                pingPongThread = std::thread([this, currentSend, offset, message_size]{
+                    generic_chunk_cb((char*)currentSend, offset, message_size);
+                });
 
-                        offset = 0;
-                    }
-                    // Append to temporary buffer
-                    memcpy(&currentTemp[offset], spiRecvPacket->data, curr_packet_size);
-                    offset += curr_packet_size;
-
-                    // if(chunk_message_cb != NULL){
-                    //     chunk_message_cb((char*)spiRecvPacket->data, curr_packet_size, message_size);
-                    //     if(DEBUG_MESSAGE_CONTENTS){
-                    //         debug_print_hex((uint8_t*)spiRecvPacket->data, curr_packet_size);
-                    //     }
-                    // } else {
-                    //     printf("WARNING: chunk_message called without setting callback!");
-                    // }
-
-                    total_recv += curr_packet_size;
-
-                }else if(recvbuf[0] != 0x00){
-                    errorReceiving = true;
-                    break;
-                }
-            } else {
-                errorReceiving = true;
-                break;
+                offset = 0;
             }
-        }
+            // Append to temporary buffer
+            memcpy(&currentTemp[offset], packet, curr_packet_size);
+            offset += curr_packet_size;
+        }, nullptr, budget);
 
 
         if(!errorReceiving){
@@ -904,13 +1844,12 @@ bool SpiApi::chunk_message_buffer(const char* stream_name, uint8_t* buffer, size
                 if(pingPongThread.joinable()) pingPongThread.join();
                 std::swap(currentTemp, currentSend);
                 pingPongThread = std::thread([this, currentSend, offset, message_size]{
-                    if(chunk_message_cb != nullptr){
-                        chunk_message_cb((char*)currentSend, offset, message_size);
-                    }
+                    generic_chunk_cb((char*)currentSend, offset, message_size);
                 });
 
                 offset = 0;
             }
+            account_fetch(stream_name, message_size, true);
         } else {
             printf("Error receiving message\n");
             req_success = 0;
@@ -923,6 +1862,36 @@ bool SpiApi::chunk_message_buffer(const char* stream_name, uint8_t* buffer, size
     return req_success;
 }
 
+bool SpiApi::chunk_message(const char* stream_name, const TransferControl& control){
+    transfer_control = &control;
+    bool req_success = chunk_message(stream_name);
+    transfer_control = nullptr;
+    return req_success;
+}
+
+bool SpiApi::chunk_message_buffer(const char* stream_name, uint8_t* buffer, size_t size, const TransferControl& control){
+    transfer_control = &control;
+    bool req_success = chunk_message_buffer(stream_name, buffer, size);
+    transfer_control = nullptr;
+    return req_success;
+}
+
+void SpiApi::set_interleave_window(uint32_t window_size){
+    interleave_window_size = window_size;
+}
+
+void SpiApi::add_interleaved_stream(const char* stream_name, uint32_t max_size){
+    interleaved_streams.push_back({stream_name, max_size});
+}
+
+void SpiApi::clear_interleaved_streams(){
+    interleaved_streams.clear();
+}
+
+void SpiApi::set_interleaved_message_cb(void (*passed_interleaved_message_cb)(Message*, const char*)){
+    interleaved_message_cb = passed_interleaved_message_cb;
+}
+
 // Static functions
 
 // Serialize only metadata into a separate vector
@@ -1,8 +1,18 @@
 #ifndef SHARED_SPI_API_H
 #define SHARED_SPI_API_H
 
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
 #include "spi_messaging.h"
 #include "spi_protocol.h"
+#include "spi_resync.h"
 
 #include "depthai-shared/datatype/DatatypeEnum.hpp"
 // TODO - unneeded, preferably move to a common include
@@ -19,6 +29,7 @@ namespace dai {
 // namespace spi {
 
 static const char* NOSTREAM = "";
+static const int SEQUENCE_GAP_BINS = 8;
 
 struct Data {
     uint32_t size;
@@ -37,28 +48,227 @@ struct Message {
     dai::DatatypeEnum type;     // exposing type here as well, for easier access.
 };
 
+struct LinkStats {
+    uint32_t packets;           // valid packets received
+    uint32_t corrupt_packets;   // aligned packets with a bad CRC
+    uint32_t lost_bursts;       // bursts in which non-idle bytes were dropped, each lost at least one packet
+    uint32_t resynced_packets;  // packets recovered from misaligned bursts
+    uint32_t dropped_bytes;     // non-idle bytes which weren't part of any valid frame
+    uint32_t repaired_packets;  // corrupt packets refetched with GET_MESSAGE_PART
+    uint32_t aborted_transfers; // transfers stopped by a TransferControl deadline or cancellation
+    uint32_t interleaved_messages;  // messages fetched in between windows of a larger transfer
+    uint32_t missed_messages;   // messages dropped on the device, summed over all streams
+};
+
+// How hard a transfer tries before giving up. Can be set for all streams and overridden per stream, eg. fail fast on
+// latency sensitive detection streams and keep trying on bulk frame streams.
+struct RetryPolicy {
+    uint32_t max_errors = 5;            // receive errors tolerated per transfer, windows and refetches included
+    uint32_t errors_per_mb = 0;         // additional errors tolerated per MiB of payload
+    uint32_t backoff_us = 0;            // wait after a failed receive, doubled with each consecutive failure
+    uint32_t packet_timeout_ms = 0;     // handshake wait per packet, 0 - transport default
+    uint32_t deadline_ms = 0;           // total time per transfer, 0 - no limit
+};
+
+// What to do with a message on a stream which is over its bandwidth budget
+enum class OverBudgetAction {
+    DEFER,      // leave the message on the device, fetch fails for now
+    DECIMATE,   // pop the message without transferring it
+};
+
+// Sequence number and device timestamp of a message, for the datatypes which carry them
+struct SequenceInfo {
+    int64_t sequence_num;
+    std::chrono::nanoseconds timestamp;
+};
+
+struct StreamStats {
+    uint64_t bytes_fetched;
+    uint32_t messages_fetched;
+    uint32_t deferred;                  // fetches refused because the stream was over budget
+    uint32_t decimated;                 // messages popped because the stream was over budget
+    uint32_t skipped;                   // messages popped by the stream's decimation setting
+    uint32_t budget_bytes_per_second;   // 0 - no budget
+    uint32_t achieved_bytes_per_second; // since the budget was set or the stats were reset
+
+    // Sequence tracking, from the metadata read on the stream. Missed messages were dropped on the device before the
+    // host got to them (queue overflow). Messages popped by the host without reading their metadata - skipped,
+    // decimated or popped by the application - fill a gap in the sequence without counting as missed.
+    int64_t last_sequence_num;          // -1 - nothing seen yet
+    uint32_t sequence_gaps;             // jumps in the sequence not explained by host pops
+    uint32_t missed_messages;           // sequence numbers never seen nor popped by the host
+    uint32_t duplicates;                // same sequence number seen again, in a later message
+    uint32_t reorders;                  // sequence number lower than the last one
+    uint32_t gap_histogram[SEQUENCE_GAP_BINS];  // bin i counts gaps of 2^i up to 2^(i+1)-1 missed messages, last bin everything above
+};
+
+struct SendStats {
+    uint32_t sent;              // messages streamed out in pipelined mode
+    uint32_t acked;             // success statuses collected
+    uint32_t failed;            // fail statuses collected, the device dropped the message
+    uint32_t refused;           // SEND_DATA commands the device didn't accept, their completion status fails too
+    uint32_t credit_waits;      // sends which had to wait for a status first
+};
+
+// Pipelined sends need firmware which tags its status packets in the byte after the status: the answer to a SEND_DATA
+// command, or the status of a finished upload. Such a device reads the announced payload even after refusing the
+// command, and ends every upload with exactly one SEND_STATUS_DONE status, a fail for a refused one.
+enum SendStatusTag : uint8_t {
+    SEND_STATUS_ACCEPT = SEND_DATA,
+    SEND_STATUS_DONE = 0x80,
+};
+
+// Lets another thread (or a chunk callback) stop an in-flight transfer
+class CancellationToken {
+    public:
+        void cancel() { cancelled = true; }
+        void reset() { cancelled = false; }
+        bool is_cancelled() const { return cancelled; }
+    private:
+        std::atomic<bool> cancelled{false};
+};
+
+// Deadline and cancellation for a single request. While a control is active, message data is fetched in
+// GET_MESSAGE_PART windows; an abort stops at a packet boundary and drains the rest of the current window, so the
+// link is ready for the next command. A window_size of 0 fetches one packet per window, so an abort takes effect right
+// after the packet in flight, at the cost of a command per packet. The aborted message stays on the device, pop it if
+// it is no longer needed.
+struct TransferControl {
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    const CancellationToken* token = nullptr;
+    uint32_t window_size = 16 * 1024;
+};
+
+// receive errors and deadline of one transfer, spanning all of its windows and repairs
+class ErrorBudget;
 
 class SpiApi {
     private:
         uint8_t (*send_spi_impl)(const char* spi_send_packet);
         uint8_t (*recv_spi_impl)(char* recvbuf);
         uint8_t (*spi_transfer_impl)(const void*, size_t, void*, size_t);
+        void (*recv_timeout_impl)(uint32_t timeout_ms);
 
         void (*chunk_message_cb)(void* curr_packet, uint32_t chunk_size, uint32_t message_size);
 
+        // context carrying variants, used in place of the above when set. Needed to drive more than one bus.
+        uint8_t (*send_spi_ctx_impl)(void* ctx, const char* spi_send_packet);
+        uint8_t (*recv_spi_ctx_impl)(void* ctx, char* recvbuf);
+        uint8_t (*spi_transfer_ctx_impl)(void* ctx, const void*, size_t, void*, size_t);
+        void (*recv_timeout_ctx_impl)(void* ctx, uint32_t timeout_ms);
+        void (*chunk_message_ctx_cb)(void* ctx, void* curr_packet, uint32_t chunk_size, uint32_t message_size);
+        void* send_spi_ctx;
+        void* recv_spi_ctx;
+        void* spi_transfer_ctx;
+        void* recv_timeout_ctx;
+        void* chunk_message_ctx;
+
         SpiProtocolInstance* spi_proto_instance;
         SpiProtocolPacket* spi_send_packet;
+        SpiResyncInstance* spi_resync_instance;
+        LinkStats link_stats;
+
+        RetryPolicy retry_policy;
+        std::map<std::string, RetryPolicy> stream_retry_policies;
+        const RetryPolicy& get_retry_policy(const char* stream_name);
+
+        const TransferControl* transfer_control;
+
+        // per stream bandwidth budget (token bucket) and stats
+        struct StreamState {
+            uint32_t bytes_per_second;
+            uint32_t burst_bytes;
+            OverBudgetAction action;
+            double tokens;
+            std::chrono::steady_clock::time_point last_refill;
+            std::chrono::steady_clock::time_point stats_since;
+            StreamStats stats;
+
+            // decimation - keep every Nth message, or at most one per min_interval of device time
+            uint32_t keep_every_n;
+            uint32_t decimation_counter;
+            std::chrono::nanoseconds min_interval;
+            std::chrono::nanoseconds last_kept;
+            bool has_last_kept;
+            Metadata cached_meta;   // metadata read to decide on decimation, handed to the next req_metadata
+            // decision on the message at the front, kept until it's popped so a retried fetch gets the same answer
+            bool has_decision;
+            bool skip_message;
+
+            bool has_sequence;
+            int64_t last_sequence_num;
+            bool front_tracked;         // the sequence number of the message at the front was read
+            int64_t front_sequence_num;
+            uint32_t untracked_pops;    // messages popped since the last sequence number, without reading theirs
+        };
+        std::map<std::string, StreamState> stream_states;
+        StreamState& get_stream_state(const char* stream_name);
+        bool admit_fetch(const char* stream_name, uint32_t size);
+        bool decimate_message(const char* stream_name, StreamState& state);
+        void drop_cached_meta(StreamState& state);
+        void track_sequence(const char* stream_name, Metadata* metadata);
+        void account_fetch(const char* stream_name, uint32_t size, bool message);
+
+        struct InterleavedStream {
+            std::string name;
+            uint32_t max_size;
+        };
+        std::vector<InterleavedStream> interleaved_streams;
+        uint32_t interleave_window_size;
+        bool in_interleave;
+        void (*interleaved_message_cb)(Message* msg, const char* stream_name);
+        void service_interleaved(const char* current_stream);
+        bool transfer_aborted();
+        void drain_payload(uint32_t size);
 
         uint8_t generic_send_spi(const char* spi_send_packet);
         uint8_t generic_recv_spi(char* recvbuf);
         uint8_t generic_spi_transfer(const void* send_buffer, size_t send_size, void* receive_buffer, size_t receive_size);
+        void generic_set_recv_timeout(uint32_t timeout_ms);
+        bool has_chunk_cb();
+
+        // pipelined sends - SEND_DATA statuses are collected from what the device clocks out during later transfers
+        enum class StatusTags {
+            UNKNOWN,    // not probed yet
+            TAGGED,
+            UNTAGGED,   // firmware without pipelined send support
+        };
+        uint32_t send_credits;
+        std::chrono::milliseconds send_status_timeout;
+        StatusTags status_tags;
+        bool pipelined_send;
+        std::deque<std::string> pending_sends;
+        SendStats send_stats;
+        void (*send_status_cb)(const char* stream_name, bool success);
+        void send_payload_packet(SpiProtocolPacket* packet);
+        void collect_send_status(const char* recvbuf);
+        bool wait_send_status();
+        int probe_status_tags(const char* stream_name, uint32_t metadata_size, uint32_t total_size);
+
+        bool (*chunk_producer_cb)(void* ctx, uint8_t* chunk, uint32_t offset, uint32_t size);
+        void* chunk_producer_ctx;
+        bool send_data_command(const char* stream_name, uint32_t metadata_size, uint32_t total_size);
+        bool send_chunked(const std::vector<uint8_t>& metadata, uint32_t data_size, const char* stream_name, uint32_t chunk_size);
+        void transfer_f16(const float* data, uint32_t count, const uint8_t* metadata, uint32_t metadata_size);
+#if defined(__linux__)
+        bool send_mapped(const std::vector<uint8_t>& metadata, int fd, const char* stream_name);
+#endif
+        void generic_chunk_cb(void* curr_packet, uint32_t chunk_size, uint32_t message_size);
+
+        int parse_packet(const char* recvbuf, SpiProtocolPacket** packet);
+        uint8_t recv_payload(const char * stream_name, uint32_t size, const std::function<void(const uint8_t*, uint32_t, uint32_t)>& on_packet, std::vector<std::pair<uint32_t, uint32_t>>* damaged, ErrorBudget& budget);
+        uint8_t repair_payload(uint8_t* data, const char * stream_name, uint32_t offset, const std::vector<std::pair<uint32_t, uint32_t>>& damaged, ErrorBudget& budget);
+        uint8_t recv_message_data(const char * stream_name, uint32_t size, const std::function<void(const uint8_t*, uint32_t, uint32_t)>& on_packet, uint8_t* repair_data, ErrorBudget& budget);
 
         void transfer(const void* buffer, int size);
         void transfer2(const void* buffer1, const void* buffer2, int size1, int size2);
 
+        uint8_t req_data_sized(Data *requested_data, const char* stream_name, uint32_t size);
+        uint8_t req_message_sized(Message* received_msg, const char* stream_name, const uint32_t* size);
+
         uint8_t spi_get_size(SpiGetSizeResp *response, spi_command get_size_cmd, const char * stream_name);
-        uint8_t spi_get_message(SpiGetMessageResp *response, spi_command get_mess_cmd, const char * stream_name, uint32_t size);
-        uint8_t spi_get_message_partial(SpiGetMessageResp *response, const char * stream_name, uint32_t offset, uint32_t size);
+        uint8_t spi_get_message(SpiGetMessageResp *response, spi_command get_mess_cmd, const char * stream_name, uint32_t size, ErrorBudget& budget);
+        uint8_t spi_get_message_partial(SpiGetMessageResp *response, const char * stream_name, uint32_t offset, uint32_t size, ErrorBudget& budget);
     public:
         SpiApi();
         ~SpiApi();
@@ -67,16 +277,41 @@ class SpiApi {
         void debug_print_hex(uint8_t * data, int len);
         void debug_print_char(char * data, int len);
 
+        // link stats
+        LinkStats get_link_stats();
+        void reset_link_stats();
+
         // refs to callbacks
         void set_send_spi_impl(uint8_t (*passed_send_spi)(const char*));
         void set_recv_spi_impl(uint8_t (*passed_recv_spi)(char*));
         void set_spi_transfer_impl(uint8_t (*transfer_impl)(const void*, size_t, void*, size_t));
+        void set_recv_timeout_impl(void (*timeout_impl)(uint32_t timeout_ms));
+        void set_send_spi_impl(uint8_t (*passed_send_spi)(void*, const char*), void* ctx);
+        void set_recv_spi_impl(uint8_t (*passed_recv_spi)(void*, char*), void* ctx);
+        void set_spi_transfer_impl(uint8_t (*transfer_impl)(void*, const void*, size_t, void*, size_t), void* ctx);
+        void set_recv_timeout_impl(void (*timeout_impl)(void*, uint32_t timeout_ms), void* ctx);
+
+        // per stream bandwidth budgets. A stream may go into debt by one message, as long as it had tokens left.
+        void set_stream_budget(const char* stream_name, uint32_t bytes_per_second, uint32_t burst_bytes, OverBudgetAction action);
+        void clear_stream_budget(const char* stream_name);
+        StreamStats get_stream_stats(const char* stream_name);
+        void reset_stream_stats();
+
+        // per stream decimation, skipped messages are popped without any data transfer. keep_every_n of 0 or 1 and
+        // min_interval_ms of 0 disable it. The time based mode reads the metadata first, to get the device timestamp.
+        void set_stream_decimation(const char* stream_name, uint32_t keep_every_n);
+        void set_stream_min_interval(const char* stream_name, uint32_t min_interval_ms);
+
+        // retry policy, per instance and per stream
+        void set_retry_policy(const RetryPolicy& policy);
+        void set_retry_policy(const char* stream_name, const RetryPolicy& policy);
 
         // base SPI API methods
         std::vector<std::string> spi_get_streams();
         uint8_t spi_pop_messages();
         uint8_t spi_pop_message(const char * stream_name);
         uint8_t req_message(Message* received_msg, const char* stream_name);
+        uint8_t req_message(Message* received_msg, const char* stream_name, const TransferControl& control);
         void free_message(Message* received_msg);
 
         // methods for requesting only metadata or data
@@ -84,6 +319,9 @@ class SpiApi {
         uint8_t req_data(Data *requested_data, const char* stream_name);
         uint8_t req_metadata(Metadata *requested_data, const char* stream_name);
         uint8_t req_data_partial(Data *requested_data, const char* stream_name, uint32_t offset, uint32_t offset_size);
+        uint8_t req_data_size(const char* stream_name, uint32_t* size);
+        // no size check and no allocation - receives [offset, offset+offset_size) of the message into buffer
+        uint8_t req_data_partial_buffer(uint8_t* buffer, const char* stream_name, uint32_t offset, uint32_t offset_size);
 
         // High level message functions
         // Receiving
@@ -97,15 +335,66 @@ class SpiApi {
             return parse_message(passed_metadata->data, passed_metadata->size, parsed_return);
         }
 
+        bool parse_sequence_info(Metadata *passed_metadata, SequenceInfo* info);
+
         // methods for receiving a large message piece by piece
         bool chunk_message(const char* stream_name);
+        bool chunk_message(const char* stream_name, const TransferControl& control);
         void set_chunk_packet_cb(void (*passed_chunk_message_cb)(void*, uint32_t, uint32_t));
+        void set_chunk_packet_cb(void (*passed_chunk_message_cb)(void*, void*, uint32_t, uint32_t), void* ctx);
         bool chunk_message_buffer(const char* stream_name, uint8_t* buffer, size_t size);
+        bool chunk_message_buffer(const char* stream_name, uint8_t* buffer, size_t size, const TransferControl& control);
+
+        // interleaving of small, high priority messages into large transfers. Large messages are fetched in windows
+        // of window_size and in between the interleaved streams are checked, in the order they were added. Messages
+        // up to max_size are fetched, passed to the callback, then freed and popped.
+        void set_interleave_window(uint32_t window_size);
+        void add_interleaved_stream(const char* stream_name, uint32_t max_size);
+        void clear_interleaved_streams();
+        void set_interleaved_message_cb(void (*passed_interleaved_message_cb)(Message*, const char*));
 
         // Sending
         bool send_message(const std::shared_ptr<RawBuffer>& sp_msg, const char* stream_name);
         bool send_message(const RawBuffer& msg, const char* stream_name);
 
+        // Streaming upload of data_size bytes, for payloads which don't fit in memory. The producer fills the chunk
+        // with [offset, offset+size) of the data, returning false to give up. The protocol can't abort an upload: a
+        // failure on the first chunk sends nothing, a later one leaves the device waiting for the rest of the
+        // announced bytes until it's reset. chunk_size is rounded down to whole packets.
+        void set_chunk_producer_cb(bool (*passed_chunk_producer_cb)(void*, uint8_t*, uint32_t, uint32_t), void* ctx);
+        bool send_data_chunked(uint32_t data_size, const char* stream_name, uint32_t chunk_size = 16*PAYLOAD_MAX_SIZE);
+        // msg supplies the metadata only, its data is ignored
+        bool send_message_chunked(const RawBuffer& msg, uint32_t data_size, const char* stream_name, uint32_t chunk_size = 16*PAYLOAD_MAX_SIZE);
+
+        // Sends count floats as FP16, converted packet by packet straight into the outgoing packets
+        uint8_t send_data_f16(const float* data, uint32_t count, const char* stream_name);
+        // msg supplies the metadata only, its data is ignored
+        bool send_message_f16(const RawBuffer& msg, const float* data, uint32_t count, const char* stream_name);
+
+#if defined(__linux__)
+        // Sends a file straight from a read-only mapping, without reading it into memory first. An empty file is only
+        // sent along with metadata.
+        bool send_file(int fd, const char* stream_name);
+        bool send_file(const char* path, const char* stream_name);
+        // msg supplies the metadata only, its data is ignored
+        bool send_message_file(const RawBuffer& msg, int fd, const char* stream_name);
+        bool send_message_file(const RawBuffer& msg, const char* path, const char* stream_name);
+#endif
+
+        // Credit based pipelined sending. The protocol has no credit command, so credits are set to what the device
+        // can buffer, eg. the SPIIn node's pool size. Each payload is streamed right after its SEND_DATA, and up to
+        // that many messages can be in flight without their completion status; those are picked up from the packets
+        // the device clocks out during following transfers, which needs the full duplex transfer impl. The first
+        // send checks that the firmware tags its statuses (see SendStatusTag), without that every send falls back
+        // to send_message, as does 0 credits. Waiting for a status gives up after status_timeout_ms.
+        void set_send_credits(uint32_t credits, uint32_t status_timeout_ms = 1000);
+        void set_send_status_cb(void (*passed_send_status_cb)(const char* stream_name, bool success));
+        bool send_message_pipelined(const RawBuffer& msg, const char* stream_name);
+        // waits for the statuses of all messages in flight, false if any failed or the device stopped responding
+        bool flush_sends();
+        uint32_t get_pending_sends();
+        SendStats get_send_stats();
+
 };
 
 
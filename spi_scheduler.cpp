@@ -0,0 +1,155 @@
+#include "spi_scheduler.hpp"
+
+#include <algorithm>
+#include <thread>
+
+namespace dai {
+
+SpiScheduler::SpiScheduler(SpiApi& api) : api(api) {
+    policy = SchedulePolicy::EARLIEST_DEADLINE_FIRST;
+    virtual_time = 0;
+}
+
+void SpiScheduler::set_policy(SchedulePolicy passed_policy){
+    policy = passed_policy;
+}
+
+void SpiScheduler::add_stream(const char* stream_name, uint32_t priority, float target_rate_hz, uint32_t deadline_ms, void (*message_cb)(Message*, const char*)){
+    ScheduledStream stream = {};
+    stream.name = stream_name;
+    stream.priority = std::max<uint32_t>(priority, 1);
+    stream.period = clock::duration::zero();
+    if(target_rate_hz > 0){
+        stream.period = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1.0 / target_rate_hz));
+    }
+    stream.deadline = std::chrono::milliseconds(deadline_ms);
+    if(deadline_ms == 0){
+        stream.deadline = stream.period;
+    }
+    stream.message_cb = message_cb;
+    stream.release = clock::now();
+    stream.next_poll = stream.release;
+    stream.virtual_finish = virtual_time;
+    streams.push_back(stream);
+}
+
+SchedulerStreamStats SpiScheduler::get_stream_stats(const char* stream_name){
+    for(const auto& stream : streams){
+        if(stream.name == stream_name){
+            return stream.stats;
+        }
+    }
+    return {};
+}
+
+// Picks the next stream to service. Streams whose next message is due come first, ordered by absolute deadline
+// (EDF) or virtual finish time (WFQ). If none is due, the one expected soonest is polled ahead, keeping the bus busy.
+SpiScheduler::ScheduledStream* SpiScheduler::pick_stream(clock::time_point now){
+    ScheduledStream* best = nullptr;
+    bool best_due = false;
+
+    for(auto& stream : streams){
+        // recently found empty, give the device some time
+        if(now < stream.next_poll){
+            continue;
+        }
+
+        bool due = now >= stream.release;
+        if(best == nullptr || (due && !best_due)){
+            best = &stream;
+            best_due = due;
+            continue;
+        }
+        if(due != best_due){
+            continue;
+        }
+
+        bool better = false;
+        if(!due){
+            better = stream.release < best->release;
+        } else if(policy == SchedulePolicy::EARLIEST_DEADLINE_FIRST){
+            clock::time_point deadline = stream.release + stream.deadline;
+            clock::time_point best_deadline = best->release + best->deadline;
+            better = deadline < best_deadline || (deadline == best_deadline && stream.priority > best->priority);
+        } else {
+            better = stream.virtual_finish < best->virtual_finish
+                || (stream.virtual_finish == best->virtual_finish && stream.priority > best->priority);
+        }
+        if(better){
+            best = &stream;
+        }
+    }
+
+    return best;
+}
+
+bool SpiScheduler::service(ScheduledStream& stream){
+    Message msg;
+    if(!api.req_message(&msg, stream.name.c_str())){
+        stream.stats.empty_polls++;
+        // poll again after a fraction of the period
+        stream.next_poll = clock::now() + std::max<clock::duration>(stream.period / 8, std::chrono::microseconds(500));
+        return false;
+    }
+
+    clock::time_point now = clock::now();
+    uint32_t bytes = msg.raw_data.size + msg.raw_meta.size;
+
+    if(stream.message_cb != nullptr){
+        stream.message_cb(&msg, stream.name.c_str());
+    }
+    api.free_message(&msg);
+    api.spi_pop_message(stream.name.c_str());
+
+    stream.stats.messages++;
+    stream.stats.bytes += bytes;
+    if(now > stream.release){
+        uint32_t latency_us = std::chrono::duration_cast<std::chrono::microseconds>(now - stream.release).count();
+        stream.stats.max_latency_us = std::max(stream.stats.max_latency_us, latency_us);
+        if(now > stream.release + stream.deadline){
+            stream.stats.deadline_misses++;
+        }
+    }
+
+    // next release keeps the target rate, unless we've fallen more than a period behind
+    stream.release += stream.period;
+    if(stream.release + stream.period < now){
+        stream.release = now;
+    }
+    stream.next_poll = clock::time_point::min();
+
+    // weighted fair queuing - tags advance by the bytes consumed, scaled by the stream weight
+    double start = std::max(stream.virtual_finish, virtual_time);
+    stream.virtual_finish = start + (double) bytes / stream.priority;
+    virtual_time = start;
+
+    return true;
+}
+
+bool SpiScheduler::run_once(){
+    ScheduledStream* stream = pick_stream(clock::now());
+    if(stream == nullptr){
+        return false;
+    }
+    return service(*stream);
+}
+
+void SpiScheduler::run(const std::atomic<bool>& stop){
+    while(!stop){
+        if(run_once()){
+            continue;
+        }
+
+        // nothing delivered - wait until the next stream can be polled again
+        clock::time_point next_poll = clock::time_point::max();
+        for(const auto& stream : streams){
+            next_poll = std::min(next_poll, stream.next_poll);
+        }
+        clock::time_point now = clock::now();
+        if(next_poll > now && next_poll != clock::time_point::max()){
+            std::this_thread::sleep_for(std::min<clock::duration>(next_poll - now, std::chrono::milliseconds(1)));
+        }
+    }
+}
+
+}  // namespace dai
@@ -0,0 +1,70 @@
+#ifndef SHARED_SPI_SCHEDULER_H
+#define SHARED_SPI_SCHEDULER_H
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "spi_api.hpp"
+
+namespace dai {
+
+enum class SchedulePolicy {
+    EARLIEST_DEADLINE_FIRST,
+    WEIGHTED_FAIR,
+};
+
+struct SchedulerStreamStats {
+    uint32_t messages;
+    uint64_t bytes;
+    uint32_t deadline_misses;   // messages delivered after their deadline
+    uint32_t empty_polls;       // stream was serviced but had no message
+    uint32_t max_latency_us;    // worst delivery time, measured from when the message was due
+};
+
+// Drives the bus over a set of streams. Each stream has a priority, a target rate and a latency deadline; the next
+// stream to service is picked by earliest deadline first or weighted fair queuing (priority is the weight). Received
+// messages are passed to the stream's callback, then freed and popped.
+class SpiScheduler {
+    public:
+        explicit SpiScheduler(SpiApi& api);
+
+        void set_policy(SchedulePolicy policy);
+        void add_stream(const char* stream_name, uint32_t priority, float target_rate_hz, uint32_t deadline_ms, void (*message_cb)(Message*, const char*));
+
+        // services a single stream, returns true if a message was delivered
+        bool run_once();
+        // services streams until stop is set
+        void run(const std::atomic<bool>& stop);
+
+        SchedulerStreamStats get_stream_stats(const char* stream_name);
+
+    private:
+        typedef std::chrono::steady_clock clock;
+
+        struct ScheduledStream {
+            std::string name;
+            uint32_t priority;
+            clock::duration period;
+            clock::duration deadline;
+            void (*message_cb)(Message*, const char*);
+
+            clock::time_point release;  // when the next message is expected
+            clock::time_point next_poll;
+            double virtual_finish;      // weighted fair queuing tag
+            SchedulerStreamStats stats;
+        };
+
+        SpiApi& api;
+        SchedulePolicy policy;
+        std::vector<ScheduledStream> streams;
+        double virtual_time;
+
+        ScheduledStream* pick_stream(clock::time_point now);
+        bool service(ScheduledStream& stream);
+};
+
+}  // namespace dai
+
+#endif
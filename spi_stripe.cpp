@@ -0,0 +1,127 @@
+#include "spi_stripe.hpp"
+
+#include <chrono>
+#include <thread>
+
+namespace dai {
+
+// weight of the newest goodput sample
+static const double GOODPUT_EMA_ALPHA = 0.25;
+
+SpiStripedFetch::SpiStripedFetch(){
+    min_stripe_size = 16 * PAYLOAD_MAX_SIZE;
+}
+
+void SpiStripedFetch::add_link(SpiApi& api){
+    links.push_back(&api);
+    goodput.push_back(0);
+}
+
+void SpiStripedFetch::set_min_stripe_size(uint32_t passed_min_stripe_size){
+    min_stripe_size = passed_min_stripe_size;
+}
+
+std::vector<double> SpiStripedFetch::get_link_goodput(){
+    return goodput;
+}
+
+// Stripe sizes in proportion to goodput, in whole packets so no link receives a partly filled packet mid message.
+// Links without a measurement yet get an equal share.
+void SpiStripedFetch::split(uint32_t size, std::vector<uint32_t>& stripe_sizes){
+    size_t count = links.size();
+    stripe_sizes.assign(count, 0);
+
+    double known_total = 0;
+    double known_max = 0;
+    size_t fastest = 0;
+    for(size_t i = 0; i < count; i++){
+        known_total += goodput[i];
+        if(goodput[i] > known_max){
+            known_max = goodput[i];
+            fastest = i;
+        }
+    }
+
+    if(size < min_stripe_size * count){
+        stripe_sizes[fastest] = size;
+        return;
+    }
+
+    std::vector<double> weights(count);
+    double total = 0;
+    for(size_t i = 0; i < count; i++){
+        weights[i] = goodput[i] > 0 ? goodput[i] : (known_total > 0 ? known_total / count : 1.0);
+        total += weights[i];
+    }
+
+    uint32_t assigned = 0;
+    for(size_t i = 0; i + 1 < count; i++){
+        uint32_t stripe = (uint32_t) (size * (weights[i] / total));
+        stripe -= stripe % PAYLOAD_MAX_SIZE;
+        stripe_sizes[i] = stripe;
+        assigned += stripe;
+    }
+    stripe_sizes[count - 1] = size - assigned;
+}
+
+bool SpiStripedFetch::fetch(const char* stream_name, uint8_t* buffer, uint32_t buffer_size, uint32_t* message_size){
+    if(links.empty() || !links[0]->req_data_size(stream_name, message_size)){
+        return false;
+    }
+    if(*message_size > buffer_size){
+        printf("message of %u bytes doesn't fit the %u byte buffer\n", *message_size, buffer_size);
+        return false;
+    }
+
+    std::vector<uint32_t> stripe_sizes;
+    split(*message_size, stripe_sizes);
+
+    std::vector<uint8_t> results(links.size(), 1);
+    std::vector<double> elapsed(links.size(), 0);
+    auto fetch_stripe = [&](size_t link, uint32_t offset){
+        auto start = std::chrono::steady_clock::now();
+        results[link] = links[link]->req_data_partial_buffer(buffer + offset, stream_name, offset, stripe_sizes[link]);
+        elapsed[link] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    // the first non empty stripe runs on this thread, the others on their own
+    std::vector<std::thread> threads;
+    size_t local = links.size();
+    uint32_t local_offset = 0;
+    uint32_t offset = 0;
+    for(size_t i = 0; i < links.size(); i++){
+        if(stripe_sizes[i] != 0){
+            if(local == links.size()){
+                local = i;
+                local_offset = offset;
+            } else {
+                threads.emplace_back(fetch_stripe, i, offset);
+            }
+        }
+        offset += stripe_sizes[i];
+    }
+    if(local != links.size()){
+        fetch_stripe(local, local_offset);
+    }
+    for(auto& thread : threads){
+        thread.join();
+    }
+
+    bool success = true;
+    for(size_t i = 0; i < links.size(); i++){
+        if(!results[i]){
+            // a failing link gets less to do next time
+            goodput[i] /= 2;
+            success = false;
+            continue;
+        }
+        if(stripe_sizes[i] != 0 && elapsed[i] > 0){
+            double sample = stripe_sizes[i] / elapsed[i];
+            goodput[i] = goodput[i] > 0 ? GOODPUT_EMA_ALPHA * sample + (1 - GOODPUT_EMA_ALPHA) * goodput[i] : sample;
+        }
+    }
+
+    return success;
+}
+
+}  // namespace dai
@@ -0,0 +1,39 @@
+#ifndef SHARED_SPI_STRIPE_H
+#define SHARED_SPI_STRIPE_H
+
+#include <vector>
+
+#include "spi_api.hpp"
+
+namespace dai {
+
+// Fetches one message over several SPI links to the same device, eg. a SOM wired to two SPI hosts. The message is
+// split into GET_MESSAGE_PART ranges, one per link, which are received in parallel into the same buffer. Range sizes
+// follow each link's measured goodput (an exponential moving average), so a slower bus gets a smaller stripe.
+class SpiStripedFetch {
+    public:
+        SpiStripedFetch();
+
+        // each api must use its own transport, the first link is also used for GET_SIZE
+        void add_link(SpiApi& api);
+        // below min_stripe_size per link the whole message is fetched over the fastest link
+        void set_min_stripe_size(uint32_t min_stripe_size);
+
+        // Receives the message at the front of the stream into buffer. The message isn't popped, which can be done
+        // over any of the links.
+        bool fetch(const char* stream_name, uint8_t* buffer, uint32_t buffer_size, uint32_t* message_size);
+
+        // bytes per second, 0 until a link was used
+        std::vector<double> get_link_goodput();
+
+    private:
+        std::vector<SpiApi*> links;
+        std::vector<double> goodput;
+        uint32_t min_stripe_size;
+
+        void split(uint32_t size, std::vector<uint32_t>& stripe_sizes);
+};
+
+}  // namespace dai
+
+#endif
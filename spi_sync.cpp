@@ -0,0 +1,138 @@
+#include "spi_sync.hpp"
+
+namespace dai {
+
+SpiSync::SpiSync(SpiApi& api) : api(api) {
+    mode = SyncMode::SEQUENCE_NUM;
+    tolerance = std::chrono::nanoseconds::zero();
+    stats = {};
+}
+
+SpiSync::~SpiSync(){
+    for(auto& stream : streams){
+        if(stream.has_head){
+            free(stream.head.data);
+        }
+    }
+}
+
+void SpiSync::set_mode(SyncMode passed_mode, uint32_t tolerance_ms){
+    mode = passed_mode;
+    tolerance = std::chrono::milliseconds(tolerance_ms);
+}
+
+void SpiSync::add_stream(const char* stream_name){
+    SyncStream stream = {};
+    stream.name = stream_name;
+    streams.push_back(stream);
+}
+
+SyncStats SpiSync::get_stats(){
+    return stats;
+}
+
+// Reads the metadata of the message at the front of the stream, if it isn't already held
+bool SpiSync::load_head(SyncStream& stream){
+    while(!stream.has_head){
+        if(!api.req_metadata(&stream.head, stream.name.c_str())){
+            return false;
+        }
+        if(api.parse_sequence_info(&stream.head, &stream.info)){
+            stream.has_head = true;
+        } else {
+            // nothing to match on
+            free(stream.head.data);
+            api.spi_pop_message(stream.name.c_str());
+            stats.unparsed++;
+        }
+    }
+    return true;
+}
+
+void SpiSync::drop_head(SyncStream& stream){
+    release_head(stream);
+    api.spi_pop_message(stream.name.c_str());
+}
+
+// Forgets the head without popping it, it's read again by the next load_head
+void SpiSync::release_head(SyncStream& stream){
+    free(stream.head.data);
+    stream.head = {};
+    stream.has_head = false;
+}
+
+// true if the message can't be part of the newest head's group, or any later one
+bool SpiSync::older(const SequenceInfo& info, const SequenceInfo& newest){
+    if(mode == SyncMode::SEQUENCE_NUM){
+        return info.sequence_num < newest.sequence_num;
+    }
+    return newest.timestamp - info.timestamp > tolerance;
+}
+
+bool SpiSync::get_group(std::vector<Message>& group){
+    group.clear();
+    if(streams.empty()){
+        return false;
+    }
+
+    // drop heads behind the newest one until they all match
+    bool matched = false;
+    while(!matched){
+        for(auto& stream : streams){
+            if(!load_head(stream)){
+                return false;
+            }
+        }
+
+        const SequenceInfo* newest = &streams[0].info;
+        for(const auto& stream : streams){
+            if(mode == SyncMode::SEQUENCE_NUM ? stream.info.sequence_num > newest->sequence_num : stream.info.timestamp > newest->timestamp){
+                newest = &stream.info;
+            }
+        }
+        SequenceInfo target = *newest;
+
+        matched = true;
+        for(auto& stream : streams){
+            if(older(stream.info, target)){
+                drop_head(stream);
+                stats.orphans++;
+                matched = false;
+            }
+        }
+    }
+
+    // complete group - only now transfer the payloads
+    for(auto& stream : streams){
+        Message msg = {};
+        if(!api.req_data(&msg.raw_data, stream.name.c_str())){
+            // a fetch refused by the stream's budget or decimation may have popped the head, read them all again
+            free_group(group);
+            for(auto& held : streams){
+                release_head(held);
+            }
+            return false;
+        }
+        group.push_back(msg);
+    }
+
+    for(size_t i = 0; i < streams.size(); i++){
+        group[i].raw_meta = streams[i].head;
+        group[i].type = streams[i].head.type;
+        streams[i].head = {};
+        streams[i].has_head = false;
+        api.spi_pop_message(streams[i].name.c_str());
+    }
+    stats.groups++;
+
+    return true;
+}
+
+void SpiSync::free_group(std::vector<Message>& group){
+    for(auto& msg : group){
+        api.free_message(&msg);
+    }
+    group.clear();
+}
+
+}  // namespace dai
@@ -0,0 +1,65 @@
+#ifndef SHARED_SPI_SYNC_H
+#define SHARED_SPI_SYNC_H
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "spi_api.hpp"
+
+namespace dai {
+
+enum class SyncMode {
+    SEQUENCE_NUM,
+    TIMESTAMP,
+};
+
+struct SyncStats {
+    uint32_t groups;            // complete groups delivered
+    uint32_t orphans;           // messages popped without a match, their payload never transferred
+    uint32_t unparsed;          // messages popped because their metadata carries no sequence info
+};
+
+// Groups messages across streams, e.g. detections with the frame they were computed on. Only the metadata at the
+// front of each stream is read; heads which can no longer be matched are popped, and the data payloads are fetched
+// once every stream holds a matching message.
+class SpiSync {
+    public:
+        explicit SpiSync(SpiApi& api);
+        ~SpiSync();
+
+        // TIMESTAMP mode matches messages whose device timestamps are within tolerance_ms of each other
+        void set_mode(SyncMode mode, uint32_t tolerance_ms = 0);
+        void add_stream(const char* stream_name);
+
+        // Fills group with one message per stream, in add_stream order, and pops them from the device. Returns false
+        // if a stream has no message yet, the heads already read are kept for the next call. After a failed payload
+        // fetch the heads are read again.
+        bool get_group(std::vector<Message>& group);
+        void free_group(std::vector<Message>& group);
+
+        SyncStats get_stats();
+
+    private:
+        struct SyncStream {
+            std::string name;
+            bool has_head;
+            Metadata head;
+            SequenceInfo info;
+        };
+
+        SpiApi& api;
+        SyncMode mode;
+        std::chrono::nanoseconds tolerance;
+        std::vector<SyncStream> streams;
+        SyncStats stats;
+
+        bool load_head(SyncStream& stream);
+        void drop_head(SyncStream& stream);
+        void release_head(SyncStream& stream);
+        bool older(const SequenceInfo& info, const SequenceInfo& newest);
+};
+
+}  // namespace dai
+
+#endif
@@ -0,0 +1,120 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "nms.h"
+
+// NMS timings at 100, 1k and 10k boxes, for both the grid and a textbook pairwise NMS. Not a test, run by hand:
+//   ./bench_nms [rounds]
+
+static uint32_t rng_state = 777;
+
+static uint32_t next_random(void){
+    rng_state = rng_state * 1664525u + 1013904223u;
+    return rng_state >> 8;
+}
+
+static float random_unit(void){
+    return (next_random() % 10001) / 10000.f;
+}
+
+static double now_us(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Decoder output like: boxes clustered around objects, a few labels, confidences above a typical threshold
+static void random_boxes(Detection dets[], int n){
+    float centers[16][2];
+    for(int c = 0; c < 16; c++){
+        centers[c][0] = random_unit();
+        centers[c][1] = random_unit();
+    }
+    for(int i = 0; i < n; i++){
+        const float* center = centers[next_random() % 16];
+        float size = 0.02f + 0.1f * random_unit();
+        float x = center[0] + 0.05f * (random_unit() - 0.5f);
+        float y = center[1] + 0.05f * (random_unit() - 0.5f);
+        Detection* det = &dets[i];
+        memset(det, 0, sizeof(*det));
+        det->label = (float) (next_random() % 4);
+        det->confidence = 0.3f + 0.7f * random_unit();
+        det->x_min = fmaxf(0.f, x - size);
+        det->y_min = fmaxf(0.f, y - size);
+        det->x_max = fminf(1.f, x + size);
+        det->y_max = fminf(1.f, y + size);
+    }
+}
+
+static int compare_confidence(const void* a, const void* b){
+    float ca = ((const Detection*) a)->confidence;
+    float cb = ((const Detection*) b)->confidence;
+    return (ca < cb) - (ca > cb);
+}
+
+static float iou(const Detection* a, const Detection* b){
+    float w = fminf(a->x_max, b->x_max) - fmaxf(a->x_min, b->x_min);
+    float h = fminf(a->y_max, b->y_max) - fmaxf(a->y_min, b->y_min);
+    if(w <= 0.f || h <= 0.f){
+        return 0.f;
+    }
+    float intersection = w * h;
+    float area_a = (a->x_max - a->x_min) * (a->y_max - a->y_min);
+    float area_b = (b->x_max - b->x_min) * (b->y_max - b->y_min);
+    return intersection / (area_a + area_b - intersection);
+}
+
+static int pairwise_nms(Detection dets[], int detections_nr, float iou_thr, int class_aware){
+    qsort(dets, detections_nr, sizeof(Detection), compare_confidence);
+    int kept = 0;
+    for(int i = 0; i < detections_nr; i++){
+        int suppressed = 0;
+        for(int k = 0; k < kept && !suppressed; k++){
+            suppressed = (!class_aware || dets[k].label == dets[i].label) && iou(&dets[k], &dets[i]) > iou_thr;
+        }
+        if(!suppressed){
+            dets[kept++] = dets[i];
+        }
+    }
+    return kept;
+}
+
+// average microseconds per call, each call on a fresh copy of the input
+static double time_nms(int (*nms)(Detection*, int, float, int), const Detection* input, Detection* work, int n, int rounds, int* kept){
+    double total = 0.;
+    for(int r = 0; r < rounds; r++){
+        memcpy(work, input, n * sizeof(Detection));
+        double start = now_us();
+        *kept = nms(work, n, 0.5f, 1);
+        total += now_us() - start;
+    }
+    return total / rounds;
+}
+
+int main(int argc, char** argv){
+    const int counts[] = {100, 1000, 10000};
+    int rounds = argc > 1 ? atoi(argv[1]) : 20;
+    rounds = rounds > 0 ? rounds : 1;
+
+    printf("%8s %12s %12s %8s %8s\n", "boxes", "grid us", "pairwise us", "speedup", "kept");
+    for(size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++){
+        int n = counts[c];
+        Detection* input = malloc(n * sizeof(Detection));
+        Detection* work = malloc(n * sizeof(Detection));
+        if(input == NULL || work == NULL){
+            return 1;
+        }
+        random_boxes(input, n);
+
+        int grid_kept, pairwise_kept;
+        double grid = time_nms(nms_detections, input, work, n, rounds, &grid_kept);
+        double pairwise = time_nms(pairwise_nms, input, work, n, rounds, &pairwise_kept);
+        printf("%8d %12.1f %12.1f %7.1fx %8d%s\n", n, grid, pairwise, pairwise / grid, grid_kept,
+               grid_kept == pairwise_kept ? "" : " (pairwise kept a different number)");
+        free(input);
+        free(work);
+    }
+    return 0;
+}
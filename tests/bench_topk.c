@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "float16.h"
+#include "tensor_kernels.h"
+
+// Top-k timings on 1000-class classifier outputs, FP16 and U8, against sorting every index. Not a test, run by hand:
+//   ./bench_topk [rounds]
+
+#define CLASSES     1000
+
+static uint32_t rng_state = 2024;
+
+static uint32_t next_random(void){
+    rng_state = rng_state * 1664525u + 1013904223u;
+    return rng_state >> 8;
+}
+
+static double now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static const float* sort_values;
+
+// largest first, ties by index
+static int compare_index(const void* a, const void* b){
+    uint32_t ia = *(const uint32_t*) a, ib = *(const uint32_t*) b;
+    if(sort_values[ia] != sort_values[ib]){
+        return sort_values[ia] < sort_values[ib] ? 1 : -1;
+    }
+    return (ia > ib) - (ia < ib);
+}
+
+// the baseline: convert everything, sort all indices, keep the first k
+static size_t sort_topk_f16(const uint16_t* data, size_t n, size_t k, uint32_t* indices){
+    static float values[CLASSES];
+    static uint32_t order[CLASSES];
+    f16_to_f32_n(values, data, n);
+    for(size_t i = 0; i < n; i++){
+        order[i] = (uint32_t) i;
+    }
+    sort_values = values;
+    qsort(order, n, sizeof(uint32_t), compare_index);
+    k = k < n ? k : n;
+    memcpy(indices, order, k * sizeof(uint32_t));
+    return k;
+}
+
+int main(int argc, char** argv){
+    const size_t ks[] = {1, 5, 10, 50};
+    int rounds = argc > 1 ? atoi(argv[1]) : 2000;
+    rounds = rounds > 0 ? rounds : 1;
+
+    // logits, mostly small with a few confident classes, like a softmax input
+    static uint16_t halves[CLASSES];
+    static uint8_t bytes[CLASSES];
+    for(int i = 0; i < CLASSES; i++){
+        float logit = (int) (next_random() % 2001 - 1000) / 250.f;
+        if(next_random() % 100 == 0){
+            logit += 8.f;
+        }
+        halves[i] = f32_to_f16(logit);
+        bytes[i] = (uint8_t) (128 + logit * 12);
+    }
+
+    uint32_t indices[CLASSES];
+    uint32_t check = 0;
+    printf("%4s %12s %12s %12s %8s\n", "k", "f16 ns", "u8 ns", "sort ns", "speedup");
+    for(size_t t = 0; t < sizeof(ks) / sizeof(ks[0]); t++){
+        size_t k = ks[t];
+        double start = now_ns();
+        for(int r = 0; r < rounds; r++){
+            check += topk_f16(halves, CLASSES, k, indices) + indices[0];
+        }
+        double f16 = (now_ns() - start) / rounds;
+
+        start = now_ns();
+        for(int r = 0; r < rounds; r++){
+            check += topk_u8(bytes, CLASSES, k, indices) + indices[0];
+        }
+        double u8 = (now_ns() - start) / rounds;
+
+        start = now_ns();
+        for(int r = 0; r < rounds; r++){
+            check += sort_topk_f16(halves, CLASSES, k, indices) + indices[0];
+        }
+        double sorted = (now_ns() - start) / rounds;
+        printf("%4zu %12.0f %12.0f %12.0f %7.1fx\n", k, f16, u8, sorted, sorted / f16);
+    }
+
+    double start = now_ns();
+    for(int r = 0; r < rounds; r++){
+        check += (uint32_t) argmax_f16(halves, CLASSES);
+    }
+    printf("argmax_f16 %.0f ns\n", (now_ns() - start) / rounds);
+    // keeps the loops from being optimized out
+    return check == 0 ? 1 : 0;
+}
@@ -0,0 +1,265 @@
+#ifndef SHARED_TEST_SIM_DEVICE_H
+#define SHARED_TEST_SIM_DEVICE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "spi_api.hpp"
+
+// Simulated SPI slave, driving SpiApi through its context carrying transport callbacks. The device side of the command
+// packets isn't part of the SPI library, so the field positions are learned from the library's own command generators.
+class SimDevice {
+    public:
+        struct SimMessage {
+            std::vector<uint8_t> data;
+            std::vector<uint8_t> meta;      // serialized metadata, datatype and size, as the device sends it
+        };
+
+        std::map<std::string, std::deque<SimMessage>> streams;
+        std::vector<SimMessage> received;   // SEND_DATA uploads
+        int dropped_uploads = 0;            // uploads with a packet which failed its CRC
+        std::map<int, int> commands;        // commands seen, by spi_command
+        std::vector<std::pair<uint32_t, uint32_t>> partial_requests;    // GET_MESSAGE_PART offset and size
+
+        // called with every packet before it is clocked out, may change or shorten it. index counts all packets.
+        std::function<void(std::vector<uint8_t>& packet, int index)> fault;
+        // answer SEND_DATA with a status before the payload
+        bool ack_send_data = true;
+        uint8_t send_data_status = SPI_MSG_SUCCESS_RESP;
+        // firmware with pipelined send support: tagged statuses, a refused upload is still read, and every upload
+        // ends with a completion status
+        bool tag_send_status = false;
+
+        SimDevice() {
+            spi_protocol_init(&protocol);
+            learn_layout();
+        }
+
+        void attach(dai::SpiApi& api){
+            api.set_send_spi_impl(&SimDevice::send_cb, this);
+            api.set_recv_spi_impl(&SimDevice::recv_cb, this);
+            api.set_spi_transfer_impl(&SimDevice::transfer_cb, this);
+        }
+
+        void add_message(const std::string& stream_name, const std::vector<uint8_t>& data, const dai::RawBuffer& metadata){
+            SimMessage msg;
+            msg.data = data;
+            msg.meta = serialize(metadata);
+            streams[stream_name].push_back(msg);
+        }
+
+        static std::vector<uint8_t> serialize(const dai::RawBuffer& msg){
+            std::vector<uint8_t> meta;
+            dai::DatatypeEnum datatype;
+            msg.serialize(meta, datatype);
+            uint32_t meta_size = meta.size();
+            int32_t type = static_cast<int32_t>(datatype);
+            for(int i = 0; i < 4; i++) meta.push_back((type >> (i * 8)) & 0xFF);
+            for(int i = 0; i < 4; i++) meta.push_back((meta_size >> (i * 8)) & 0xFF);
+            return meta;
+        }
+
+        size_t pending_bytes() const { return out.size(); }
+        // bytes of an announced upload not received yet
+        uint32_t upload_pending() const { return upload_left; }
+
+    private:
+        // positions in the packet payload
+        size_t cmd_pos = 0, name_pos = 0, offset_pos = 0, size_pos = 0, send_meta_pos = 0, send_size_pos = 0;
+
+        SpiProtocolInstance protocol;
+        std::deque<uint8_t> out;
+        int packet_index = 0;
+        bool upload_corrupt = false;
+        bool upload_refused = false;
+        uint32_t upload_left = 0;
+        uint32_t upload_meta = 0;
+        std::vector<uint8_t> upload;
+
+        static size_t find(const uint8_t* data, const uint8_t* pattern, size_t size){
+            for(size_t i = 0; i + size <= SPI_PROTOCOL_PAYLOAD_SIZE; i++){
+                if(memcmp(data + i, pattern, size) == 0){
+                    return i;
+                }
+            }
+            return 0;
+        }
+
+        void learn_layout(){
+            SpiProtocolPacket a, b;
+            const uint8_t offset[4] = {0x01, 0x02, 0x03, 0x04};
+            const uint8_t size[4] = {0x05, 0x06, 0x07, 0x08};
+            spi_generate_command_partial(&a, GET_SIZE, 4, "QZX", 0x04030201, 0x08070605);
+            spi_generate_command_partial(&b, GET_MESSAGE_PART, 4, "QZX", 0x04030201, 0x08070605);
+            for(size_t i = 0; i < SPI_PROTOCOL_PAYLOAD_SIZE; i++){
+                if(a.data[i] != b.data[i]){
+                    cmd_pos = i;
+                    break;
+                }
+            }
+            name_pos = find(a.data, (const uint8_t*) "QZX", 4);
+            offset_pos = find(a.data, offset, 4);
+            size_pos = find(a.data, size, 4);
+
+            spi_generate_command_send(&a, SEND_DATA, 4, "QZX", 0x04030201, 0x08070605);
+            send_meta_pos = find(a.data, offset, 4);
+            send_size_pos = find(a.data, size, 4);
+        }
+
+        static uint32_t read_u32(const uint8_t* data){
+            return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t) data[3] << 24);
+        }
+
+        void push_packet(const uint8_t* data, uint32_t size){
+            uint8_t payload[SPI_PROTOCOL_PAYLOAD_SIZE] = {0};
+            memcpy(payload, data, size);
+            SpiProtocolPacket packet;
+            spi_protocol_write_packet(&packet, payload, SPI_PROTOCOL_PAYLOAD_SIZE);
+            std::vector<uint8_t> bytes((uint8_t*) &packet, (uint8_t*) &packet + SPI_PKT_SIZE);
+            if(fault){
+                fault(bytes, packet_index);
+            }
+            packet_index++;
+            out.insert(out.end(), bytes.begin(), bytes.end());
+        }
+
+        void push_range(const std::vector<uint8_t>& data, uint32_t offset, uint32_t size){
+            for(uint32_t i = 0; i < size; i += SPI_PROTOCOL_PAYLOAD_SIZE){
+                uint32_t chunk = std::min<uint32_t>(SPI_PROTOCOL_PAYLOAD_SIZE, size - i);
+                push_packet(data.data() + offset + i, chunk);
+            }
+        }
+
+        void push_u32(uint32_t value){
+            uint8_t bytes[4] = {(uint8_t) value, (uint8_t) (value >> 8), (uint8_t) (value >> 16), (uint8_t) (value >> 24)};
+            push_packet(bytes, 4);
+        }
+
+        void push_status(uint8_t status, uint8_t tag = 0){
+            uint8_t bytes[2] = {status, tag};
+            push_packet(bytes, 2);
+        }
+
+        void on_command(const uint8_t* data){
+            int cmd = data[cmd_pos];
+            std::string name((const char*) data + name_pos);
+            commands[cmd]++;
+            auto& queue = streams[name];
+
+            switch(cmd){
+                case GET_SIZE:
+                    push_u32(queue.empty() ? 0xFFFFFFFFU : queue.front().data.size());
+                    break;
+                case GET_METASIZE:
+                    push_u32(queue.empty() ? 0xFFFFFFFFU : queue.front().meta.size());
+                    break;
+                case GET_MESSAGE:
+                    if(!queue.empty()) push_range(queue.front().data, 0, queue.front().data.size());
+                    break;
+                case GET_METADATA:
+                    if(!queue.empty()) push_range(queue.front().meta, 0, queue.front().meta.size());
+                    break;
+                case GET_MESSAGE_PART: {
+                    uint32_t offset = read_u32(data + offset_pos);
+                    uint32_t size = read_u32(data + size_pos);
+                    partial_requests.push_back({offset, size});
+                    if(!queue.empty()) push_range(queue.front().data, offset, size);
+                    break;
+                }
+                case POP_MESSAGE:
+                    push_status(queue.empty() ? SPI_MSG_FAIL_RESP : SPI_MSG_SUCCESS_RESP);
+                    if(!queue.empty()) queue.pop_front();
+                    break;
+                case POP_MESSAGES:
+                    for(auto& entry : streams) entry.second.clear();
+                    push_status(SPI_MSG_SUCCESS_RESP);
+                    break;
+                case SEND_DATA:
+                    upload_meta = read_u32(data + send_meta_pos);
+                    upload_left = read_u32(data + send_size_pos);
+                    upload.clear();
+                    upload_corrupt = false;
+                    upload_refused = send_data_status != SPI_MSG_SUCCESS_RESP;
+                    if(ack_send_data) push_status(send_data_status, tag_send_status ? dai::SEND_STATUS_ACCEPT : 0);
+                    if(upload_refused && !tag_send_status) upload_left = 0;
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        void on_packet(const uint8_t* bytes){
+            SpiProtocolPacket packet;
+            memcpy(&packet, bytes, SPI_PKT_SIZE);
+            if(upload_left == 0){
+                on_command(packet.data);
+                return;
+            }
+
+            uint32_t chunk = std::min<uint32_t>(SPI_PROTOCOL_PAYLOAD_SIZE, upload_left);
+            upload.insert(upload.end(), packet.data, packet.data + chunk);
+            upload_left -= chunk;
+            if(spi_protocol_parse(&protocol, (uint8_t*) bytes, SPI_PKT_SIZE) == nullptr){
+                upload_corrupt = true;
+            }
+            if(upload_left == 0 && upload_refused){
+                push_status(SPI_MSG_FAIL_RESP, dai::SEND_STATUS_DONE);
+            } else if(upload_left == 0 && upload_corrupt){
+                dropped_uploads++;
+                if(tag_send_status) push_status(SPI_MSG_FAIL_RESP, dai::SEND_STATUS_DONE);
+            } else if(upload_left == 0){
+                SimMessage msg;
+                msg.data.assign(upload.begin(), upload.end() - upload_meta);
+                msg.meta.assign(upload.end() - upload_meta, upload.end());
+                received.push_back(msg);
+                if(tag_send_status) push_status(SPI_MSG_SUCCESS_RESP, dai::SEND_STATUS_DONE);
+            }
+        }
+
+        // clocks out the next packet, zeros once the device has nothing more to say
+        uint8_t clock_out(uint8_t* recvbuf, size_t size){
+            if(out.empty()){
+                memset(recvbuf, 0, size);
+                return 0;
+            }
+            for(size_t i = 0; i < size; i++){
+                if(out.empty()){
+                    recvbuf[i] = 0;
+                } else {
+                    recvbuf[i] = out.front();
+                    out.pop_front();
+                }
+            }
+            return 1;
+        }
+
+        static uint8_t send_cb(void* ctx, const char* packet){
+            static_cast<SimDevice*>(ctx)->on_packet((const uint8_t*) packet);
+            return 1;
+        }
+
+        static uint8_t recv_cb(void* ctx, char* recvbuf){
+            return static_cast<SimDevice*>(ctx)->clock_out((uint8_t*) recvbuf, SPI_PKT_SIZE);
+        }
+
+        static uint8_t transfer_cb(void* ctx, const void* send_buffer, size_t send_size, void* receive_buffer, size_t receive_size){
+            SimDevice* device = static_cast<SimDevice*>(ctx);
+            if(receive_buffer != nullptr){
+                device->clock_out((uint8_t*) receive_buffer, receive_size);
+            }
+            if(send_buffer != nullptr){
+                for(size_t i = 0; i + SPI_PKT_SIZE <= send_size; i += SPI_PKT_SIZE){
+                    device->on_packet((const uint8_t*) send_buffer + i);
+                }
+            }
+            return 1;
+        }
+};
+
+#endif
@@ -0,0 +1,256 @@
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "decode_raw_mobilenet.h"
+#include "test_util.h"
+
+static uint32_t rng_state = 12345;
+
+static uint32_t next_random(void){
+    rng_state = rng_state * 1664525u + 1013904223u;
+    return rng_state >> 8;
+}
+
+// mostly plausible values, with a share of arbitrary bit patterns (NaNs, infinities, negatives, subnormals)
+static half random_half(void){
+    switch(next_random() % 4){
+        case 0:
+            return (half) (next_random() & 0xFFFF);
+        case 1:
+            return (half) (next_random() % 0x3C01);     // 0 to 1.0
+        default:
+            return (half) f32_to_f16((next_random() % 1000) / 999.f);
+    }
+}
+
+// The straightforward float decoder the block decoder replaced
+static int reference_decode(Detection dets[], const half* result, float confidence_thr, int max_detections){
+    int detections_nr = 0;
+    for(int i = 0; i < max_detections; i++){
+        const half* record = &result[i * 7];
+        if((uint16_t) record[0] == 0xBC00){
+            break;
+        }
+        if(f16_to_f32(record[2]) >= confidence_thr){
+            Detection* det = &dets[detections_nr++];
+            det->label = f16_to_f32(record[1]);
+            det->confidence = f16_to_f32(record[2]);
+            det->x_min = f16_to_f32(record[3]);
+            det->y_min = f16_to_f32(record[4]);
+            det->x_max = f16_to_f32(record[5]);
+            det->y_max = f16_to_f32(record[6]);
+            CLAMP_MIN_MAX(det->confidence, 0.f, 1.f);
+            CLAMP_MIN_MAX(det->x_min, 0.f, 1.f);
+            CLAMP_MIN_MAX(det->y_min, 0.f, 1.f);
+            CLAMP_MIN_MAX(det->x_max, 0.f, 1.f);
+            CLAMP_MIN_MAX(det->y_max, 0.f, 1.f);
+        }
+    }
+    return detections_nr;
+}
+
+// Detection fields from label on, bit for bit
+static int same_detection(const Detection* a, const Detection* b){
+    return memcmp(&a->label, &b->label, sizeof(Detection) - offsetof(Detection, label)) == 0;
+}
+
+// Random record lists against the reference, for thresholds on both paths and end markers in and out of blocks
+static void test_decode_matches_reference(){
+    const float thresholds[] = {-1.f, 0.f, 1e-7f, 0.3f, 0.5f, 0.9999f, 1.f, 2.f, NAN};
+    int mismatches = 0;
+
+    for(int round = 0; round < 2000; round++){
+        half records[41 * 7];
+        int max_detections = next_random() % 41;
+        for(int i = 0; i < 41 * 7; i++){
+            records[i] = random_half();
+        }
+        for(int i = 0; i < 41; i++){
+            // the header is 0 for real records, -1 ends the list
+            records[i * 7] = (next_random() % 30 == 0) ? (half) 0xBC00 : 0;
+        }
+
+        for(size_t t = 0; t < sizeof(thresholds) / sizeof(thresholds[0]); t++){
+            Detection expected[41], decoded[41];
+            int expected_nr = reference_decode(expected, records, thresholds[t], max_detections);
+            int decoded_nr = decode_raw_mobilenet(decoded, records, thresholds[t], max_detections);
+            if(decoded_nr != expected_nr){
+                mismatches++;
+                continue;
+            }
+            for(int i = 0; i < decoded_nr; i++){
+                if(!same_detection(&decoded[i], &expected[i])){
+                    mismatches++;
+                }
+            }
+        }
+    }
+    CHECK(mismatches == 0);
+}
+
+// A tensor which ends right after the end marker's header, no block reads past it
+static void test_end_marker_at_buffer_end(){
+    int mismatches = 0;
+    for(int count = 0; count <= 2 * 8 + 1; count++){
+        half* records = malloc((count * 7 + 1) * sizeof(half));
+        for(int i = 0; i < count * 7; i++){
+            records[i] = random_half();
+        }
+        for(int i = 0; i < count; i++){
+            records[i * 7] = 0;
+        }
+        records[count * 7] = (half) 0xBC00;
+
+        for(float threshold = 0.f; threshold < 1.f; threshold += 0.5f){
+            Detection expected[2 * 8 + 1], decoded[2 * 8 + 1];
+            int expected_nr = reference_decode(expected, records, threshold, 40);
+            int decoded_nr = decode_raw_mobilenet(decoded, records, threshold, 40);
+            mismatches += decoded_nr != expected_nr;
+            for(int i = 0; i < decoded_nr && i < expected_nr; i++){
+                mismatches += !same_detection(&decoded[i], &expected[i]);
+            }
+        }
+        free(records);
+    }
+    CHECK(mismatches == 0);
+}
+
+static void count_detection(void* ctx, const Detection* det){
+    (void) det;
+    (*(int*) ctx)++;
+}
+
+// Fed in chunks split at any byte, the streaming decoder gives what the whole tensor decode does
+static void test_stream_matches_whole(){
+    int mismatches = 0;
+
+    for(int round = 0; round < 500; round++){
+        half records[41 * 7];
+        int max_detections = 1 + next_random() % 40;
+        for(int i = 0; i < 41 * 7; i++){
+            records[i] = random_half();
+        }
+        for(int i = 0; i < 41; i++){
+            records[i * 7] = (next_random() % 20 == 0) ? (half) 0xBC00 : 0;
+        }
+        float threshold = (round % 3 == 0) ? 0.f : 0.5f;
+
+        Detection expected[41], streamed[41];
+        int expected_nr = decode_raw_mobilenet(expected, records, threshold, max_detections);
+
+        MobilenetStreamDecoder decoder;
+        int callbacks = 0;
+        mobilenet_stream_init(&decoder, streamed, threshold, max_detections);
+        mobilenet_stream_set_detection_cb(&decoder, count_detection, &callbacks);
+        const uint8_t* bytes = (const uint8_t*) records;
+        uint32_t offset = 0;
+        int more = 1;
+        while(more && offset < sizeof(records)){
+            uint32_t chunk = 1 + next_random() % 40;
+            if(chunk > sizeof(records) - offset){
+                chunk = sizeof(records) - offset;
+            }
+            more = mobilenet_stream_feed(&decoder, bytes + offset, chunk);
+            offset += chunk;
+        }
+
+        // done once the end marker or max_detections records were seen
+        if(more || decoder.detections_nr != expected_nr || callbacks != expected_nr){
+            mismatches++;
+            continue;
+        }
+        for(int i = 0; i < expected_nr; i++){
+            if(!same_detection(&streamed[i], &expected[i])){
+                mismatches++;
+            }
+        }
+    }
+    CHECK(mismatches == 0);
+}
+
+// Q15 of the clamped float value, rounded half up like half_to_q15_clamped
+static uint16_t reference_q15(uint16_t bits){
+    float value = f16_to_f32(bits);
+    if(isnan(value) || value <= 0.f){
+        return 0;
+    }
+    if(value >= 1.f){
+        return Q15_ONE;
+    }
+    return (uint16_t) floor((double) value * Q15_ONE + 0.5);
+}
+
+// every half against the float path
+static void test_q15_all_halves(){
+    int mismatches = 0;
+    for(uint32_t bits = 0; bits <= 0xFFFF; bits++){
+        if(half_to_q15_clamped((half) bits) != reference_q15(bits)){
+            mismatches++;
+        }
+    }
+    CHECK(mismatches == 0);
+}
+
+// labels are truncated toward zero, everything outside the int16 range saturates
+static void test_fixed_labels_all_halves(){
+    int mismatches = 0;
+    half record[2 * 7] = {0};
+    record[2] = (half) 0x3C00;      // confidence 1.0
+    record[7] = (half) 0xBC00;      // end of the list
+    for(uint32_t bits = 0; bits <= 0xFFFF; bits++){
+        DetectionFixed det;
+        record[1] = (half) bits;
+        if(decode_raw_mobilenet_fixed(&det, record, 0, 2, 300, 300) != 1){
+            mismatches++;
+            continue;
+        }
+
+        float value = f16_to_f32(bits);
+        int32_t expected;
+        if(isnan(value) || fabsf(value) >= 32768.f){
+            expected = (bits & 0x8000) ? -INT16_MAX : INT16_MAX;
+        } else {
+            expected = (int32_t) value;
+        }
+        if(det.label != expected){
+            mismatches++;
+        }
+    }
+    CHECK(mismatches == 0);
+}
+
+// boxes and confidences agree with the float decoder to within rounding
+static void test_fixed_matches_float(){
+    half records[4 * 7] = {
+        0, 3, 0x3A00, 0x2E66, 0x3266, 0x3800, 0x3B33,      // 0.75 confidence, box 0.1 0.2 0.5 0.9
+        0, 1, 0x3400, 0x0000, 0xBC00, 0x3C00, 0x4000,      // 0.25, clamped box
+        0, 7, 0x3C00, 0x0001, 0x03FF, 0x3BFF, 0x3C01,      // subnormals and the halves around 1.0
+        (half) 0xBC00,
+    };
+    Detection dets[4];
+    DetectionFixed fixed[4];
+    int count = decode_raw_mobilenet(dets, records, 0.5f, 4);
+    CHECK(decode_raw_mobilenet_fixed(fixed, records, Q15_ONE / 2, 4, 640, 480) == count);
+    CHECK(count == 2);
+
+    for(int i = 0; i < count; i++){
+        CHECK(fixed[i].label == (int16_t) dets[i].label);
+        CHECK(fabsf(fixed[i].confidence / (float) Q15_ONE - dets[i].confidence) <= 1.f / Q15_ONE);
+        CHECK(fabsf(fixed[i].x_min - dets[i].x_min * 640) <= 1.f);
+        CHECK(fabsf(fixed[i].y_min - dets[i].y_min * 480) <= 1.f);
+        CHECK(fabsf(fixed[i].x_max - dets[i].x_max * 640) <= 1.f);
+        CHECK(fabsf(fixed[i].y_max - dets[i].y_max * 480) <= 1.f);
+    }
+}
+
+int main(){
+    test_decode_matches_reference();
+    test_end_marker_at_buffer_end();
+    test_stream_matches_whole();
+    test_q15_all_halves();
+    test_fixed_labels_all_halves();
+    test_fixed_matches_float();
+    return TEST_RESULT();
+}
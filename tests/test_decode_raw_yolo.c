@@ -0,0 +1,178 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "decode_raw_yolo.h"
+#include "test_util.h"
+
+#define GRID            7
+#define CLASSES         3
+#define CHANNELS        (5 + CLASSES)
+#define LAYER_ANCHORS   2
+#define LAYER_SIZE      (LAYER_ANCHORS * CHANNELS * GRID * GRID)
+#define MAX_CANDIDATES  (2 * LAYER_ANCHORS * GRID * GRID)
+
+static const float anchors[] = {10, 14, 23, 27, 37, 58, 81, 82};
+static const int masks[2][LAYER_ANCHORS] = {{2, 3}, {0, 1}};
+
+static uint32_t rng_state = 777;
+
+static uint32_t next_random(void){
+    rng_state = rng_state * 1664525u + 1013904223u;
+    return rng_state >> 8;
+}
+
+// logit between lo and hi, in 1/64 steps so it's exact as a half
+static half random_logit(int lo, int hi){
+    return (half) f32_to_f16(lo + (next_random() % ((hi - lo) * 64)) / 64.f);
+}
+
+static float sigmoid(float x){
+    return 1.f / (1.f + expf(-x));
+}
+
+static float clamp01(float val){
+    return val < 0.f ? 0.f : (val > 1.f ? 1.f : val);
+}
+
+static size_t value_index(YoloLayout layout, int anchor, int channel, int cell){
+    if(layout == YOLO_LAYOUT_CHW){
+        return ((size_t) anchor * CHANNELS + channel) * GRID * GRID + cell;
+    }
+    return ((size_t) anchor * GRID * GRID + cell) * CHANNELS + channel;
+}
+
+// Every cell without the objectness pre-filter, YOLO_V3 boxes
+static int reference_decode_layer(Detection dets[], int detections_nr, const YoloConfig* config, const YoloLayer* layer){
+    for(int a = 0; a < layer->mask_size; a++){
+        const float* anchor = &config->anchors[2 * layer->mask[a]];
+        for(int cell = 0; cell < GRID * GRID; cell++){
+            float value[CHANNELS];
+            for(int c = 0; c < CHANNELS; c++){
+                value[c] = f16_to_f32(layer->data[value_index(config->layout, a, c, cell)]);
+            }
+            int best_class = 0;
+            for(int c = 1; c < CLASSES; c++){
+                if(value[5 + c] > value[5 + best_class]){
+                    best_class = c;
+                }
+            }
+            float confidence = sigmoid(value[4]) * sigmoid(value[5 + best_class]);
+            if(confidence < config->confidence_thr){
+                continue;
+            }
+            float center_x = ((cell % GRID) + sigmoid(value[0])) / GRID;
+            float center_y = ((cell / GRID) + sigmoid(value[1])) / GRID;
+            float half_w = 0.5f * expf(value[2]) * anchor[0] / config->input_width;
+            float half_h = 0.5f * expf(value[3]) * anchor[1] / config->input_height;
+
+            Detection* det = &dets[detections_nr++];
+            det->header = 0;
+            det->label = (float) best_class;
+            det->confidence = clamp01(confidence);
+            det->x_min = clamp01(center_x - half_w);
+            det->y_min = clamp01(center_y - half_h);
+            det->x_max = clamp01(center_x + half_w);
+            det->y_max = clamp01(center_y + half_h);
+        }
+    }
+    return detections_nr;
+}
+
+static int compare_confidence(const void* a, const void* b){
+    float ca = ((const Detection*) a)->confidence;
+    float cb = ((const Detection*) b)->confidence;
+    return (ca < cb) - (ca > cb);
+}
+
+static int close_to(float a, float b){
+    return fabsf(a - b) <= 1e-5f;
+}
+
+static int same_detection(const Detection* a, const Detection* b){
+    return a->label == b->label && close_to(a->confidence, b->confidence) && close_to(a->x_min, b->x_min)
+        && close_to(a->y_min, b->y_min) && close_to(a->x_max, b->x_max) && close_to(a->y_max, b->y_max);
+}
+
+static void fill_layer(half* data, YoloLayout layout, int objectness_lo, int objectness_hi){
+    for(int a = 0; a < LAYER_ANCHORS; a++){
+        for(int cell = 0; cell < GRID * GRID; cell++){
+            for(int c = 0; c < CHANNELS; c++){
+                half value = c == 4 ? random_logit(objectness_lo, objectness_hi) : random_logit(-3, 3);
+                data[value_index(layout, a, c, cell)] = value;
+            }
+        }
+    }
+}
+
+static YoloConfig make_config(YoloLayout layout){
+    YoloConfig config;
+    memset(&config, 0, sizeof(config));
+    config.version = YOLO_V3;
+    config.layout = layout;
+    config.num_classes = CLASSES;
+    config.input_width = 416;
+    config.input_height = 416;
+    config.anchors = anchors;
+    config.confidence_thr = 0.3f;
+    config.iou_thr = 0.5f;
+    return config;
+}
+
+// With room for all, the pre-filtered decoder finds the same detections as decoding every cell, for both layouts
+static void test_layer_matches_reference(){
+    for(int layout = YOLO_LAYOUT_CHW; layout <= YOLO_LAYOUT_HWC; layout++){
+        YoloConfig config = make_config((YoloLayout) layout);
+        half data[LAYER_SIZE];
+        fill_layer(data, config.layout, -6, 3);
+        YoloLayer layer = {data, GRID, GRID, masks[0], LAYER_ANCHORS};
+
+        Detection expected[MAX_CANDIDATES], decoded[MAX_CANDIDATES];
+        int expected_nr = reference_decode_layer(expected, 0, &config, &layer);
+        int decoded_nr = decode_raw_yolo_layer(decoded, 0, MAX_CANDIDATES, &config, &layer);
+        CHECK(expected_nr > 10);
+        CHECK(decoded_nr == expected_nr);
+        int mismatches = 0;
+        for(int i = 0; i < decoded_nr && i < expected_nr; i++){
+            mismatches += !same_detection(&decoded[i], &expected[i]);
+        }
+        CHECK(mismatches == 0);
+    }
+}
+
+// A full output keeps the most confident detections over all layers, a confident later layer isn't dropped
+static void test_full_output_keeps_best(){
+    for(int layout = YOLO_LAYOUT_CHW; layout <= YOLO_LAYOUT_HWC; layout++){
+        YoloConfig config = make_config((YoloLayout) layout);
+        half data[2][LAYER_SIZE];
+        fill_layer(data[0], config.layout, -2, 2);
+        fill_layer(data[1], config.layout, 0, 6);      // the second layer is more confident
+        YoloLayer layers[2] = {{data[0], GRID, GRID, masks[0], LAYER_ANCHORS}, {data[1], GRID, GRID, masks[1], LAYER_ANCHORS}};
+
+        Detection all[MAX_CANDIDATES];
+        int all_nr = reference_decode_layer(all, 0, &config, &layers[0]);
+        all_nr = reference_decode_layer(all, all_nr, &config, &layers[1]);
+        qsort(all, all_nr, sizeof(Detection), compare_confidence);
+
+        const int limits[] = {0, 1, 5, 20};
+        for(size_t l = 0; l < sizeof(limits) / sizeof(limits[0]); l++){
+            int max_detections = limits[l];
+            Detection decoded[20];
+            int decoded_nr = decode_raw_yolo_layer(decoded, 0, max_detections, &config, &layers[0]);
+            decoded_nr = decode_raw_yolo_layer(decoded, decoded_nr, max_detections, &config, &layers[1]);
+            CHECK(decoded_nr == (all_nr < max_detections ? all_nr : max_detections));
+            qsort(decoded, decoded_nr, sizeof(Detection), compare_confidence);
+            int mismatches = 0;
+            for(int i = 0; i < decoded_nr; i++){
+                mismatches += !close_to(decoded[i].confidence, all[i].confidence);
+            }
+            CHECK(mismatches == 0);
+        }
+    }
+}
+
+int main(){
+    test_layer_matches_reference();
+    test_full_output_keeps_best();
+    return TEST_RESULT();
+}
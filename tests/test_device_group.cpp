@@ -0,0 +1,89 @@
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "device_group.hpp"
+#include "sim_device.hpp"
+#include "test_util.h"
+
+static void add_messages(SimDevice& device, const char* stream_name, int count){
+    for(int i = 0; i < count; i++){
+        dai::RawImgFrame frame;
+        frame.sequenceNum = i;
+        device.add_message(stream_name, std::vector<uint8_t>(100, (uint8_t) i), frame);
+    }
+}
+
+// Every message of both links arrives once, in order per stream, tagged with its device
+static void test_two_links(){
+    SimDevice devices[2];
+    dai::SpiApi apis[2];
+    devices[0].attach(apis[0]);
+    devices[1].attach(apis[1]);
+    add_messages(devices[0], "a", 3);
+    add_messages(devices[1], "b", 3);
+    add_messages(devices[1], "c", 2);
+
+    dai::DeviceGroup group;
+    CHECK(group.add_device(apis[0], {"a"}) == 0);
+    CHECK(group.add_device(apis[1], {"b", "c"}) == 1);
+    group.start();
+    CHECK(group.add_device(apis[0], {"a"}) == SIZE_MAX);
+
+    std::map<std::string, std::vector<int>> received;
+    int wrong_device = 0;
+    for(int i = 0; i < 8; i++){
+        dai::GroupMessage group_msg;
+        if(!group.get_message(&group_msg, 1000)){
+            break;
+        }
+        wrong_device += group_msg.device != (group_msg.stream_name == "a" ? 0u : 1u);
+        received[group_msg.stream_name].push_back(group_msg.msg.raw_data.size == 100 ? group_msg.msg.raw_data.data[0] : -1);
+        group.free_message(&group_msg);
+    }
+    dai::GroupMessage group_msg;
+    CHECK(!group.get_message(&group_msg, 10));
+    group.stop();
+
+    CHECK(wrong_device == 0);
+    CHECK(received["a"] == std::vector<int>({0, 1, 2}));
+    CHECK(received["b"] == std::vector<int>({0, 1, 2}));
+    CHECK(received["c"] == std::vector<int>({0, 1}));
+    CHECK(devices[0].streams["a"].empty() && devices[1].streams["b"].empty() && devices[1].streams["c"].empty());
+}
+
+// A full queue stops the links, the rest of the messages wait on the devices
+static void test_full_queue(){
+    SimDevice devices[2];
+    dai::SpiApi apis[2];
+    devices[0].attach(apis[0]);
+    devices[1].attach(apis[1]);
+    add_messages(devices[0], "a", 10);
+    add_messages(devices[1], "b", 10);
+
+    dai::DeviceGroup group(2);
+    group.add_device(apis[0], {"a"});
+    group.add_device(apis[1], {"b"});
+    group.start();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    group.stop();
+
+    size_t queued = 0;
+    dai::GroupMessage group_msg;
+    while(group.get_message(&group_msg, 0)){
+        queued++;
+        group.free_message(&group_msg);
+    }
+    // both links may pass the check for room at once
+    CHECK(queued >= 2 && queued <= 3);
+    CHECK(devices[0].streams["a"].size() + devices[1].streams["b"].size() + queued == 20);
+}
+
+int main(){
+    test_two_links();
+    test_full_queue();
+    return TEST_RESULT();
+}
@@ -0,0 +1,101 @@
+#include <math.h>
+#include <string.h>
+
+#include "float16.h"
+#include "test_util.h"
+
+static uint32_t float_bits(float value){
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+// The half's value from its fields
+static float reference_f16_to_f32(uint16_t bits){
+    int exponent = (bits >> 10) & 0x1f;
+    int mantissa = bits & 0x3ff;
+    float magnitude;
+    if(exponent == 0x1f){
+        magnitude = mantissa == 0 ? INFINITY : NAN;
+    } else if(exponent == 0){
+        magnitude = ldexpf((float) mantissa, -24);
+    } else {
+        magnitude = ldexpf((float) (mantissa | 0x400), exponent - 25);
+    }
+    return (bits & 0x8000) ? -magnitude : magnitude;
+}
+
+// Every half, scalar and bulk, at every tail length of the vector loops
+static void test_f16_to_f32_all_halves(){
+    static uint16_t halves[0x10000];
+    static float floats[0x10000 + 1];
+    for(uint32_t i = 0; i < 0x10000; i++){
+        halves[i] = (uint16_t) i;
+    }
+
+    int mismatches = 0;
+    for(uint32_t i = 0; i < 0x10000; i++){
+        float expected = reference_f16_to_f32(halves[i]);
+        float value = f16_to_f32(halves[i]);
+        mismatches += isnan(expected) ? !isnan(value) : float_bits(value) != float_bits(expected);
+    }
+    CHECK(mismatches == 0);
+
+    for(size_t offset = 0; offset < 9; offset++){
+        size_t n = 0x10000 - offset;
+        floats[n] = -1.f;
+        f16_to_f32_n(floats, halves + offset, n);
+        int bulk_mismatches = floats[n] != -1.f;
+        for(size_t i = 0; i < n; i++){
+            float expected = reference_f16_to_f32(halves[offset + i]);
+            bulk_mismatches += isnan(expected) ? !isnan(floats[i]) : float_bits(floats[i]) != float_bits(expected);
+        }
+        CHECK(bulk_mismatches == 0);
+    }
+}
+
+// Halves round trip, points between two halves round to nearest even, both scalar and bulk
+static void test_f32_to_f16_rounding(){
+    static float values[3 * 0x7c00];
+    static uint16_t expected[3 * 0x7c00];
+    static uint16_t bulk[3 * 0x7c00 + 1];
+    size_t n = 0;
+    for(uint32_t bits = 0; bits < 0x7c00; bits++){
+        float value = reference_f16_to_f32((uint16_t) bits);
+        // above the largest half, the next step would be 2^16
+        float next = bits + 1 == 0x7c00 ? 65536.f : reference_f16_to_f32((uint16_t) (bits + 1));
+        float midpoint = value + (next - value) / 2;
+        // the exact half, the midpoint and just above it
+        values[n] = value;
+        expected[n++] = (uint16_t) bits;
+        values[n] = midpoint;
+        expected[n++] = (uint16_t) ((bits & 1) ? bits + 1 : bits);
+        values[n] = nextafterf(midpoint, INFINITY);
+        expected[n++] = (uint16_t) (bits + 1);
+    }
+    // past the largest half's midpoint the result is Inf
+    CHECK(expected[n - 2] == 0x7c00 && expected[n - 1] == 0x7c00);
+
+    int mismatches = 0;
+    for(size_t i = 0; i < n; i++){
+        mismatches += f32_to_f16(values[i]) != expected[i];
+        mismatches += f32_to_f16(-values[i]) != (expected[i] | 0x8000);
+    }
+    CHECK(mismatches == 0);
+
+    bulk[n] = 0x1234;
+    f32_to_f16_n(bulk, values, n);
+    CHECK(bulk[n] == 0x1234);
+    CHECK(memcmp(bulk, expected, n * sizeof(uint16_t)) == 0);
+
+    CHECK(f32_to_f16(1e10f) == 0x7c00);
+    CHECK(f32_to_f16(-INFINITY) == 0xfc00);
+    CHECK((f32_to_f16(NAN) & 0x7e00) == 0x7e00);
+    CHECK(f32_to_f16(1e-10f) == 0);
+}
+
+int main(){
+    test_f16_to_f32_all_halves();
+    test_f32_to_f16_rounding();
+    return TEST_RESULT();
+}
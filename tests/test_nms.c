@@ -0,0 +1,144 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nms.h"
+#include "test_util.h"
+
+#define MAX_BOXES   400
+
+static uint32_t rng_state = 4242;
+
+static uint32_t next_random(void){
+    rng_state = rng_state * 1664525u + 1013904223u;
+    return rng_state >> 8;
+}
+
+static float random_unit(void){
+    return (next_random() % 10001) / 10000.f;
+}
+
+static float iou(const Detection* a, const Detection* b){
+    float w = fminf(a->x_max, b->x_max) - fmaxf(a->x_min, b->x_min);
+    float h = fminf(a->y_max, b->y_max) - fmaxf(a->y_min, b->y_min);
+    if(w <= 0.f || h <= 0.f){
+        return 0.f;
+    }
+    float intersection = w * h;
+    float area_a = (a->x_max - a->x_min) * (a->y_max - a->y_min);
+    float area_b = (b->x_max - b->x_min) * (b->y_max - b->y_min);
+    return intersection / (area_a + area_b - intersection);
+}
+
+// Textbook greedy NMS, every candidate against every kept box. Selection of the most confident box left, the first
+// one on ties.
+static int reference_nms(Detection dets[], int detections_nr, float iou_thr, int class_aware){
+    for(int i = 0; i < detections_nr; i++){
+        int best = i;
+        for(int j = i + 1; j < detections_nr; j++){
+            best = dets[j].confidence > dets[best].confidence ? j : best;
+        }
+        Detection det = dets[best];
+        memmove(&dets[i + 1], &dets[i], (best - i) * sizeof(Detection));
+        dets[i] = det;
+    }
+    int kept = 0;
+    for(int i = 0; i < detections_nr; i++){
+        int suppressed = 0;
+        for(int k = 0; k < kept && !suppressed; k++){
+            suppressed = (!class_aware || dets[k].label == dets[i].label) && iou(&dets[k], &dets[i]) > iou_thr;
+        }
+        if(!suppressed){
+            dets[kept++] = dets[i];
+        }
+    }
+    return kept;
+}
+
+// Boxes around a few centers so many overlap, some spanning most of the image, some degenerate. Confidences are
+// distinct, or with levels > 0 only that many different values.
+static void random_boxes(Detection dets[], int n, int labels, int levels){
+    float centers[5][2];
+    for(int c = 0; c < 5; c++){
+        centers[c][0] = random_unit();
+        centers[c][1] = random_unit();
+    }
+    for(int i = 0; i < n; i++){
+        const float* center = centers[next_random() % 5];
+        float size = next_random() % 10 == 0 ? 0.8f * random_unit() : 0.15f * random_unit();
+        float x = center[0] + 0.1f * (random_unit() - 0.5f);
+        float y = center[1] + 0.1f * (random_unit() - 0.5f);
+        Detection* det = &dets[i];
+        memset(det, 0, sizeof(*det));
+        det->label = (float) (next_random() % labels);
+        det->confidence = levels > 0 ? (float) (1 + next_random() % levels) / levels : (float) (n - i) / n;
+        det->x_min = fmaxf(0.f, x - size);
+        det->y_min = fmaxf(0.f, y - (next_random() % 20 == 0 ? 0.f : size));
+        det->x_max = fminf(1.f, x + size);
+        det->y_max = fminf(1.f, y + size);
+    }
+    // shuffled, the input order isn't sorted
+    for(int i = n - 1; i > 0; i--){
+        int j = next_random() % (i + 1);
+        Detection tmp = dets[i];
+        dets[i] = dets[j];
+        dets[j] = tmp;
+    }
+}
+
+// The grid path, taken from 32 boxes on, keeps the same boxes in the same order as pairwise NMS, ties in input order
+static void test_grid_matches_pairwise(){
+    const int counts[] = {31, 32, 33, 64, 150, MAX_BOXES};
+    const float thresholds[] = {0.f, 0.3f, 0.5f, 0.9f};
+    int mismatches = 0;
+
+    for(int round = 0; round < 20; round++){
+        for(size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++){
+            for(size_t t = 0; t < sizeof(thresholds) / sizeof(thresholds[0]); t++){
+                for(int class_aware = 0; class_aware < 2; class_aware++){
+                    Detection input[MAX_BOXES], expected[MAX_BOXES];
+                    random_boxes(input, counts[c], 3, round % 2 == 0 ? 0 : 4);
+                    memcpy(expected, input, counts[c] * sizeof(Detection));
+
+                    int expected_nr = reference_nms(expected, counts[c], thresholds[t], class_aware);
+                    int kept = nms_detections(input, counts[c], thresholds[t], class_aware);
+                    if(kept != expected_nr || memcmp(input, expected, kept * sizeof(Detection)) != 0){
+                        mismatches++;
+                    }
+                }
+            }
+        }
+    }
+    CHECK(mismatches == 0);
+}
+
+// Identical boxes keep only the most confident one, boxes in one point don't break the grid
+static void test_degenerate_sets(){
+    Detection dets[64];
+    for(int i = 0; i < 64; i++){
+        memset(&dets[i], 0, sizeof(Detection));
+        dets[i].confidence = (float) (i + 1) / 64;
+        dets[i].x_min = 0.25f;
+        dets[i].y_min = 0.25f;
+        dets[i].x_max = 0.5f;
+        dets[i].y_max = 0.5f;
+    }
+    CHECK(nms_detections(dets, 64, 0.5f, 0) == 1);
+    CHECK(dets[0].confidence == 1.f);
+
+    for(int i = 0; i < 64; i++){
+        memset(&dets[i], 0, sizeof(Detection));
+        dets[i].confidence = (float) (i + 1) / 64;
+        dets[i].x_min = dets[i].x_max = 0.5f;
+        dets[i].y_min = dets[i].y_max = 0.5f;
+    }
+    // zero area boxes never overlap
+    CHECK(nms_detections(dets, 64, 0.5f, 0) == 64);
+    CHECK(dets[0].confidence == 1.f && dets[63].confidence == 1.f / 64);
+}
+
+int main(){
+    test_grid_matches_pairwise();
+    test_degenerate_sets();
+    return TEST_RESULT();
+}
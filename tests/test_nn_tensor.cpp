@@ -0,0 +1,114 @@
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "float16.h"
+#include "nn_tensor.hpp"
+#include "sim_device.hpp"
+#include "test_util.h"
+
+static const uint32_t SCORES_OFFSET = 300;
+static const uint32_t SCORES_COUNT = 500;
+
+static dai::TensorInfo tensor(const char* name, dai::TensorInfo::DataType type, std::vector<unsigned> dims, unsigned offset){
+    dai::TensorInfo info = {};
+    info.name = name;
+    info.dataType = type;
+    info.dims = dims;
+    info.numDimensions = dims.size();
+    info.offset = offset;
+    return info;
+}
+
+// Two layers: 4x7 FP16 boxes at the start, 500 U8 scores from an offset which isn't packet aligned
+static void add_nn_message(SimDevice& device, int64_t sequence_num){
+    dai::RawNNData nn_data;
+    nn_data.sequenceNum = sequence_num;
+    nn_data.tensors.push_back(tensor("boxes", dai::TensorInfo::DataType::FP16, {4, 7}, 0));
+    nn_data.tensors.push_back(tensor("scores", dai::TensorInfo::DataType::U8F, {SCORES_COUNT}, SCORES_OFFSET));
+
+    std::vector<uint8_t> data(SCORES_OFFSET + SCORES_COUNT);
+    for(uint32_t i = 0; i < 28; i++){
+        uint16_t half = f32_to_f16(i * 0.25f + sequence_num);
+        memcpy(&data[i * 2], &half, sizeof(half));
+    }
+    for(uint32_t i = 0; i < SCORES_COUNT; i++){
+        data[SCORES_OFFSET + i] = (uint8_t) (i * 7 + sequence_num);
+    }
+    device.add_message("nn", data, nn_data);
+}
+
+// Only the layer's byte range is fetched, the layout is read from the first metadata and kept
+static void test_layer_offsets(){
+    SimDevice device;
+    dai::SpiApi api;
+    device.attach(api);
+    add_nn_message(device, 0);
+
+    dai::NNTensorIndex index(api);
+    dai::Data data;
+    dai::TensorView view;
+    CHECK(index.req_layer("nn", "scores", &data, &view));
+    typedef std::vector<std::pair<uint32_t, uint32_t>> Ranges;
+    CHECK(device.partial_requests == Ranges({{SCORES_OFFSET, SCORES_COUNT}}));
+    CHECK(view.valid() && view.byte_size() == SCORES_COUNT && view.is_dense());
+    int mismatches = 0;
+    for(uint32_t i = 0; i < SCORES_COUNT; i++){
+        mismatches += view.get_flat(i) != (uint8_t) (i * 7);
+    }
+    CHECK(mismatches == 0);
+    free(data.data);
+
+    CHECK(index.req_layer("nn", "boxes", &data, &view));
+    CHECK(device.partial_requests.back() == std::make_pair(0u, 56u));
+    CHECK(view.get({1, 2}) == 9 * 0.25f && view.get({3, 6}) == 27 * 0.25f);
+    free(data.data);
+    CHECK(device.commands[GET_METADATA] == 1);
+
+    CHECK(!index.req_layer("nn", "missing", &data, &view));
+    CHECK(device.partial_requests.size() == 2);
+
+    // the view of a whole message finds the same bytes
+    dai::Message msg;
+    CHECK(api.req_message(&msg, "nn"));
+    CHECK(index.view(msg, "nn", "scores", &view));
+    CHECK(view.data() == msg.raw_data.data + SCORES_OFFSET && view.get_flat(3) == 21);
+    api.free_message(&msg);
+}
+
+// A layer fetch followed by the whole message reads the metadata twice, that's neither a duplicate nor a gap
+static void test_layer_then_message_sequence(){
+    SimDevice device;
+    dai::SpiApi api;
+    device.attach(api);
+    for(int64_t sequence_num = 0; sequence_num < 4; sequence_num++){
+        add_nn_message(device, sequence_num);
+    }
+
+    dai::NNTensorIndex index(api);
+    for(int64_t sequence_num = 0; sequence_num < 4; sequence_num++){
+        // the layout is read again from each message's metadata
+        index.invalidate("nn");
+        dai::Data data;
+        dai::TensorView view;
+        CHECK(index.req_layer("nn", "boxes", &data, &view));
+        CHECK(view.get_flat(0) == sequence_num);
+        free(data.data);
+
+        dai::Message msg;
+        CHECK(api.req_message(&msg, "nn"));
+        api.free_message(&msg);
+        api.spi_pop_message("nn");
+    }
+
+    dai::StreamStats stats = api.get_stream_stats("nn");
+    CHECK(stats.duplicates == 0 && stats.reorders == 0);
+    CHECK(stats.sequence_gaps == 0 && stats.missed_messages == 0);
+    CHECK(stats.last_sequence_num == 3);
+}
+
+int main(){
+    test_layer_offsets();
+    test_layer_then_message_sequence();
+    return TEST_RESULT();
+}
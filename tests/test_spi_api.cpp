@@ -0,0 +1,541 @@
+#include <chrono>
+#include <cstdlib>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "float16.h"
+#include "sim_device.hpp"
+#include "spi_api.hpp"
+#include "test_util.h"
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static std::vector<uint8_t> pattern(uint32_t size, uint32_t seed){
+    std::vector<uint8_t> data(size);
+    for(uint32_t i = 0; i < size; i++){
+        data[i] = (uint8_t) ((i * 31 + seed * 7 + (i >> 8)) & 0xFF);
+    }
+    return data;
+}
+
+static dai::RawImgFrame frame(int64_t sequence_num){
+    dai::RawImgFrame msg;
+    msg.sequenceNum = sequence_num;
+    msg.ts.sec = sequence_num;
+    return msg;
+}
+
+// A packet missing its first bytes shifts every packet after it, the rest of the message is refetched
+static void test_lost_packet_is_refetched(){
+    SimDevice device;
+    dai::SpiApi api;
+    device.attach(api);
+
+    std::vector<uint8_t> data = pattern(10 * PAYLOAD_MAX_SIZE, 1);
+    device.add_message("out", data, frame(0));
+    // packet 0 is the GET_SIZE response, packet 3 the third packet of the message
+    device.fault = [](std::vector<uint8_t>& packet, int index){
+        if(index == 3){
+            packet.erase(packet.begin(), packet.begin() + 40);
+        }
+    };
+
+    dai::Data received = {0, nullptr};
+    CHECK(api.req_data(&received, "out"));
+    CHECK(received.size == data.size() && memcmp(received.data, data.data(), data.size()) == 0);
+    CHECK(device.partial_requests.size() == 1);
+    if(!device.partial_requests.empty()){
+        CHECK(device.partial_requests[0].first == 2 * PAYLOAD_MAX_SIZE);
+        CHECK(device.partial_requests[0].second == 8 * PAYLOAD_MAX_SIZE);
+    }
+    dai::LinkStats stats = api.get_link_stats();
+    CHECK(stats.lost_bursts >= 1);
+    CHECK(device.pending_bytes() == 0);
+    free(received.data);
+}
+
+// The error budget covers the whole message, not each window or refetch. A failed transfer leaves the link idle.
+static void test_error_budget_spans_windows(){
+    for(uint32_t max_errors : {2, 20}){
+        SimDevice device;
+        dai::SpiApi api;
+        device.attach(api);
+        dai::RetryPolicy policy;
+        policy.max_errors = max_errors;
+        api.set_retry_policy(policy);
+
+        std::vector<uint8_t> data = pattern(8 * PAYLOAD_MAX_SIZE, 2);
+        device.add_message("out", data, frame(0));
+        // one packet in each of the last three windows has a bad CRC, each window is then repaired with one more
+        // packet: 1 2 | 3 4 5 | 6 7 8 | 9 10 11
+        device.fault = [](std::vector<uint8_t>& packet, int index){
+            if(index == 3 || index == 6 || index == 9){
+                packet[SPI_PKT_SIZE - 3] ^= 0x01;
+            }
+        };
+
+        dai::TransferControl control;
+        control.window_size = 2 * PAYLOAD_MAX_SIZE;
+        dai::Message msg;
+        bool received = api.req_message(&msg, "out", control);
+        CHECK(received == (max_errors == 20));
+        CHECK(device.pending_bytes() == 0);
+        if(received){
+            CHECK(msg.raw_data.size == data.size() && memcmp(msg.raw_data.data, data.data(), data.size()) == 0);
+            api.free_message(&msg);
+        }
+    }
+}
+
+// fetches the front message of "out" and returns the first byte of its data, -1 if the fetch failed
+static int fetch_first_byte(dai::SpiApi& api){
+    dai::Message msg;
+    if(!api.req_message(&msg, "out")){
+        return -1;
+    }
+    int first = msg.raw_data.size > 0 ? msg.raw_data.data[0] : -1;
+    api.free_message(&msg);
+    api.spi_pop_message("out");
+    return first;
+}
+
+// A kept message which is deferred by the stream's budget stays kept when the fetch is retried
+static void test_decimation_survives_deferred_fetch(){
+    for(int time_based = 0; time_based < 2; time_based++){
+        SimDevice device;
+        dai::SpiApi api;
+        device.attach(api);
+        for(int i = 0; i < 4; i++){
+            device.add_message("out", std::vector<uint8_t>(PAYLOAD_MAX_SIZE, (uint8_t) i), frame(i));
+        }
+        if(time_based){
+            api.set_stream_min_interval("out", 500);    // messages are a second apart, all are kept
+        } else {
+            api.set_stream_decimation("out", 2);        // keeps 0 and 2
+        }
+        api.set_stream_budget("out", 1, PAYLOAD_MAX_SIZE, dai::OverBudgetAction::DEFER);
+
+        CHECK(fetch_first_byte(api) == 0);
+        if(!time_based){
+            CHECK(fetch_first_byte(api) == -1);         // 1 is skipped and popped
+        }
+        // out of tokens now, the next kept message is deferred however often it's retried
+        CHECK(fetch_first_byte(api) == -1);
+        CHECK(fetch_first_byte(api) == -1);
+        api.clear_stream_budget("out");
+        CHECK(fetch_first_byte(api) == (time_based ? 1 : 2));
+    }
+}
+
+// Messages popped by the host's decimation aren't counted as missed, only the one the device dropped
+static void test_host_pops_are_not_missed(){
+    SimDevice device;
+    dai::SpiApi api;
+    device.attach(api);
+    for(int64_t sequence_num : {0, 1, 2, 3, 5, 6, 7}){
+        device.add_message("out", std::vector<uint8_t>(16, (uint8_t) sequence_num), frame(sequence_num));
+    }
+    api.set_stream_decimation("out", 3);
+
+    std::vector<int> kept;
+    while(!device.streams["out"].empty()){
+        int first = fetch_first_byte(api);
+        if(first >= 0){
+            kept.push_back(first);
+        }
+    }
+    CHECK(kept == std::vector<int>({0, 3, 7}));
+
+    dai::StreamStats stats = api.get_stream_stats("out");
+    CHECK(stats.skipped == 4);
+    CHECK(stats.missed_messages == 1);
+    CHECK(stats.sequence_gaps == 1);
+    CHECK(stats.last_sequence_num == 7);
+    CHECK(api.get_link_stats().missed_messages == 1);
+}
+
+// Reading a message's metadata and then the whole message counts its sequence number once, only a later message with
+// the same number is a duplicate
+static void test_reread_is_not_duplicate(){
+    SimDevice device;
+    dai::SpiApi api;
+    device.attach(api);
+    for(int64_t sequence_num : {0, 1, 1, 3, 2}){
+        device.add_message("out", std::vector<uint8_t>(16, (uint8_t) sequence_num), frame(sequence_num));
+    }
+
+    while(!device.streams["out"].empty()){
+        for(int read = 0; read < 2; read++){
+            dai::Metadata meta;
+            CHECK(api.req_metadata(&meta, "out"));
+            free(meta.data);
+        }
+        dai::Message msg;
+        CHECK(api.req_message(&msg, "out"));
+        api.free_message(&msg);
+        api.spi_pop_message("out");
+    }
+
+    dai::StreamStats stats = api.get_stream_stats("out");
+    CHECK(stats.duplicates == 1);
+    CHECK(stats.reorders == 1);
+    CHECK(stats.sequence_gaps == 1 && stats.missed_messages == 1);
+    CHECK(stats.last_sequence_num == 3);
+}
+
+static dai::RawImgFrame upload(uint32_t size, uint32_t seed){
+    dai::RawImgFrame msg = frame(seed);
+    msg.data = pattern(size, seed);
+    return msg;
+}
+
+// Pipelined sends stream each payload right after its SEND_DATA, statuses are collected on later transfers
+static void test_pipelined_send(){
+    SimDevice device;
+    dai::SpiApi api;
+    device.attach(api);
+    device.tag_send_status = true;
+    api.set_send_credits(2);
+
+    for(uint32_t i = 0; i < 4; i++){
+        CHECK(api.send_message_pipelined(upload(600 + i, i), "in"));
+        CHECK(api.get_pending_sends() <= 2);
+        // only the first send waits for the answer to its SEND_DATA
+        device.ack_send_data = false;
+    }
+    CHECK(api.flush_sends());
+    CHECK(device.received.size() == 4);
+    for(uint32_t i = 0; i < device.received.size(); i++){
+        CHECK(device.received[i].data == pattern(600 + i, i));
+        CHECK(device.received[i].meta == SimDevice::serialize(frame(i)));
+    }
+    dai::SendStats stats = api.get_send_stats();
+    CHECK(stats.sent == 4 && stats.acked == 4 && stats.failed == 0 && stats.refused == 0);
+}
+
+// A refused upload is still streamed, the device reads and drops it and reports it failed
+static void test_pipelined_send_refused(){
+    SimDevice device;
+    dai::SpiApi api;
+    device.attach(api);
+    device.tag_send_status = true;
+    device.send_data_status = SPI_MSG_FAIL_RESP;
+    api.set_send_credits(2);
+
+    for(uint32_t i = 0; i < 3; i++){
+        CHECK(api.send_message_pipelined(upload(2000, i), "in"));
+    }
+    CHECK(!api.flush_sends());
+    CHECK(device.commands[SEND_DATA] == 3);
+    CHECK(device.commands.size() == 1);
+    CHECK(device.received.empty());
+    dai::SendStats stats = api.get_send_stats();
+    CHECK(stats.sent == 3 && stats.refused == 3 && stats.failed == 3 && stats.acked == 0);
+    CHECK(api.get_pending_sends() == 0);
+}
+
+// Firmware which doesn't tag its statuses gets plain sends, a refused one streams nothing
+static void test_pipelined_send_untagged(){
+    SimDevice device;
+    dai::SpiApi api;
+    device.attach(api);
+    api.set_send_credits(2);
+
+    for(uint32_t i = 0; i < 3; i++){
+        CHECK(api.send_message_pipelined(upload(600, i), "in"));
+    }
+    CHECK(api.get_pending_sends() == 0);
+    CHECK(api.flush_sends());
+    CHECK(device.received.size() == 3);
+    CHECK(device.commands[SEND_DATA] == 3 && device.commands.size() == 1);
+    dai::SendStats stats = api.get_send_stats();
+    CHECK(stats.sent == 0 && stats.refused == 0 && stats.acked == 0);
+
+    device.send_data_status = SPI_MSG_FAIL_RESP;
+    CHECK(!api.send_message_pipelined(upload(2000, 3), "in"));
+    CHECK(device.commands[SEND_DATA] == 4 && device.commands.size() == 1);
+    CHECK(device.received.size() == 3);
+}
+
+// A device which stops reporting is given up on after the status timeout
+static void test_pipelined_send_timeout(){
+    SimDevice device;
+    dai::SpiApi api;
+    device.attach(api);
+    device.tag_send_status = true;
+    api.set_send_credits(1, 50);
+
+    CHECK(api.send_message_pipelined(upload(100, 0), "in"));
+    device.tag_send_status = false;
+    CHECK(api.send_message_pipelined(upload(100, 1), "in"));
+    auto start = std::chrono::steady_clock::now();
+    CHECK(!api.send_message_pipelined(upload(100, 2), "in"));
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    CHECK(elapsed >= std::chrono::milliseconds(50) && elapsed < std::chrono::milliseconds(1000));
+    CHECK(api.get_pending_sends() == 1);
+    CHECK(api.get_send_stats().credit_waits == 2);
+    CHECK(device.received.size() == 2);
+}
+
+struct ProducerState {
+    uint32_t fail_at;                       // offset at which the producer gives up
+    std::set<std::thread::id> threads;
+};
+
+static bool produce(void* ctx, uint8_t* chunk, uint32_t offset, uint32_t size){
+    ProducerState* state = static_cast<ProducerState*>(ctx);
+    state->threads.insert(std::this_thread::get_id());
+    if(offset >= state->fail_at){
+        return false;
+    }
+    std::vector<uint8_t> data = pattern(offset + size, 3);
+    memcpy(chunk, data.data() + offset, size);
+    return true;
+}
+
+// Chunks come from one producer thread. A producer failing on the first chunk sends nothing, a later failure leaves
+// the rest of the upload outstanding.
+static void test_chunked_send(){
+    const uint32_t size = 10 * PAYLOAD_MAX_SIZE + 17;
+    const uint32_t meta_size = SimDevice::serialize(frame(5)).size();
+    for(uint32_t fail_at : {size, 0u, 4u * PAYLOAD_MAX_SIZE}){
+        SimDevice device;
+        dai::SpiApi api;
+        device.attach(api);
+        ProducerState state = {fail_at, {}};
+        api.set_chunk_producer_cb(&produce, &state);
+
+        bool sent = api.send_message_chunked(frame(5), size, "in", 2 * PAYLOAD_MAX_SIZE);
+        CHECK(sent == (fail_at == size));
+        CHECK(state.threads.size() == 1);
+        CHECK(state.threads.count(std::this_thread::get_id()) == 0);
+        CHECK(device.dropped_uploads == 0);
+        if(sent){
+            CHECK(device.received.size() == 1 && device.received[0].data == pattern(size, 3));
+        } else {
+            CHECK(device.received.empty());
+            CHECK(device.commands[SEND_DATA] == (fail_at == 0 ? 0 : 1));
+            // no padding to the announced size
+            CHECK(device.upload_pending() == (fail_at == 0 ? 0 : size + meta_size - fail_at));
+        }
+        if(device.upload_pending() == 0){
+            // in step with the device, the next command is answered
+            uint32_t queued = 0;
+            device.add_message("out", std::vector<uint8_t>(5), frame(0));
+            CHECK(api.req_data_size("out", &queued) && queued == 5);
+        }
+    }
+}
+
+// floats are sent as halves, packet by packet, followed by the metadata
+static void test_send_f16(){
+    SimDevice device;
+    dai::SpiApi api;
+    device.attach(api);
+
+    std::vector<float> values(300);
+    std::vector<uint8_t> expected(values.size() * 2);
+    for(size_t i = 0; i < values.size(); i++){
+        values[i] = (float) i * 0.37f - 40.f;
+        uint16_t half = f32_to_f16(values[i]);
+        memcpy(&expected[i * 2], &half, 2);
+    }
+    CHECK(api.send_message_f16(frame(9), values.data(), values.size(), "in"));
+    CHECK(device.received.size() == 1);
+    if(!device.received.empty()){
+        CHECK(device.received[0].data == expected);
+        CHECK(device.received[0].meta == SimDevice::serialize(frame(9)));
+    }
+}
+
+struct CancelState {
+    dai::CancellationToken token;
+    uint32_t received;
+    uint32_t cancel_after;      // bytes
+};
+
+static void cancel_after_bytes(void* ctx, void*, uint32_t chunk_size, uint32_t){
+    CancelState* state = static_cast<CancelState*>(ctx);
+    state->received += chunk_size;
+    if(state->received >= state->cancel_after){
+        state->token.cancel();
+    }
+}
+
+// A cancel stops at the end of the current window, or right after the packet with a window size of 0. Either way the
+// link is left in step and the message stays on the device.
+static void test_cancel_stops_at_window(){
+    for(uint32_t window : {0u, 2u * PAYLOAD_MAX_SIZE}){
+        SimDevice device;
+        dai::SpiApi api;
+        device.attach(api);
+        device.add_message("out", pattern(10 * PAYLOAD_MAX_SIZE, 4), frame(0));
+
+        CancelState state;
+        state.received = 0;
+        state.cancel_after = 3 * PAYLOAD_MAX_SIZE;
+        api.set_chunk_packet_cb(&cancel_after_bytes, &state);
+
+        dai::TransferControl control;
+        control.token = &state.token;
+        control.window_size = window;
+        CHECK(!api.chunk_message("out", control));
+        // the fourth packet is part of the second window, it's drained but not delivered
+        CHECK(state.received == 3 * PAYLOAD_MAX_SIZE);
+        CHECK(device.partial_requests.size() == (window == 0 ? 3u : 2u));
+        CHECK(device.pending_bytes() == 0);
+        CHECK(api.get_link_stats().aborted_transfers == 1);
+
+        uint32_t size = 0;
+        CHECK(api.req_data_size("out", &size) && size == 10 * PAYLOAD_MAX_SIZE);
+    }
+}
+
+static std::vector<std::pair<std::string, std::vector<uint8_t>>> interleaved;
+
+static void on_interleaved(dai::Message* msg, const char* stream_name){
+    interleaved.push_back({stream_name, std::vector<uint8_t>(msg->raw_data.data, msg->raw_data.data + msg->raw_data.size)});
+}
+
+// A small message is fetched in between the windows of a large one, with one GET_SIZE per check
+static void test_interleaved_small_stream(){
+    SimDevice device;
+    dai::SpiApi api;
+    device.attach(api);
+    std::vector<uint8_t> big = pattern(10 * PAYLOAD_MAX_SIZE, 5);
+    std::vector<uint8_t> small = pattern(40, 6);
+    device.add_message("big", big, frame(0));
+    device.add_message("small", small, frame(0));
+
+    interleaved.clear();
+    api.set_interleave_window(2 * PAYLOAD_MAX_SIZE);
+    api.add_interleaved_stream("small", 100);
+    api.set_interleaved_message_cb(&on_interleaved);
+
+    dai::Message msg;
+    CHECK(api.req_message(&msg, "big"));
+    CHECK(msg.raw_data.size == big.size() && memcmp(msg.raw_data.data, big.data(), big.size()) == 0);
+    api.free_message(&msg);
+
+    CHECK(interleaved.size() == 1);
+    if(!interleaved.empty()){
+        CHECK(interleaved[0].first == "small" && interleaved[0].second == small);
+    }
+    CHECK(device.streams["small"].empty());
+    CHECK(device.streams["big"].size() == 1);
+    // one for the large message, then one per window boundary for the small stream
+    CHECK(device.commands[GET_SIZE] == 5);
+    CHECK(device.partial_requests.size() == 5);
+    CHECK(api.get_link_stats().interleaved_messages == 1);
+}
+
+// A stream may go one message into debt, then fetches are refused until the bucket refills. Over budget messages are
+// either left on the device or popped without transfer.
+static void test_stream_budget(){
+    for(dai::OverBudgetAction action : {dai::OverBudgetAction::DEFER, dai::OverBudgetAction::DECIMATE}){
+        SimDevice device;
+        dai::SpiApi api;
+        device.attach(api);
+        for(int i = 0; i < 5; i++){
+            device.add_message("out", std::vector<uint8_t>(400, (uint8_t) i), frame(i));
+        }
+        api.set_stream_budget("out", 10000, 500, action);
+
+        CHECK(fetch_first_byte(api) == 0);      // 500 tokens
+        CHECK(fetch_first_byte(api) == 1);      // 100 tokens, goes into debt
+        CHECK(fetch_first_byte(api) == -1);     // -300 tokens
+        int get_messages = device.commands[GET_MESSAGE];
+        dai::StreamStats stats = api.get_stream_stats("out");
+        CHECK(stats.messages_fetched == 2 && stats.bytes_fetched >= 800);
+        if(action == dai::OverBudgetAction::DEFER){
+            CHECK(stats.deferred == 1 && stats.decimated == 0);
+            CHECK(device.streams["out"].size() == 3);
+        } else {
+            CHECK(stats.deferred == 0 && stats.decimated == 1);
+            CHECK(device.streams["out"].size() == 2);
+        }
+
+        // refilled up to the burst size
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        CHECK(fetch_first_byte(api) == (action == dai::OverBudgetAction::DEFER ? 2 : 3));
+        CHECK(device.commands[GET_MESSAGE] == get_messages + 1);
+        CHECK(api.get_stream_stats("out").budget_bytes_per_second == 10000);
+
+        api.clear_stream_budget("out");
+        CHECK(fetch_first_byte(api) >= 0);
+    }
+}
+
+#if defined(__linux__)
+static std::string temp_file(const std::vector<uint8_t>& data){
+    char path[] = "/tmp/test_spi_api_XXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    CHECK(write(fd, data.data(), data.size()) == (ssize_t) data.size());
+    close(fd);
+    return path;
+}
+
+// Files are sent from a mapping, a file which can't be opened or mapped sends nothing
+static void test_send_mapped(){
+    SimDevice device;
+    dai::SpiApi api;
+    device.attach(api);
+
+    std::string empty = temp_file({});
+    std::string file = temp_file(pattern(3 * PAYLOAD_MAX_SIZE + 5, 7));
+
+    CHECK(!api.send_file("/nonexistent/file", "in"));
+    CHECK(!api.send_file(-1, "in"));
+    // write only, can't be mapped for reading
+    int fd = open(file.c_str(), O_WRONLY);
+    CHECK(!api.send_file(fd, "in"));
+    close(fd);
+    // an empty upload has nothing to announce
+    CHECK(!api.send_file(empty.c_str(), "in"));
+    CHECK(device.commands.empty());
+
+    CHECK(api.send_message_file(frame(1), empty.c_str(), "in"));
+    CHECK(api.send_file(file.c_str(), "in"));
+    fd = open(file.c_str(), O_RDONLY);
+    CHECK(api.send_message_file(frame(2), fd, "in"));
+    close(fd);
+
+    CHECK(device.commands[SEND_DATA] == 3);
+    CHECK(device.received.size() == 3);
+    if(device.received.size() == 3){
+        CHECK(device.received[0].data.empty() && device.received[0].meta == SimDevice::serialize(frame(1)));
+        CHECK(device.received[1].data == pattern(3 * PAYLOAD_MAX_SIZE + 5, 7) && device.received[1].meta.empty());
+        CHECK(device.received[2].data == pattern(3 * PAYLOAD_MAX_SIZE + 5, 7));
+        CHECK(device.received[2].meta == SimDevice::serialize(frame(2)));
+    }
+    unlink(empty.c_str());
+    unlink(file.c_str());
+}
+#endif
+
+int main(){
+    test_lost_packet_is_refetched();
+    test_error_budget_spans_windows();
+    test_decimation_survives_deferred_fetch();
+    test_host_pops_are_not_missed();
+    test_reread_is_not_duplicate();
+    test_pipelined_send();
+    test_pipelined_send_refused();
+    test_pipelined_send_untagged();
+    test_pipelined_send_timeout();
+    test_chunked_send();
+    test_send_f16();
+#if defined(__linux__)
+    test_send_mapped();
+#endif
+    test_cancel_stops_at_window();
+    test_interleaved_small_stream();
+    test_stream_budget();
+    return TEST_RESULT();
+}
@@ -0,0 +1,72 @@
+#include <string.h>
+
+#include "spi_capture.h"
+#include "spi_messaging.h"
+#include "test_util.h"
+
+#define CAPTURE_PATH "test_spi_capture.bin"
+
+static char last_sent[SPI_PKT_SIZE];
+static int sends = 0;
+
+static uint8_t fake_send(const char* sendbuf){
+    memcpy(last_sent, sendbuf, SPI_PKT_SIZE);
+    sends++;
+    return 1;
+}
+
+static uint8_t fake_recv(char* recvbuf){
+    for(int i = 0; i < SPI_PKT_SIZE; i++){
+        recvbuf[i] = (char) (i * 7);
+    }
+    return 1;
+}
+
+int main(){
+    char packet[SPI_PKT_SIZE];
+    char received[SPI_PKT_SIZE];
+    for(int i = 0; i < SPI_PKT_SIZE; i++){
+        packet[i] = (char) i;
+    }
+
+    // nothing to wrap yet
+    CHECK(spi_capture_send_spi(packet) == 0);
+    CHECK(spi_capture_recv_spi(received) == 0);
+    CHECK(spi_capture_transfer_spi(packet, sizeof(packet), received, sizeof(received)) == 0);
+
+    CHECK(spi_capture_start(CAPTURE_PATH, fake_send, fake_recv, NULL));
+    CHECK(spi_capture_send_spi(packet) == 1);
+    CHECK(sends == 1 && memcmp(last_sent, packet, SPI_PKT_SIZE) == 0);
+    CHECK(spi_capture_recv_spi(received) == 1);
+    // no transfer wrapped
+    CHECK(spi_capture_transfer_spi(packet, sizeof(packet), received, sizeof(received)) == 0);
+    spi_capture_stop();
+
+    char expected[SPI_PKT_SIZE];
+    fake_recv(expected);
+
+    SpiReplayStats stats;
+    CHECK(spi_replay_open(CAPTURE_PATH, 0));
+    CHECK(spi_replay_send_spi(packet) == 1);
+    memset(received, 0, sizeof(received));
+    CHECK(spi_replay_recv_spi(received) == 1);
+    CHECK(memcmp(received, expected, SPI_PKT_SIZE) == 0);
+    // past the end of the recording
+    CHECK(spi_replay_recv_spi(received) == 0);
+    spi_replay_get_stats(&stats);
+    CHECK(stats.records == 2);
+    CHECK(stats.send_mismatches == 0);
+    CHECK(stats.exhausted == 1);
+    spi_replay_close();
+
+    // a different packet than recorded counts as a mismatch
+    packet[10] ^= 1;
+    CHECK(spi_replay_open(CAPTURE_PATH, 0));
+    spi_replay_send_spi(packet);
+    spi_replay_get_stats(&stats);
+    CHECK(stats.send_mismatches == 1);
+    spi_replay_close();
+
+    remove(CAPTURE_PATH);
+    return TEST_RESULT();
+}
@@ -0,0 +1,98 @@
+#include <string.h>
+
+#include "spi_resync.h"
+#include "test_util.h"
+
+static SpiResyncInstance resync;
+static SpiProtocolInstance proto;
+
+static void make_packet(uint8_t* bytes, uint8_t fill){
+    uint8_t payload[SPI_PROTOCOL_PAYLOAD_SIZE];
+    memset(payload, fill, sizeof(payload));
+    SpiProtocolPacket packet;
+    spi_protocol_write_packet(&packet, payload, sizeof(payload));
+    memcpy(bytes, &packet, SPI_PKT_SIZE);
+}
+
+static int feed(const uint8_t* burst, SpiProtocolPacket** packet){
+    return spi_resync_feed(&resync, &proto, burst, SPI_PKT_SIZE, packet);
+}
+
+// aligned packets pass through, a bad CRC is reported as corrupt
+static void test_aligned(){
+    uint8_t a[SPI_PKT_SIZE];
+    SpiProtocolPacket* packet;
+    spi_resync_init(&resync);
+
+    make_packet(a, 0x11);
+    CHECK(feed(a, &packet) == SPI_RESYNC_PACKET);
+    CHECK(packet != NULL && packet->data[0] == 0x11);
+
+    a[10] ^= 0xff;
+    CHECK(feed(a, &packet) == SPI_RESYNC_CORRUPT);
+    CHECK(packet == NULL);
+
+    uint8_t idle[SPI_PKT_SIZE] = {0};
+    CHECK(feed(idle, &packet) == SPI_RESYNC_PENDING);
+}
+
+// A stream shifted by a few bytes: the head of the first packet is gone, so that packet is lost. The ones after it are
+// put back together across bursts.
+static void test_shifted(){
+    enum { PACKETS = 4, SHIFT = 37 };
+    uint8_t stream[PACKETS * SPI_PKT_SIZE];
+    for(int i = 0; i < PACKETS; i++){
+        make_packet(stream + i * SPI_PKT_SIZE, (uint8_t) (0x20 + i));
+    }
+    spi_resync_init(&resync);
+
+    SpiProtocolPacket* packet;
+    // bytes SHIFT.. of packet 0, then the start of packet 1
+    CHECK(feed(stream + SHIFT, &packet) == SPI_RESYNC_LOST);
+    CHECK(packet == NULL);
+
+    // packet 1 completes, then packet 2
+    CHECK(feed(stream + SHIFT + SPI_PKT_SIZE, &packet) == SPI_RESYNC_PACKET);
+    CHECK(packet != NULL && packet->data[0] == 0x21);
+    CHECK(feed(stream + SHIFT + 2 * SPI_PKT_SIZE, &packet) == SPI_RESYNC_PACKET);
+    CHECK(packet != NULL && packet->data[0] == 0x22);
+    CHECK(resync.resynced_packets == 2);
+    CHECK(resync.dropped_bytes > 0);
+}
+
+// garbage in front of a complete frame means a packet went missing before it
+static void test_garbage_before_frame(){
+    uint8_t burst[SPI_PKT_SIZE];
+    uint8_t a[SPI_PKT_SIZE];
+    SpiProtocolPacket* packet;
+    spi_resync_init(&resync);
+
+    // half a burst of noise, held over with the start of the frame
+    make_packet(a, 0x33);
+    memset(burst, 0x5a, 100);
+    memcpy(burst + 100, a, SPI_PKT_SIZE - 100);
+    CHECK(feed(burst, &packet) == SPI_RESYNC_LOST);
+
+    // the rest of the frame, nothing dropped in between
+    memset(burst, 0, sizeof(burst));
+    memcpy(burst, a + SPI_PKT_SIZE - 100, 100);
+    CHECK(feed(burst, &packet) == SPI_RESYNC_PACKET);
+    CHECK(packet != NULL && packet->data[0] == 0x33);
+
+    // A start byte held over which turns out to be noise: the frame found behind it comes back together with the loss
+    spi_resync_init(&resync);
+    memset(burst, 0, sizeof(burst));
+    memset(burst + SPI_PKT_SIZE - 10, 0x5a, 10);
+    burst[SPI_PKT_SIZE - 10] = START_BYTE_MAGIC;
+    CHECK(feed(burst, &packet) == SPI_RESYNC_PENDING);
+    CHECK(feed(a, &packet) == SPI_RESYNC_LOST);
+    CHECK(packet != NULL && packet->data[0] == 0x33);
+}
+
+int main(){
+    spi_protocol_init(&proto);
+    test_aligned();
+    test_shifted();
+    test_garbage_before_frame();
+    return TEST_RESULT();
+}
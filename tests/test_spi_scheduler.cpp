@@ -0,0 +1,75 @@
+#include <string>
+#include <vector>
+
+#include "sim_device.hpp"
+#include "spi_scheduler.hpp"
+#include "test_util.h"
+
+static std::vector<std::string> delivered;
+
+static void on_message(dai::Message*, const char* stream_name){
+    delivered.push_back(stream_name);
+}
+
+static void add_messages(SimDevice& device, const char* stream_name, int count){
+    for(int i = 0; i < count; i++){
+        dai::RawImgFrame frame;
+        frame.sequenceNum = i;
+        device.add_message(stream_name, std::vector<uint8_t>(100, (uint8_t) i), frame);
+    }
+}
+
+// With both streams due, the one with the earlier deadline is serviced until it runs dry
+static void test_earliest_deadline_first(){
+    SimDevice device;
+    dai::SpiApi api;
+    device.attach(api);
+    add_messages(device, "relaxed", 3);
+    add_messages(device, "urgent", 3);
+
+    dai::SpiScheduler scheduler(api);
+    scheduler.set_policy(dai::SchedulePolicy::EARLIEST_DEADLINE_FIRST);
+    scheduler.add_stream("relaxed", 1, 0, 1000, &on_message);
+    scheduler.add_stream("urgent", 1, 0, 10, &on_message);
+
+    delivered.clear();
+    int runs = 0;
+    while(delivered.size() < 6 && runs++ < 100){
+        scheduler.run_once();
+    }
+    CHECK(delivered == std::vector<std::string>({"urgent", "urgent", "urgent", "relaxed", "relaxed", "relaxed"}));
+    CHECK(scheduler.get_stream_stats("urgent").messages == 3);
+    CHECK(scheduler.get_stream_stats("urgent").empty_polls >= 1);
+    CHECK(scheduler.get_stream_stats("relaxed").messages == 3);
+    CHECK(device.streams["urgent"].empty() && device.streams["relaxed"].empty());
+}
+
+// Weighted fair queuing with equal message sizes shares the bus by priority
+static void test_weighted_fair_share(){
+    SimDevice device;
+    dai::SpiApi api;
+    device.attach(api);
+    add_messages(device, "heavy", 100);
+    add_messages(device, "light", 100);
+
+    dai::SpiScheduler scheduler(api);
+    scheduler.set_policy(dai::SchedulePolicy::WEIGHTED_FAIR);
+    scheduler.add_stream("heavy", 3, 0, 1000, &on_message);
+    scheduler.add_stream("light", 1, 0, 1000, &on_message);
+
+    delivered.clear();
+    for(int i = 0; i < 40; i++){
+        CHECK(scheduler.run_once());
+    }
+    uint32_t heavy = scheduler.get_stream_stats("heavy").messages;
+    uint32_t light = scheduler.get_stream_stats("light").messages;
+    CHECK(heavy + light == 40);
+    CHECK(heavy >= 29 && heavy <= 31);
+    CHECK(scheduler.get_stream_stats("heavy").bytes == heavy * scheduler.get_stream_stats("light").bytes / light);
+}
+
+int main(){
+    test_earliest_deadline_first();
+    test_weighted_fair_share();
+    return TEST_RESULT();
+}
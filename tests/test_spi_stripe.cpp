@@ -0,0 +1,97 @@
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "sim_device.hpp"
+#include "spi_stripe.hpp"
+#include "test_util.h"
+
+static std::vector<uint8_t> pattern(uint32_t size, uint32_t seed){
+    std::vector<uint8_t> data(size);
+    for(uint32_t i = 0; i < size; i++){
+        data[i] = (uint8_t) (i * 31 + seed + i / 251);
+    }
+    return data;
+}
+
+// One device seen over two links, both hold the same message
+struct StripedLinks {
+    SimDevice devices[2];
+    dai::SpiApi apis[2];
+    dai::SpiStripedFetch fetch;
+
+    StripedLinks(){
+        for(int i = 0; i < 2; i++){
+            devices[i].attach(apis[i]);
+            fetch.add_link(apis[i]);
+        }
+    }
+
+    void add_message(const std::vector<uint8_t>& data){
+        for(auto& device : devices){
+            device.add_message("out", data, dai::RawImgFrame());
+        }
+    }
+};
+
+// Stripes in whole packets, the last link gets the rest, a partly filled final packet included
+static void test_short_final_stripe(){
+    StripedLinks links;
+    links.fetch.set_min_stripe_size(PAYLOAD_MAX_SIZE);
+    uint32_t size = 5 * PAYLOAD_MAX_SIZE + 100;
+    std::vector<uint8_t> data = pattern(size, 1);
+    links.add_message(data);
+
+    std::vector<uint8_t> buffer(size + 1, 0xee);
+    uint32_t message_size = 0;
+    CHECK(links.fetch.fetch("out", buffer.data(), size, &message_size));
+    CHECK(message_size == size);
+    CHECK(std::equal(data.begin(), data.end(), buffer.begin()) && buffer[size] == 0xee);
+
+    uint32_t first = 2 * PAYLOAD_MAX_SIZE;
+    typedef std::vector<std::pair<uint32_t, uint32_t>> Ranges;
+    CHECK(links.devices[0].partial_requests == Ranges({{0, first}}));
+    CHECK(links.devices[1].partial_requests == Ranges({{first, size - first}}));
+    std::vector<double> goodput = links.fetch.get_link_goodput();
+    CHECK(goodput.size() == 2 && goodput[0] > 0 && goodput[1] > 0);
+
+    // with measured goodput the split moves, the stripes still cover the message
+    std::fill(buffer.begin(), buffer.end(), 0xee);
+    CHECK(links.fetch.fetch("out", buffer.data(), size, &message_size));
+    CHECK(std::equal(data.begin(), data.end(), buffer.begin()) && buffer[size] == 0xee);
+    Ranges ranges;
+    for(auto& device : links.devices){
+        ranges.insert(ranges.end(), device.partial_requests.begin() + 1, device.partial_requests.end());
+    }
+    std::sort(ranges.begin(), ranges.end());
+    uint32_t covered = 0;
+    for(size_t i = 0; i < ranges.size(); i++){
+        CHECK(ranges[i].first == covered);
+        CHECK(i + 1 == ranges.size() || ranges[i].second % PAYLOAD_MAX_SIZE == 0);
+        covered += ranges[i].second;
+    }
+    CHECK(covered == size);
+}
+
+// Small messages go over one link, a message larger than the buffer isn't fetched at all
+static void test_unstriped(){
+    StripedLinks links;
+    uint32_t size = 3 * PAYLOAD_MAX_SIZE;
+    std::vector<uint8_t> data = pattern(size, 2);
+    links.add_message(data);
+
+    std::vector<uint8_t> buffer(size);
+    uint32_t message_size = 0;
+    CHECK(!links.fetch.fetch("out", buffer.data(), size - 1, &message_size));
+    CHECK(links.devices[0].partial_requests.empty() && links.devices[1].partial_requests.empty());
+
+    CHECK(links.fetch.fetch("out", buffer.data(), size, &message_size));
+    CHECK(buffer == data);
+    CHECK(links.devices[0].partial_requests.size() == 1 && links.devices[1].partial_requests.empty());
+}
+
+int main(){
+    test_short_final_stripe();
+    test_unstriped();
+    return TEST_RESULT();
+}
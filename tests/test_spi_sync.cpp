@@ -0,0 +1,122 @@
+#include <vector>
+
+#include "sim_device.hpp"
+#include "spi_sync.hpp"
+#include "test_util.h"
+
+static dai::RawImgFrame frame(int64_t sequence_num, int64_t timestamp_ms){
+    dai::RawImgFrame msg;
+    msg.sequenceNum = sequence_num;
+    msg.ts.sec = timestamp_ms / 1000;
+    msg.ts.nsec = (timestamp_ms % 1000) * 1000000;
+    return msg;
+}
+
+static void add_frame(SimDevice& device, const char* stream_name, int64_t sequence_num, int64_t timestamp_ms = 0){
+    device.add_message(stream_name, std::vector<uint8_t>(8, (uint8_t) sequence_num), frame(sequence_num, timestamp_ms));
+}
+
+// Sequence numbers of the group's messages, -1 if the payload doesn't belong to the metadata
+static std::vector<int64_t> group_sequence(dai::SpiApi& api, std::vector<dai::Message>& group){
+    std::vector<int64_t> sequence;
+    for(auto& msg : group){
+        dai::SequenceInfo info;
+        bool matches = api.parse_sequence_info(&msg.raw_meta, &info) && msg.raw_data.size == 8 && msg.raw_data.data[0] == (uint8_t) info.sequence_num;
+        sequence.push_back(matches ? info.sequence_num : -1);
+    }
+    return sequence;
+}
+
+// Heads behind the newest one are popped without their payload, until every stream holds the same sequence number
+static void test_sequence_groups(){
+    SimDevice device;
+    dai::SpiApi api;
+    device.attach(api);
+    for(int64_t i = 0; i < 4; i++){
+        add_frame(device, "frames", i);
+    }
+    add_frame(device, "dets", 1);
+    add_frame(device, "dets", 3);
+
+    dai::SpiSync sync(api);
+    sync.add_stream("frames");
+    sync.add_stream("dets");
+    std::vector<dai::Message> group;
+    CHECK(sync.get_group(group));
+    CHECK(group_sequence(api, group) == std::vector<int64_t>({1, 1}));
+    sync.free_group(group);
+    CHECK(sync.get_group(group));
+    CHECK(group_sequence(api, group) == std::vector<int64_t>({3, 3}));
+    sync.free_group(group);
+
+    CHECK(!sync.get_group(group) && group.empty());
+    CHECK(sync.get_stats().groups == 2 && sync.get_stats().orphans == 2);
+    CHECK(device.streams["frames"].empty() && device.streams["dets"].empty());
+    // only the grouped payloads were transferred
+    CHECK(device.commands[GET_MESSAGE] == 4);
+}
+
+// Timestamps within the tolerance match, a head older than the newest by more than that is popped
+static void test_timestamp_groups(){
+    SimDevice device;
+    dai::SpiApi api;
+    device.attach(api);
+    add_frame(device, "frames", 0, 0);
+    add_frame(device, "frames", 1, 33);
+    add_frame(device, "dets", 7, 36);
+
+    dai::SpiSync sync(api);
+    sync.set_mode(dai::SyncMode::TIMESTAMP, 5);
+    sync.add_stream("frames");
+    sync.add_stream("dets");
+    std::vector<dai::Message> group;
+    CHECK(sync.get_group(group));
+    CHECK(group_sequence(api, group) == std::vector<int64_t>({1, 7}));
+    sync.free_group(group);
+    CHECK(sync.get_stats().orphans == 1);
+
+    // a late message of the matched stream waits for its partner
+    add_frame(device, "dets", 8, 70);
+    CHECK(!sync.get_group(group));
+    add_frame(device, "frames", 2, 66);
+    CHECK(sync.get_group(group));
+    CHECK(group_sequence(api, group) == std::vector<int64_t>({2, 8}));
+    sync.free_group(group);
+}
+
+// A payload fetch which decimation refuses pops the head, the next group mustn't pair its stale metadata with the
+// message behind it
+static void test_refused_fetch_rereads_heads(){
+    SimDevice device;
+    dai::SpiApi api;
+    device.attach(api);
+    for(int64_t i = 0; i < 3; i++){
+        add_frame(device, "frames", i);
+        add_frame(device, "dets", i);
+    }
+    // frames 1 is skipped
+    api.set_stream_decimation("frames", 2);
+
+    dai::SpiSync sync(api);
+    sync.add_stream("frames");
+    sync.add_stream("dets");
+    std::vector<dai::Message> group;
+    CHECK(sync.get_group(group));
+    CHECK(group_sequence(api, group) == std::vector<int64_t>({0, 0}));
+    sync.free_group(group);
+
+    CHECK(!sync.get_group(group) && group.empty());
+    CHECK(api.get_stream_stats("frames").skipped == 1);
+    CHECK(sync.get_group(group));
+    CHECK(group_sequence(api, group) == std::vector<int64_t>({2, 2}));
+    sync.free_group(group);
+    CHECK(sync.get_stats().orphans == 1);
+    CHECK(device.streams["frames"].empty() && device.streams["dets"].empty());
+}
+
+int main(){
+    test_sequence_groups();
+    test_timestamp_groups();
+    test_refused_fetch_rereads_heads();
+    return TEST_RESULT();
+}
@@ -0,0 +1,294 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "float16.h"
+#include "tensor_kernels.h"
+#include "test_util.h"
+
+#define MAX_VALUES  1000
+
+static uint32_t rng_state = 99;
+
+static uint32_t next_random(void){
+    rng_state = rng_state * 1664525u + 1013904223u;
+    return rng_state >> 8;
+}
+
+// a narrow range so values repeat and ties are common, sometimes any non NaN half, signed zeros included
+static uint16_t random_half(void){
+    for(;;){
+        uint16_t bits = next_random() % 4 == 0 ? (uint16_t) next_random() : f32_to_f16((int) (next_random() % 21) - 10);
+        if((bits & 0x7c00) != 0x7c00 || (bits & 0x03ff) == 0){
+            return bits;
+        }
+    }
+}
+
+static const size_t sizes[] = {0, 1, 7, 8, 9, 15, 16, 17, 33, 100, MAX_VALUES};
+#define SIZES_NR    (sizeof(sizes) / sizeof(sizes[0]))
+
+// Keys are ordered like the values, for every pair of non NaN halves
+static void test_sort_key_order(){
+    int mismatches = 0;
+    for(uint32_t a = 0; a < 0x10000; a += 7){
+        for(uint32_t b = 0; b < 0x10000; b += 13){
+            float fa = f16_to_f32((uint16_t) a), fb = f16_to_f32((uint16_t) b);
+            if(isnan(fa) || isnan(fb)){
+                continue;
+            }
+            int16_t ka = f16_sort_key((uint16_t) a), kb = f16_sort_key((uint16_t) b);
+            mismatches += (ka < kb) != (fa < fb) || (ka == kb) != (fa == fb);
+        }
+    }
+    CHECK(mismatches == 0);
+    CHECK(f16_sort_key(0x7e00) > f16_sort_key(0x7c00));     // NaN past +Inf
+    CHECK(f16_sort_key(0xfe00) < f16_sort_key(0xfc00));     // -NaN past -Inf
+}
+
+static size_t reference_argmax_f16(const uint16_t* data, size_t n){
+    size_t best = 0;
+    for(size_t i = 1; i < n; i++){
+        if(f16_to_f32(data[i]) > f16_to_f32(data[best])){
+            best = i;
+        }
+    }
+    return best;
+}
+
+static size_t reference_argmax_u8(const uint8_t* data, size_t n){
+    size_t best = 0;
+    for(size_t i = 1; i < n; i++){
+        if(data[i] > data[best]){
+            best = i;
+        }
+    }
+    return best;
+}
+
+static void test_argmax(){
+    int mismatches = 0;
+    for(int round = 0; round < 200; round++){
+        for(size_t s = 0; s < SIZES_NR; s++){
+            uint16_t halves[MAX_VALUES];
+            uint8_t bytes[MAX_VALUES];
+            // a small byte range in half the rounds, for ties
+            uint32_t byte_range = round % 2 == 0 ? 256 : 5;
+            for(size_t i = 0; i < sizes[s]; i++){
+                halves[i] = random_half();
+                bytes[i] = (uint8_t) (next_random() % byte_range);
+            }
+            mismatches += argmax_f16(halves, sizes[s]) != reference_argmax_f16(halves, sizes[s]);
+            mismatches += argmax_u8(bytes, sizes[s]) != reference_argmax_u8(bytes, sizes[s]);
+        }
+    }
+    CHECK(mismatches == 0);
+}
+
+// Indices by value, largest first, ties by index. Selection sort, the sizes are small.
+static void reference_order(const float* values, size_t n, uint32_t* order){
+    for(size_t i = 0; i < n; i++){
+        order[i] = (uint32_t) i;
+    }
+    for(size_t i = 0; i < n; i++){
+        size_t best = i;
+        for(size_t j = i + 1; j < n; j++){
+            float a = values[order[j]], b = values[order[best]];
+            if(a > b || (a == b && order[j] < order[best])){
+                best = j;
+            }
+        }
+        uint32_t tmp = order[i];
+        order[i] = order[best];
+        order[best] = tmp;
+    }
+}
+
+static void test_topk(){
+    const size_t ks[] = {0, 1, 3, 64, 65, MAX_VALUES + 1};
+    int mismatches = 0;
+    for(int round = 0; round < 20; round++){
+        for(size_t s = 0; s < SIZES_NR; s++){
+            size_t n = sizes[s];
+            uint16_t halves[MAX_VALUES];
+            uint8_t bytes[MAX_VALUES];
+            float half_values[MAX_VALUES], byte_values[MAX_VALUES];
+            for(size_t i = 0; i < n; i++){
+                halves[i] = random_half();
+                bytes[i] = (uint8_t) (next_random() % (round % 2 == 0 ? 256 : 5));
+                half_values[i] = f16_to_f32(halves[i]);
+                byte_values[i] = bytes[i];
+            }
+            uint32_t half_order[MAX_VALUES], byte_order[MAX_VALUES];
+            reference_order(half_values, n, half_order);
+            reference_order(byte_values, n, byte_order);
+
+            for(size_t t = 0; t < sizeof(ks) / sizeof(ks[0]); t++){
+                size_t expected = ks[t] < n ? ks[t] : n;
+                uint32_t indices[MAX_VALUES];
+                size_t count = topk_f16(halves, n, ks[t], indices);
+                mismatches += count != expected || memcmp(indices, half_order, count * sizeof(uint32_t)) != 0;
+                count = topk_u8(bytes, n, ks[t], indices);
+                mismatches += count != expected || memcmp(indices, byte_order, count * sizeof(uint32_t)) != 0;
+            }
+        }
+    }
+    CHECK(mismatches == 0);
+}
+
+static int softmax_matches(const double* logits, const float* probs, size_t k){
+    double max = logits[0], sum = 0.;
+    for(size_t i = 1; i < k; i++){
+        max = logits[i] > max ? logits[i] : max;
+    }
+    for(size_t i = 0; i < k; i++){
+        sum += exp(logits[i] - max);
+    }
+    for(size_t i = 0; i < k; i++){
+        if(fabs(exp(logits[i] - max) / sum - probs[i]) > 1e-6){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void test_softmax(){
+    int mismatches = 0;
+    for(int round = 0; round < 200; round++){
+        uint16_t halves[64];
+        uint8_t bytes[64];
+        for(int i = 0; i < 64; i++){
+            halves[i] = f32_to_f16((int) (next_random() % 4001 - 2000) / 100.f);
+            bytes[i] = (uint8_t) next_random();
+        }
+        size_t k = 1 + next_random() % 10;
+        uint32_t indices[10];
+        for(size_t i = 0; i < k; i++){
+            indices[i] = next_random() % 64;
+        }
+        float scale = 0.05f + (next_random() % 100) / 1000.f;
+        int32_t zero_point = next_random() % 256;
+
+        double logits[10];
+        float probs[10];
+        for(size_t i = 0; i < k; i++){
+            logits[i] = f16_to_f32(halves[indices[i]]);
+        }
+        softmax_topk_f16(halves, indices, k, probs);
+        mismatches += !softmax_matches(logits, probs, k);
+
+        for(size_t i = 0; i < k; i++){
+            logits[i] = ((double) bytes[indices[i]] - zero_point) * scale;
+        }
+        softmax_topk_u8(bytes, indices, k, scale, zero_point, probs);
+        mismatches += !softmax_matches(logits, probs, k);
+    }
+    CHECK(mismatches == 0);
+}
+
+// every byte value, at every alignment and tail length of the vector loop
+static void test_dequantize(){
+    uint8_t src[256 + 40];
+    for(int i = 0; i < (int) sizeof(src); i++){
+        src[i] = (uint8_t) (i * 37);
+    }
+    int mismatches = 0;
+    for(size_t offset = 0; offset < 16; offset++){
+        for(size_t n = 0; n + offset <= sizeof(src); n += 1 + n / 4){
+            float dst[sizeof(src) + 1];
+            dst[n] = -1.f;
+            dequantize_u8(dst, src + offset, n, 0.125f, 128);
+            for(size_t i = 0; i < n; i++){
+                mismatches += dst[i] != (float) ((int32_t) src[offset + i] - 128) * 0.125f;
+            }
+            mismatches += dst[n] != -1.f;
+        }
+    }
+    CHECK(mismatches == 0);
+}
+
+// Class of each pixel by comparing the floats, ties to the lowest class
+static void reference_class_map(const uint16_t* tensor, SegLayout layout, uint32_t classes, uint32_t pixels, uint8_t* class_map){
+    for(uint32_t p = 0; p < pixels; p++){
+        uint32_t best = 0;
+        for(uint32_t c = 1; c < classes; c++){
+            size_t index = layout == SEG_LAYOUT_HWC ? (size_t) p * classes + c : (size_t) c * pixels + p;
+            size_t best_index = layout == SEG_LAYOUT_HWC ? (size_t) p * classes + best : (size_t) best * pixels + p;
+            if(f16_to_f32(tensor[index]) > f16_to_f32(tensor[best_index])){
+                best = c;
+            }
+        }
+        class_map[p] = (uint8_t) best;
+    }
+}
+
+// Both layouts fed in chunks split at any byte, from odd addresses too, with trailing bytes past the tensor
+static void test_seg_argmax_chunks(){
+    const uint32_t class_counts[] = {1, 3, 21, 256};
+    const uint32_t widths[] = {1, 5, 17};
+    int mismatches = 0;
+
+    for(size_t c = 0; c < sizeof(class_counts) / sizeof(class_counts[0]); c++){
+        for(size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); w++){
+            for(int layout = SEG_LAYOUT_HWC; layout <= SEG_LAYOUT_CHW; layout++){
+                uint32_t classes = class_counts[c], width = widths[w], height = 3, pixels = width * height;
+                size_t values = (size_t) classes * pixels;
+                uint16_t* tensor = malloc(values * sizeof(uint16_t));
+                // one spare byte in front for odd addresses, some behind as trailing data
+                uint8_t* buffer = malloc(values * sizeof(uint16_t) + 8);
+                uint8_t* class_map = malloc(pixels);
+                uint8_t* expected = malloc(pixels);
+                for(size_t i = 0; i < values; i++){
+                    tensor[i] = random_half();
+                }
+                reference_class_map(tensor, (SegLayout) layout, classes, pixels, expected);
+
+                for(int round = 0; round < 10; round++){
+                    uint8_t* bytes = buffer + (round % 2);
+                    memcpy(bytes, tensor, values * sizeof(uint16_t));
+                    memset(bytes + values * sizeof(uint16_t), 0x7b, 4);
+                    size_t total = values * sizeof(uint16_t) + 4;
+
+                    SegArgmaxState state;
+                    memset(class_map, 0xee, pixels);
+                    CHECK(seg_argmax_init(&state, (SegLayout) layout, classes, width, height, class_map));
+                    size_t fed = 0;
+                    while(fed < total){
+                        // mostly small chunks, some empty, some large
+                        size_t chunk = next_random() % 4 == 0 ? next_random() % (2 * classes + 8) : next_random() % 9;
+                        chunk = chunk < total - fed ? chunk : total - fed;
+                        seg_argmax_feed(&state, bytes + fed, chunk);
+                        fed += chunk;
+                        mismatches += seg_argmax_done(&state) != (fed >= values * sizeof(uint16_t));
+                    }
+                    mismatches += memcmp(class_map, expected, pixels) != 0;
+                    seg_argmax_free(&state);
+                }
+                free(tensor);
+                free(buffer);
+                free(class_map);
+                free(expected);
+            }
+        }
+    }
+    CHECK(mismatches == 0);
+
+    SegArgmaxState state;
+    uint8_t class_map[4];
+    CHECK(!seg_argmax_init(&state, SEG_LAYOUT_HWC, 257, 2, 2, class_map));
+    CHECK(!seg_argmax_init(&state, SEG_LAYOUT_CHW, 0, 2, 2, class_map));
+    // width * height past 32 bits
+    CHECK(!seg_argmax_init(&state, SEG_LAYOUT_HWC, 3, 0x10000, 0x10000, class_map));
+    CHECK(!seg_argmax_init(&state, SEG_LAYOUT_CHW, 3, 0x10001, 0xFFFF0, class_map));
+    CHECK(!seg_argmax_init(&state, SEG_LAYOUT_CHW, 3, UINT32_MAX, 2, class_map));
+}
+
+int main(){
+    test_sort_key_order();
+    test_argmax();
+    test_topk();
+    test_softmax();
+    test_dequantize();
+    test_seg_argmax_chunks();
+    return TEST_RESULT();
+}
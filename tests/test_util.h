@@ -0,0 +1,21 @@
+#ifndef SHARED_TEST_UTIL_H
+#define SHARED_TEST_UTIL_H
+
+#include <stdio.h>
+
+// Minimal checks for the host side tests, a test binary returns TEST_RESULT() from main
+static int test_failures = 0;
+
+#define CHECK(cond)                                                             \
+    do                                                                          \
+    {                                                                           \
+        if (!(cond))                                                            \
+        {                                                                       \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);    \
+            test_failures++;                                                    \
+        }                                                                       \
+    } while (0)
+
+#define TEST_RESULT() (test_failures == 0 ? 0 : 1)
+
+#endif